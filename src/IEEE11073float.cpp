@@ -32,91 +32,111 @@
  * \date Jun 14, 2010
  */
 
-#include "main.h"
+#include <string.h>
+#include <math.h>
 #include "IEEE11073float.h"
 
+/** Powers of ten that fit the scaled mantissa of the fast path */
+static const uint32_t pow10_table[8] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000};
+
+/**
+ * @brief Convert a value into an IEEE-11073 32-bit FLOAT
+ * Values that are exactly representable as float and are
+ * within 1 <= |data| <= MDER_FLOAT_MANTISSA_MAX (that includes all
+ * temperatures the MLX90632 can deliver above 1 degree) are converted
+ * with integer arithmetic only. The result is bit-identical to the
+ * generic loop based float2IEEE11073_const(), which is used for all other values.
+ *
+ * @param data value to encode
+ * @param output if not NULL, receives the 4 bytes of the FLOAT (little endian)
+ * @return uint32_t IEEE-11073 FLOAT
+ */
 uint32_t float2IEEE11073(double data, uint8_t output[4])
 {
-	uint32_t result = MDER_NaN;
+	uint64_t bits;
+	memcpy(&bits, &data, sizeof(bits));
 
-	if (isnan(data))
+	uint32_t result;
+	uint32_t biased_exp = (uint32_t)(bits >> 52) & 0x7FF;
+	// Fast path: 1 <= |data| < 2^23 and no bits below float precision
+	if ((biased_exp >= 1023) && (biased_exp < 1023 + 23) && ((bits & 0x1FFFFFFFULL) == 0))
 	{
-		goto finally;
-	} /* else if (data > MDER_FLOAT_MAX) {
-    result = MDER_POSITIVE_INFINITY;
-    goto finally;
-  } else if (data < MDER_FLOAT_MIN) {
-    result = MDER_NEGATIVE_INFINITY;
-    goto finally;
-  } else if (data >= -MDER_FLOAT_EPSILON &&
-    data <= MDER_FLOAT_EPSILON) {
-    result = 0;
-    goto finally;
-  }*/
+		// |data| = mant / 2^shift, mant has 24 significant bits
+		uint32_t mant = (uint32_t)((bits >> 29) & 0x7FFFFF) | 0x800000;
+		uint32_t shift = 1023 + 23 - biased_exp;
+		uint64_t limit = (uint64_t)MDER_FLOAT_MANTISSA_MAX << shift;
 
-	double sgn;
-	sgn = data > 0 ? +1 : -1;
-	double mantissa;
-	mantissa = fabs(data);
-	int32_t exponent;
-	exponent = 0; // Note: 10**x exponent, not 2**x
-
-	// scale up if number is too big
-	while (mantissa > MDER_FLOAT_MANTISSA_MAX)
-	{
-		mantissa /= 10.0;
-		++exponent;
-		if (exponent > MDER_FLOAT_EXPONENT_MAX)
+		if ((uint64_t)mant <= limit)
 		{
-			// argh, should not happen
-			if (sgn > 0)
+			// Number of decimals needed to make the value an integer
+			uint32_t trailing = __builtin_ctz(mant);
+			uint32_t decimals = shift > trailing ? shift - trailing : 0;
+
+			// Number of decimals that still fit into the mantissa
+			uint32_t int_part = mant >> shift;
+			uint32_t digits = 1 + (int_part >= 10) + (int_part >= 100) + (int_part >= 1000) +
+							  (int_part >= 10000) + (int_part >= 100000) + (int_part >= 1000000);
+			uint32_t max_decimals = 7 - digits;
+			if ((uint64_t)mant * pow10_table[max_decimals] > limit)
 			{
-				result = MDER_POSITIVE_INFINITY;
+				max_decimals--;
 			}
-			else
+
+			if (decimals > max_decimals)
 			{
-				result = MDER_NEGATIVE_INFINITY;
+				decimals = max_decimals;
 			}
-			goto finally;
-		}
-	}
 
-	// scale down if number is too small
-	while (mantissa < 1)
-	{
-		mantissa *= 10;
-		--exponent;
-		if (exponent < MDER_FLOAT_EXPONENT_MIN)
+			// Round half away from zero, same as round()
+			uint64_t scaled = (uint64_t)mant * pow10_table[decimals];
+			uint32_t int_mantissa = (uint32_t)((scaled + (1ULL << (shift - 1))) >> shift);
+			if (bits >> 63)
+			{
+				int_mantissa = 0 - int_mantissa;
+			}
+			result = ((0 - decimals) << 24) | (int_mantissa & 0xFFFFFF);
+		}
+		else
 		{
-			// argh, should not happen
-			result = 0;
-			goto finally;
+			result = float2IEEE11073_const(data);
 		}
 	}
-
-	// scale down if number needs more precision
-	double smantissa;
-	smantissa = round(mantissa * MDER_FLOAT_PRECISION);
-	double rmantissa;
-	rmantissa = round(mantissa) * MDER_FLOAT_PRECISION;
-	double mdiff;
-	mdiff = abs(smantissa - rmantissa);
-	while (mdiff > 0.5 && exponent > MDER_FLOAT_EXPONENT_MIN &&
-		   (mantissa * 10) <= MDER_FLOAT_MANTISSA_MAX)
+	else
 	{
-		mantissa *= 10;
-		--exponent;
-		smantissa = round(mantissa * MDER_FLOAT_PRECISION);
-		rmantissa = round(mantissa) * MDER_FLOAT_PRECISION;
-		mdiff = abs(smantissa - rmantissa);
+		result = float2IEEE11073_const(data);
 	}
 
-	uint32_t int_mantissa;
-	int_mantissa = (int)round(sgn * mantissa);
-	result = (exponent << 24) | (int_mantissa & 0xFFFFFF);
-
-finally:
 	if (output)
 		memcpy(output, &result, 4);
 	return result;
-}
\ No newline at end of file
+}
+/**
+ * @brief Pack a list of values as IEEE-11073 FLOAT or SFLOAT (little endian)
+ * SFLOAT halves the payload size. With a mantissa of max. 2045 it still
+ * gives 0.1 degree resolution up to 204.5 degrees and 1 degree above
+ *
+ * @param values values to encode
+ * @param count number of values
+ * @param output buffer for the encoded values, needs 4 (FLOAT) or 2 (SFLOAT) bytes per value
+ * @param use_sfloat if true encode as 16-bit SFLOAT, else as 32-bit FLOAT
+ * @return size_t number of bytes written to output
+ */
+size_t IEEE11073pack(const float *values, size_t count, uint8_t *output, bool use_sfloat)
+{
+	size_t out_idx = 0;
+	for (size_t idx = 0; idx < count; idx++)
+	{
+		if (use_sfloat)
+		{
+			uint16_t sfloat = float2IEEE11073sfloat(values[idx]);
+			output[out_idx++] = (uint8_t)(sfloat);
+			output[out_idx++] = (uint8_t)(sfloat >> 8);
+		}
+		else
+		{
+			float2IEEE11073(values[idx], &output[out_idx]);
+			out_idx += 4;
+		}
+	}
+	return out_idx;
+}
@@ -36,6 +36,7 @@
 #define _IEEE11073FLOAT_H_
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef enum
 {
@@ -87,5 +88,163 @@ static const uint32_t FIRST_S_RESERVED_VALUE = MDER_S_POSITIVE_INFINITY;
 #define MDER_SFLOAT_PRECISION 10000
 
 uint32_t float2IEEE11073(double data, uint8_t output[4]);
+size_t IEEE11073pack(const float *values, size_t count, uint8_t *output, bool use_sfloat);
+
+/**
+ * @brief Round half away from zero for positive values, constexpr replacement of round()
+ */
+constexpr double mder_round(double value)
+{
+	return (double)(int64_t)(value + 0.5);
+}
+
+/**
+ * @brief 10 ** exponent, exact for |exponent| <= 22, constexpr replacement of pow()
+ */
+constexpr double mder_pow10(int32_t exponent)
+{
+	double result = 1.0;
+	for (int32_t idx = 0; idx < (exponent < 0 ? -exponent : exponent); idx++)
+	{
+		result *= 10.0;
+	}
+	return exponent < 0 ? 1.0 / result : result;
+}
+
+/**
+ * @brief Generic IEEE-11073 encoder used for FLOAT and SFLOAT
+ *
+ * @tparam MANTISSA_BITS 24 for FLOAT, 12 for SFLOAT
+ * @tparam MANTISSA_MAX largest mantissa that is not a reserved value
+ * @tparam EXPONENT_MAX largest exponent
+ * @tparam EXPONENT_MIN smallest exponent
+ * @tparam PRECISION 10 ** number of significant decimals of the mantissa
+ * @tparam NAN_VALUE reserved value for NaN
+ * @tparam POS_INF reserved value for +INFINITY
+ * @tparam NEG_INF reserved value for -INFINITY
+ * @param data value to encode
+ * @return uint32_t encoded value, upper bits unused for SFLOAT
+ */
+template <uint32_t MANTISSA_BITS, int32_t MANTISSA_MAX, int32_t EXPONENT_MAX, int32_t EXPONENT_MIN,
+		  uint32_t PRECISION, uint32_t NAN_VALUE, uint32_t POS_INF, uint32_t NEG_INF>
+constexpr uint32_t mder_encode(double data)
+{
+	if (data != data)
+	{
+		return NAN_VALUE;
+	}
+
+	bool negative = !(data > 0);
+	double mantissa = negative ? -data : data;
+	int32_t exponent = 0; // Note: 10**x exponent, not 2**x
+
+	// scale up if number is too big
+	while (mantissa > MANTISSA_MAX)
+	{
+		mantissa /= 10.0;
+		++exponent;
+		if (exponent > EXPONENT_MAX)
+		{
+			return negative ? NEG_INF : POS_INF;
+		}
+	}
+
+	// scale down if number is too small
+	while (mantissa < 1)
+	{
+		mantissa *= 10;
+		--exponent;
+		if (exponent < EXPONENT_MIN)
+		{
+			return 0;
+		}
+	}
+
+	// scale down if number needs more precision
+	double mdiff = mder_round(mantissa * PRECISION) - mder_round(mantissa) * PRECISION;
+	while ((mdiff > 0.5 || mdiff < -0.5) && exponent > EXPONENT_MIN &&
+		   (mantissa * 10) <= MANTISSA_MAX)
+	{
+		mantissa *= 10;
+		--exponent;
+		mdiff = mder_round(mantissa * PRECISION) - mder_round(mantissa) * PRECISION;
+	}
+
+	int32_t int_mantissa = (int32_t)mder_round(mantissa);
+	if (negative)
+	{
+		int_mantissa = -int_mantissa;
+	}
+	return ((uint32_t)exponent << MANTISSA_BITS) | ((uint32_t)int_mantissa & ((1UL << MANTISSA_BITS) - 1));
+}
+
+/**
+ * @brief Generic IEEE-11073 decoder used for FLOAT and SFLOAT
+ *
+ * @param raw encoded value
+ * @return double decoded value, NaN for NaN, NRes and reserved values
+ */
+template <uint32_t MANTISSA_BITS, uint32_t NAN_VALUE, uint32_t NRES, uint32_t RESERVED, uint32_t POS_INF, uint32_t NEG_INF>
+constexpr double mder_decode(uint32_t raw)
+{
+	if (raw == POS_INF)
+	{
+		return __builtin_inf();
+	}
+	if (raw == NEG_INF)
+	{
+		return -__builtin_inf();
+	}
+	if ((raw == NAN_VALUE) || (raw == NRES) || (raw == RESERVED))
+	{
+		return __builtin_nan("");
+	}
+
+	// Sign extend mantissa and exponent, the exponent has a third of the mantissa bits
+	const uint32_t total_bits = MANTISSA_BITS + MANTISSA_BITS / 3;
+	int32_t mantissa = (int32_t)(raw << (32 - MANTISSA_BITS)) >> (32 - MANTISSA_BITS);
+	int32_t exponent = (int32_t)(raw << (32 - total_bits)) >> (32 - total_bits + MANTISSA_BITS);
+	return exponent < 0 ? mantissa / mder_pow10(-exponent) : mantissa * mder_pow10(exponent);
+}
+
+/**
+ * @brief Convert a value into an IEEE-11073 32-bit FLOAT at compile time
+ * Gives the same result as float2IEEE11073(), which should be used at runtime
+ */
+constexpr uint32_t float2IEEE11073_const(double data)
+{
+	return mder_encode<24, MDER_FLOAT_MANTISSA_MAX, MDER_FLOAT_EXPONENT_MAX, MDER_FLOAT_EXPONENT_MIN, MDER_FLOAT_PRECISION,
+					   MDER_NaN, MDER_POSITIVE_INFINITY, MDER_NEGATIVE_INFINITY>(data);
+}
+
+/**
+ * @brief Convert an IEEE-11073 32-bit FLOAT into a double
+ */
+constexpr double IEEE11073float2double(uint32_t raw)
+{
+	return mder_decode<24, MDER_NaN, MDER_NRes, MDER_RESERVED_VALUE, MDER_POSITIVE_INFINITY, MDER_NEGATIVE_INFINITY>(raw);
+}
+
+/**
+ * @brief Convert a value into an IEEE-11073 16-bit SFLOAT
+ */
+constexpr uint16_t float2IEEE11073sfloat(double data)
+{
+	return (uint16_t)mder_encode<12, MDER_SFLOAT_MANTISSA_MAX, MDER_SFLOAT_EXPONENT_MAX, MDER_SFLOAT_EXPONENT_MIN, MDER_SFLOAT_PRECISION,
+								 MDER_S_NaN, MDER_S_POSITIVE_INFINITY, MDER_S_NEGATIVE_INFINITY>(data);
+}
+
+/**
+ * @brief Convert an IEEE-11073 16-bit SFLOAT into a double
+ */
+constexpr double IEEE11073sfloat2double(uint16_t raw)
+{
+	return mder_decode<12, MDER_S_NaN, MDER_S_NRes, MDER_S_RESERVED_VALUE, MDER_S_POSITIVE_INFINITY, MDER_S_NEGATIVE_INFINITY>(raw);
+}
+
+static_assert(float2IEEE11073sfloat(36.5) == 0xF16D, "SFLOAT encoder");
+static_assert(IEEE11073sfloat2double(0xF16D) == 36.5, "SFLOAT decoder");
+static_assert(float2IEEE11073_const(-1.0) == 0x00FFFFFF, "FLOAT encoder");
+static_assert(IEEE11073float2double(0xFE000E47) == 36.55, "FLOAT decoder");
 
 #endif /* _IEEE11073FLOAT_H_ */
\ No newline at end of file
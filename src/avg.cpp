@@ -8,6 +8,10 @@
  * int numberOfReadings
  * double min
  * double max
+ *
+ * In addition the last AVGSTD_HISTORY_SIZE readings are kept in a
+ * statically allocated ring buffer to provide the mean, variance and
+ * slope of a sliding window in O(1) per reading.
  **/
 
 /* 
@@ -20,90 +24,329 @@ The above copyright notice and this permission notice shall be included in all c
 THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
-#include "main.h"
+#include "avg.h"
 #include <math.h>
 
-AvgStd::AvgStd()
+/**
+ * Divide by the number of readings, the only division per reading.
+ * Q16_16 uses a plain integer division of the raw value.
+ **/
+static inline float divN(float value, unsigned int n) { return value / (float)n; }
+static inline double divN(double value, unsigned int n) { return value / (double)n; }
+static inline Q16_16 divN(Q16_16 value, unsigned int n) { return value / n; }
+static inline Q48_16 divN(Q48_16 value, unsigned int n) { return value / n; }
+
+/**
+ * Multiply by a count without converting the count into the
+ * fixed point type, (Q16_16)(int)n overflows for n >= 32768.
+ * The result is a sum, so Q16_16 returns Q48_16.
+ **/
+static inline float mulN(float value, unsigned int n) { return value * (float)n; }
+static inline double mulN(double value, unsigned int n) { return value * (double)n; }
+static inline Q48_16 mulN(Q16_16 value, unsigned int n) { return Q48_16::fromRaw((int64_t)value.getRaw() * n); }
+
+/**
+ * Product added to a sum of squares or products
+ **/
+static inline float mulW(float a, float b) { return a * b; }
+static inline double mulW(double a, double b) { return a * b; }
+static inline Q48_16 mulW(Q16_16 a, Q16_16 b) { return Q48_16::mul(a, b); }
+
+/**
+ * Ratio of two counts 0 .. 1
+ **/
+static inline void ratioN(float &ratio, unsigned int num, unsigned int den) { ratio = (float)num / (float)den; }
+static inline void ratioN(double &ratio, unsigned int num, unsigned int den) { ratio = (double)num / (double)den; }
+static inline void ratioN(Q16_16 &ratio, unsigned int num, unsigned int den) { ratio = Q16_16::fromRaw((int32_t)(((int64_t)num << 16) / den)); }
+
+/**
+ * Check dev * dev <= limit, Q16_16 can only square values below 181
+ **/
+static inline bool squareWithin(float dev, float limit) { return dev * dev <= limit; }
+static inline bool squareWithin(double dev, double limit) { return dev * dev <= limit; }
+static inline bool squareWithin(Q16_16 dev, Q16_16 limit) { return (dev < Q16_16(181)) && (dev * dev <= limit); }
+
+template <typename T>
+AvgStdT<T>::AvgStdT()
 {
-	AvgStd::reset();
+	reset();
+	w_size = AVGSTD_HISTORY_SIZE;
+	trend_interval = 1000;
+	sampling_interval = 10;
+	clearHistory();
 }
 
-void AvgStd::checkAndAddReading(float val)
+/**
+ * Adds the reading if it is within r_sigma standard deviations
+ * of the mean, compared as squares to avoid the square root
+ **/
+template <typename T>
+void AvgStdT<T>::checkAndAddReading(float val)
 {
 
 	if (N < 10)
-		AvgStd::addReading(val);
+		addReading(val);
 	else
 	{
 		if (r_sigma == -1)
-			AvgStd::addReading(val);
+			addReading(val);
 		else
 		{
-			if (abs(avg - val) <= (r_sigma * sqrt(var)))
-				AvgStd::addReading(val);
+			T dev = avg - (T)val;
+			if (dev < T())
+				dev = -dev;
+			if (squareWithin(dev, (T)divN(m2, N - 1) * r_sigma_sq))
+				addReading(val);
 		}
 	}
 }
 
-void AvgStd::addReading(float val)
+/**
+ * Welford update: one division per reading, no
+ * cancellation between large sums over long streams
+ **/
+template <typename T>
+void AvgStdT<T>::addReading(float val)
 {
+	T value = (T)val;
+	if (N == 0)
+	{
+		min = value;
+		max = value;
+	}
+	else
+	{
+		// set min/max
+		max = value > max ? value : max;
+		min = value < min ? value : min;
+	}
+	N++;
 
+	T delta = value - avg;
+	avg += divN(delta, N);
+	m2 += mulW(delta, value - avg);
+
+	addToWindow(value);
+}
+
+/**
+ * Chan's parallel update: combine the running moments of another
+ * set of readings, e.g. a batch collected somewhere else
+ **/
+template <typename T>
+void AvgStdT<T>::merge(const AvgStdT<T> &other)
+{
+	if (other.N == 0)
+		return;
 	if (N == 0)
 	{
-		avg = val;
-		min = val;
-		max = val;
+		avg = other.avg;
+		m2 = other.m2;
+		min = other.min;
+		max = other.max;
+		N = other.N;
+		return;
+	}
+
+	unsigned int total = N + other.N;
+	T delta = other.avg - avg;
+	T ratio;
+	ratioN(ratio, other.N, total);
+	T weighted = delta * ratio;
+	avg += weighted;
+	m2 += other.m2 + mulN(delta * weighted, N);
+	max = other.max > max ? other.max : max;
+	min = other.min < min ? other.min : min;
+	N = total;
+}
+
+template <typename T>
+void AvgStdT<T>::addToWindow(T val)
+{
+	if (w_count == 0)
+	{
+		w_ref = val;
 	}
-	else if (N == 1)
+
+	T y = val - w_ref;
+	if (w_count < w_size)
 	{
-		//set min/max
-		max = val > max ? val : max;
-		min = val < min ? val : min;
-
-		float thisavg = (avg + val) / 2;
-		// initial value is in avg
-		var = (avg - thisavg) * (avg - thisavg) + (val - thisavg) * (val - thisavg);
-		avg = thisavg;
+		// Window is still growing, new reading gets index w_count
+		w_sum_iy += mulN(y, w_count);
+		w_sum += y;
+		w_sum_sq += mulW(y, y);
+		history[(w_head + w_count) % w_size] = val;
+		w_count++;
 	}
 	else
 	{
-		// set min/max
-		max = val > max ? val : max;
-		min = val < min ? val : min;
-
-		float M = (float)N;
+		// Drop the oldest reading, all indices shift down by one
+		T old = history[w_head] - w_ref;
+		w_sum_iy += mulN(y, w_count - 1) - W(w_sum) + W(old);
+		w_sum += y - old;
+		w_sum_sq += mulW(y, y) - mulW(old, old);
+		history[w_head] = val;
+		w_head = (w_head + 1) % w_size;
 
-		var = var * ((M - 1) / M) + ((val - avg) * (val - avg) / (M + 1));
+		// Rounding errors of the sliding sums add up, recalculate once per window
+		if (++w_pushes >= w_size)
+		{
+			recalcWindow();
+		}
+	}
+}
 
-		avg = avg * (M / (M + 1)) + val / (M + 1);
+template <typename T>
+void AvgStdT<T>::recalcWindow()
+{
+	w_ref += divN(w_sum, w_count);
+	w_sum = T();
+	w_sum_sq = W();
+	w_sum_iy = W();
+	for (unsigned int idx = 0; idx < w_count; idx++)
+	{
+		T y = history[(w_head + idx) % w_size] - w_ref;
+		w_sum += y;
+		w_sum_sq += mulW(y, y);
+		w_sum_iy += mulN(y, idx);
 	}
-	N++;
+	w_pushes = 0;
 }
 
-void AvgStd::reset()
+template <typename T>
+void AvgStdT<T>::clearHistory()
+{
+	w_head = 0;
+	w_count = 0;
+	w_pushes = 0;
+	w_ref = T();
+	w_sum = T();
+	w_sum_sq = W();
+	w_sum_iy = W();
+}
+
+template <typename T>
+void AvgStdT<T>::setWindowSize(unsigned int size)
+{
+	if (size < 2)
+		size = 2;
+	if (size > AVGSTD_HISTORY_SIZE)
+		size = AVGSTD_HISTORY_SIZE;
+	w_size = size;
+	clearHistory();
+}
+
+template <typename T>
+void AvgStdT<T>::reset()
 {
 	N = 0;
-	avg = 0;
-	var = 0;
-	min = 0;
-	max = 0;
+	avg = T();
+	m2 = W();
+	min = T();
+	max = T();
 	r_sigma = -1;
+	r_sigma_sq = T();
 }
 
-float AvgStd::getMean() { return avg; }
-float AvgStd::getStd()
+template <typename T>
+float AvgStdT<T>::getMean() { return (float)avg; }
+template <typename T>
+float AvgStdT<T>::getStd()
 {
 	float ret = -1;
 	if (N > 1)
-		ret = sqrt(var);
+		ret = sqrt(getVariance());
 	return ret;
 }
-float AvgStd::getVariance() { return var; }
-unsigned int AvgStd::getN() { return N; }
-float AvgStd::getMin() { return min; }
-float AvgStd::getMax() { return max; }
+template <typename T>
+float AvgStdT<T>::getVariance()
+{
+	if (N < 2)
+		return 0;
+	return (float)m2 / (float)(N - 1);
+}
+template <typename T>
+unsigned int AvgStdT<T>::getN() { return N; }
+template <typename T>
+float AvgStdT<T>::getMin() { return (float)min; }
+template <typename T>
+float AvgStdT<T>::getMax() { return (float)max; }
 
-void AvgStd::setRejectionSigma(float sigmas)
+template <typename T>
+void AvgStdT<T>::setRejectionSigma(float sigmas)
 {
 	r_sigma = sigmas;
+	r_sigma_sq = (T)(sigmas * sigmas);
 };
+
+template <typename T>
+unsigned int AvgStdT<T>::getWindowN() { return w_count; }
+template <typename T>
+float AvgStdT<T>::getWindowMean()
+{
+	if (w_count == 0)
+		return 0;
+	return (float)w_ref + (float)w_sum / (float)w_count;
+}
+template <typename T>
+float AvgStdT<T>::getWindowVariance()
+{
+	if (w_count < 2)
+		return 0;
+	float n = (float)w_count;
+	float sum = (float)w_sum;
+	float ret = ((float)w_sum_sq - sum * sum / n) / (n - 1);
+	return ret > 0 ? ret : 0;
+}
+template <typename T>
+float AvgStdT<T>::getWindowStd()
+{
+	float ret = -1;
+	if (w_count > 1)
+		ret = sqrt(getWindowVariance());
+	return ret;
+}
+
+/**
+ * Least squares slope over the window in units per second
+ **/
+template <typename T>
+float AvgStdT<T>::getSlope()
+{
+	if (w_count < 2)
+		return 0;
+	float n = (float)w_count;
+	// Sums of the indices 0 .. n-1
+	float sum_i = n * (n - 1) / 2;
+	float sum_ii = (n - 1) * n * (2 * n - 1) / 6;
+	float slope_per_sample = (n * (float)w_sum_iy - sum_i * (float)w_sum) / (n * sum_ii - sum_i * sum_i);
+	return slope_per_sample * 1000.0f / (float)sampling_interval;
+}
+
+/**
+ * Projected change over the trend interval in 1/100 units,
+ * e.g. 5 means a rise of 0.05 degree within the trend interval
+ **/
+template <typename T>
+int AvgStdT<T>::getTrend()
+{
+	return (int)lroundf(getSlope() * (float)trend_interval / 10.0f);
+}
+
+template <typename T>
+void AvgStdT<T>::setTrendInterval(int interval)
+{
+	if (interval > 0)
+		trend_interval = interval;
+}
+
+template <typename T>
+void AvgStdT<T>::setSamplingInterval(int interval)
+{
+	if (interval > 0)
+		sampling_interval = interval;
+}
+
+template class AvgStdT<float>;
+template class AvgStdT<double>;
+template class AvgStdT<Q16_16>;
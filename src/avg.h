@@ -8,6 +8,10 @@
  * int numberOfReadings
  * double min
  * double max
+ *
+ * In addition the last AVGSTD_HISTORY_SIZE readings are kept in a
+ * statically allocated ring buffer to provide the mean, variance and
+ * slope of a sliding window in O(1) per reading.
  **/
 
 /* 
@@ -23,10 +27,41 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #ifndef AVGSTD_H
 #define AVGSTD_H
 
-#include "Arduino.h"
+#include "q16.h"
 
-class AvgStd
+/** Capacity of the sliding window ring buffer */
+#ifndef AVGSTD_HISTORY_SIZE
+#define AVGSTD_HISTORY_SIZE 128
+#endif
+
+/**
+ * Type of the sums of squares and products, the type itself for float
+ * and double, Q48_16 for Q16_16
+ **/
+template <typename T>
+struct AvgStdWide
+{
+	typedef T type;
+};
+template <>
+struct AvgStdWide<Q16_16>
+{
+	typedef Q48_16 type;
+};
+
+/**
+ * Running statistics with the accumulator type T for mean and
+ * sum of squared deviations. T can be float, double or Q16_16.
+ * The sliding window is kept in T as well, so adding a reading to the
+ * Q16_16 variant needs no float math except the conversion of the reading.
+ * The sums of squares and products are kept in AvgStdWide<T>, for Q16_16
+ * only the readings and their mean must stay within its range.
+ **/
+template <typename T>
+class AvgStdT
 {
+	typedef typename AvgStdWide<T>::type W;
+
 public:
 	float getMean();
 	float getStd();
@@ -37,15 +72,53 @@ public:
 	void reset();
 	void addReading(float);
 	void checkAndAddReading(float);
+	void merge(const AvgStdT<T> &);
 	void setRejectionSigma(float);
 	int getTrend();
 	void setTrendInterval(int);
 	void setSamplingInterval(int);
-	AvgStd();
+	float getWindowMean();
+	float getWindowStd();
+	float getWindowVariance();
+	unsigned int getWindowN();
+	float getSlope();
+	void setWindowSize(unsigned int);
+	void clearHistory();
+	AvgStdT();
 
 private:
-	float min, max, var, avg, r_sigma;
+	void addToWindow(T);
+	void recalcWindow();
+
+	float r_sigma;
+	/** Square of r_sigma for the rejection test */
+	T r_sigma_sq;
+	T min, max;
+	/** Mean and sum of squared deviations from the mean */
+	T avg;
+	W m2;
 	unsigned int N;
+
+	/** Ring buffer with the last readings */
+	T history[AVGSTD_HISTORY_SIZE];
+	/** Index of the oldest reading */
+	unsigned int w_head;
+	/** Number of readings in the window */
+	unsigned int w_count;
+	/** Size of the window, max AVGSTD_HISTORY_SIZE */
+	unsigned int w_size;
+	/** Number of readings since the sums were recalculated */
+	unsigned int w_pushes;
+	/** Reference value subtracted from the readings to keep the sums small */
+	T w_ref;
+	/** Sums over the window of (y), (y * y) and (i * y), i = 0 for the oldest reading */
+	T w_sum;
+	W w_sum_sq, w_sum_iy;
+	/** Trend interval and sampling interval in milliseconds */
+	int trend_interval, sampling_interval;
 };
 
+/** Default statistics used by the application */
+typedef AvgStdT<float> AvgStd;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,173 @@
+/**
+ * @file battery.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Battery voltage monitor and state of charge
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+/** Micro Volts per LSB, 3.0V ADC range, 12-bit ADC resolution and
+ * 1.73 compensation of the VBAT divider = 1.73 * 3000mV/4096 */
+#define REAL_VBAT_UV_PER_LSB (1267)
+
+/** Number of ADC samples averaged by the SAADC for one reading */
+#define BATT_OVERSAMPLING 32
+/** Filter weight of a new reading, 1/2^BATT_FILTER_SHIFT */
+#define BATT_FILTER_SHIFT 2
+/** Fractional bits of the filter state */
+#define BATT_FILTER_FRAC 4
+
+/** Timer for the background readings */
+SoftwareTimer batt_timer;
+
+/** Filtered battery voltage in mV << BATT_FILTER_FRAC */
+static int32_t batt_filter = 0;
+/** Cached battery voltage in mV */
+static volatile int32_t batt_mv = 0;
+/** Cached state of charge in % */
+static volatile uint8_t batt_soc = 0;
+
+/** LiPo discharge curve, battery voltage in mV and state of charge in % */
+struct batt_curve_point_s
+{
+	int16_t mv;
+	uint8_t soc;
+};
+static const batt_curve_point_s batt_curve[] = {
+	{3300, 0},
+	{3600, 3},
+	{3700, 10},
+	{3750, 18},
+	{3790, 27},
+	{3830, 37},
+	{3870, 47},
+	{3920, 57},
+	{3980, 67},
+	{4030, 76},
+	{4080, 84},
+	{4130, 92},
+	{4200, 100},
+};
+
+/**
+ * @brief Do one oversampled reading of the battery voltage
+ *
+ * @return int32_t battery voltage in mV
+ */
+static int32_t battery_read_adc(void)
+{
+	int32_t raw = analogRead(WB_A0);
+
+	// Convert the raw value to compensated mv, taking the resistor-
+	// divider into account (providing the actual LIPO voltage)
+	// ADC range is 0..3000mV and resolution is 12-bit (0..4095)
+	return (raw * REAL_VBAT_UV_PER_LSB + 500) / 1000;
+}
+
+/**
+ * @brief Estimate the state of charge from the battery voltage
+ *
+ * @param mv battery voltage in mV
+ * @return uint8_t state of charge in %
+ */
+uint8_t battery_soc_from_mv(int32_t mv)
+{
+	const size_t num_points = sizeof(batt_curve) / sizeof(batt_curve[0]);
+	if (mv <= batt_curve[0].mv)
+	{
+		return 0;
+	}
+	for (size_t idx = 1; idx < num_points; idx++)
+	{
+		if (mv < batt_curve[idx].mv)
+		{
+			// Linear interpolation between the two curve points
+			const batt_curve_point_s &low = batt_curve[idx - 1];
+			const batt_curve_point_s &high = batt_curve[idx];
+			return low.soc + ((mv - low.mv) * (high.soc - low.soc)) / (high.mv - low.mv);
+		}
+	}
+	return 100;
+}
+
+/**
+ * @brief Take a new reading and update the cached values
+ * Runs in the timer task, the battery service is updated
+ * by the loop task on the BATT_UPDATE event
+ *
+ * @param unused
+ */
+static void battery_update(TimerHandle_t unused)
+{
+	(void)unused;
+	int32_t reading = battery_read_adc() << BATT_FILTER_FRAC;
+	batt_filter += (reading - batt_filter) >> BATT_FILTER_SHIFT;
+	batt_mv = (batt_filter + (1 << (BATT_FILTER_FRAC - 1))) >> BATT_FILTER_FRAC;
+
+	uint8_t soc = battery_soc_from_mv(batt_mv);
+	if (soc != batt_soc)
+	{
+		batt_soc = soc;
+		events_post(BATT_UPDATE);
+	}
+}
+
+/**
+ * @brief Initialize the ADC and start the background readings
+ *
+ */
+void init_battery(void)
+{
+	// Set the analog reference to 3.0V (default = 3.6V)
+	analogReference(AR_INTERNAL_3_0);
+
+	// Set the resolution to 12-bit (0..4095)
+	analogReadResolution(12); // Can be 8, 10, 12 or 14
+
+	// Let the SAADC average the samples of one reading
+	analogOversampling(BATT_OVERSAMPLING);
+
+	// Start the filter with the first reading
+	batt_filter = battery_read_adc() << BATT_FILTER_FRAC;
+	batt_mv = batt_filter >> BATT_FILTER_FRAC;
+	batt_soc = battery_soc_from_mv(batt_mv);
+	MYLOG("BAT", "Battery %ld mV, %d%%", batt_mv, batt_soc);
+
+	batt_timer.begin(BATT_READ_INTERVAL, battery_update);
+	batt_timer.start();
+}
+
+/**
+ * @brief Get the filtered battery voltage, does not access the ADC
+ *
+ * @return int32_t battery voltage in mV
+ */
+int32_t readVBAT_mv(void)
+{
+	return batt_mv;
+}
+
+/**
+ * @brief Get the filtered battery voltage, does not access the ADC
+ *
+ * @return float battery voltage in mV
+ */
+float readVBAT(void)
+{
+	return (float)batt_mv;
+}
+
+/**
+ * @brief Get the estimated state of charge, does not access the ADC
+ *
+ * @return uint8_t state of charge in %
+ */
+uint8_t battery_soc(void)
+{
+	return batt_soc;
+}
@@ -0,0 +1,272 @@
+/**
+ * @file ble-conn.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Connection parameters following the activity on the connection
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+/** Fast connection for transfers: 15 ms interval, no latency, 4 s supervision timeout */
+#define CONN_FAST_MIN_INTERVAL 12
+#define CONN_FAST_MAX_INTERVAL 12
+#define CONN_FAST_LATENCY 0
+#define CONN_FAST_TIMEOUT 400
+/** Idle connection: 485 to 500 ms interval, skip up to 2 intervals, 6 s supervision timeout */
+#define CONN_IDLE_MIN_INTERVAL 388
+#define CONN_IDLE_MAX_INTERVAL 400
+#define CONN_IDLE_LATENCY 2
+#define CONN_IDLE_TIMEOUT 600
+
+/**
+ * @brief Check connection parameters against the limits of iOS,
+ * Apple rejects parameter updates outside of them
+ * Intervals in units of 1.25 ms, timeout in units of 10 ms
+ * - min interval >= 15 ms and min + 15 ms <= max, or min = max = 15 ms
+ * - latency <= 30
+ * - max interval * (latency + 1) <= 2 s
+ * - max interval * (latency + 1) * 3 < timeout
+ * - 2 s <= timeout <= 6 s
+ */
+constexpr bool conn_params_valid(uint16_t min_interval, uint16_t max_interval, uint16_t latency, uint16_t timeout)
+{
+	return (min_interval >= 12) && ((min_interval + 12 <= max_interval) || ((min_interval == 12) && (max_interval == 12))) &&
+		   (latency <= 30) &&
+		   (max_interval * 5 * (latency + 1) <= 8000) &&
+		   (max_interval * 5 * (latency + 1) * 3 < timeout * 40) &&
+		   (timeout >= 200) && (timeout <= 600);
+}
+static_assert(conn_params_valid(CONN_FAST_MIN_INTERVAL, CONN_FAST_MAX_INTERVAL, CONN_FAST_LATENCY, CONN_FAST_TIMEOUT),
+			  "Fast connection parameters are not accepted by iOS");
+static_assert(conn_params_valid(CONN_IDLE_MIN_INTERVAL, CONN_IDLE_MAX_INTERVAL, CONN_IDLE_LATENCY, CONN_IDLE_TIMEOUT),
+			  "Idle connection parameters are not accepted by iOS");
+
+/** Time after connect for the service discovery of the central */
+#define CONN_DISCOVERY_TIME 5000
+/** ATT MTU requested for the stream batches */
+#define CONN_MTU 247
+
+/** Connection parameter modes */
+enum conn_mode_e
+{
+	CONN_MODE_NONE,
+	CONN_MODE_NEW,
+	CONN_MODE_IDLE,
+	CONN_MODE_FAST
+};
+
+/** Activities that need a fast connection, bit = conn_activity_e */
+static volatile uint8_t conn_activities = 0;
+/** Requested connection mode per connection handle, CONN_MODE_NONE if not connected,
+ * CONN_MODE_NEW if nothing was requested yet */
+static conn_mode_e conn_mode[BLE_MAX_CONNECTION];
+
+/** Timer to end the discovery phase after connect */
+SoftwareTimer conn_timer;
+
+/**
+ * @brief Request connection parameters from the central
+ *
+ * @param conn_handle connection handle
+ * @param min_interval min connection interval in units of 1.25 ms
+ * @param max_interval max connection interval in units of 1.25 ms
+ * @param latency slave latency
+ * @param timeout supervision timeout in units of 10 ms
+ */
+static void conn_request(uint16_t conn_handle, uint16_t min_interval, uint16_t max_interval, uint16_t latency, uint16_t timeout)
+{
+	// BLEConnection::requestConnectionParameter() sets min = max, which iOS only accepts for 15 ms
+	ble_gap_conn_params_t params;
+	params.min_conn_interval = min_interval;
+	params.max_conn_interval = max_interval;
+	params.slave_latency = latency;
+	params.conn_sup_timeout = timeout;
+	uint32_t result = sd_ble_gap_conn_param_update(conn_handle, &params);
+	if (result != NRF_SUCCESS)
+	{
+		MYLOG("CON", "Parameter request for %d failed 0x%lX", conn_handle, result);
+	}
+}
+
+/**
+ * @brief Request the connection parameters for the current activities
+ * on all connections. The data goes to all connections, so they all follow the activities.
+ * Called by the loop task on CONN_UPDATE only, so the requests of
+ * different tasks do not overlap
+ *
+ */
+void conn_params_apply(void)
+{
+	conn_mode_e mode = conn_activities != 0 ? CONN_MODE_FAST : CONN_MODE_IDLE;
+	for (uint16_t conn_handle = 0; conn_handle < BLE_MAX_CONNECTION; conn_handle++)
+	{
+		// The BLE task sets the mode on connect and disconnect
+		taskENTER_CRITICAL();
+		bool changed = (conn_mode[conn_handle] != CONN_MODE_NONE) && (conn_mode[conn_handle] != mode);
+		if (changed)
+		{
+			conn_mode[conn_handle] = mode;
+		}
+		taskEXIT_CRITICAL();
+		if (!changed)
+		{
+			continue;
+		}
+		if (mode == CONN_MODE_FAST)
+		{
+			MYLOG("CON", "Request fast connection %d, activities 0x%02X", conn_handle, conn_activities);
+			conn_request(conn_handle, CONN_FAST_MIN_INTERVAL, CONN_FAST_MAX_INTERVAL, CONN_FAST_LATENCY, CONN_FAST_TIMEOUT);
+		}
+		else
+		{
+			MYLOG("CON", "Request idle connection %d", conn_handle);
+			conn_request(conn_handle, CONN_IDLE_MIN_INTERVAL, CONN_IDLE_MAX_INTERVAL, CONN_IDLE_LATENCY, CONN_IDLE_TIMEOUT);
+		}
+	}
+}
+
+/**
+ * @brief End of the discovery phase
+ *
+ * @param unused
+ */
+static void conn_discovery_done(TimerHandle_t unused)
+{
+	(void)unused;
+	conn_activity(CONN_ACT_DISCOVERY, false);
+}
+
+/**
+ * @brief Log the negotiated parameters, called for every BLE event.
+ * A changed MTU changes the batch size of the sample stream
+ *
+ * @param event BLE event from the SoftDevice
+ */
+static void conn_event_callback(ble_evt_t *event)
+{
+	switch (event->header.evt_id)
+	{
+	case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+	{
+		ble_gap_conn_params_t &params = event->evt.gap_evt.params.conn_param_update.conn_params;
+		MYLOG("CON", "Interval %d.%02d ms, latency %d, timeout %d ms",
+			  (params.max_conn_interval * 125) / 100, (params.max_conn_interval * 125) % 100,
+			  params.slave_latency, params.conn_sup_timeout * 10);
+		break;
+	}
+	case BLE_GAP_EVT_DATA_LENGTH_UPDATE:
+		MYLOG("CON", "Data length TX %d, RX %d bytes",
+			  event->evt.gap_evt.params.data_length_update.effective_params.max_tx_octets,
+			  event->evt.gap_evt.params.data_length_update.effective_params.max_rx_octets);
+		break;
+	case BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST:
+		MYLOG("CON", "Central MTU %d", event->evt.gatts_evt.params.exchange_mtu_request.client_rx_mtu);
+		// A client can subscribe to the stream before the MTU exchange
+		events_post(STREAM_CONFIG);
+		break;
+	case BLE_GATTC_EVT_EXCHANGE_MTU_RSP:
+		MYLOG("CON", "Server MTU %d", event->evt.gattc_evt.params.exchange_mtu_rsp.server_rx_mtu);
+		events_post(STREAM_CONFIG);
+		break;
+	case BLE_GAP_EVT_PHY_UPDATE:
+		MYLOG("CON", "PHY TX %d, RX %d", event->evt.gap_evt.params.phy_update.tx_phy, event->evt.gap_evt.params.phy_update.rx_phy);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * @brief Setup the connection parameter handling, call before advertising starts
+ *
+ */
+void init_conn_params(void)
+{
+	for (uint16_t conn_handle = 0; conn_handle < BLE_MAX_CONNECTION; conn_handle++)
+	{
+		conn_mode[conn_handle] = CONN_MODE_NONE;
+	}
+	Bluefruit.setEventCallback(conn_event_callback);
+	conn_timer.begin(CONN_DISCOVERY_TIME, conn_discovery_done, NULL, false);
+}
+
+/**
+ * @brief New connection, starts with fast parameters for the service discovery
+ * and asks for larger packets
+ *
+ * @param handle Connection handle
+ */
+void conn_params_connected(uint16_t handle)
+{
+	if (handle >= BLE_MAX_CONNECTION)
+	{
+		return;
+	}
+	taskENTER_CRITICAL();
+	conn_mode[handle] = CONN_MODE_NEW;
+	taskEXIT_CRITICAL();
+	BLEConnection *connection = Bluefruit.Connection(handle);
+	if (connection != NULL)
+	{
+		connection->requestDataLengthUpdate();
+		connection->requestMtuExchange(CONN_MTU);
+	}
+	conn_activity(CONN_ACT_DISCOVERY, true);
+	conn_timer.stop();
+	conn_timer.start();
+}
+
+/**
+ * @brief Connection is gone
+ *
+ * @param handle Connection handle
+ */
+void conn_params_disconnected(uint16_t handle)
+{
+	if (handle < BLE_MAX_CONNECTION)
+	{
+		taskENTER_CRITICAL();
+		conn_mode[handle] = CONN_MODE_NONE;
+		taskEXIT_CRITICAL();
+	}
+	bool connected = false;
+	for (uint16_t conn_handle = 0; conn_handle < BLE_MAX_CONNECTION; conn_handle++)
+	{
+		connected |= conn_mode[conn_handle] != CONN_MODE_NONE;
+	}
+	if (!connected)
+	{
+		// Last connection is gone
+		conn_timer.stop();
+		taskENTER_CRITICAL();
+		conn_activities &= ~(1 << CONN_ACT_DISCOVERY);
+		taskEXIT_CRITICAL();
+	}
+}
+
+/**
+ * @brief Start or end an activity that needs a fast connection
+ * Without activities the connection switches to long intervals with slave latency.
+ * Can be called from any task, the parameters are requested by the loop task
+ *
+ * @param activity the activity
+ * @param active true if the activity starts, false if it ends
+ */
+void conn_activity(conn_activity_e activity, bool active)
+{
+	taskENTER_CRITICAL();
+	if (active)
+	{
+		conn_activities |= 1 << activity;
+	}
+	else
+	{
+		conn_activities &= ~(1 << activity);
+	}
+	taskEXIT_CRITICAL();
+	events_post(CONN_UPDATE);
+}
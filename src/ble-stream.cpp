@@ -0,0 +1,228 @@
+/**
+ * @file ble-stream.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Custom BLE service to stream all samples of a measurement in batches
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+/* Sample Stream Service Definitions
+ * Sample Stream Service:  5A4E0001-7B3F-4C61-9D2A-3E5F6B8A1C20
+ * Sample Batch Char:      5A4E0002-7B3F-4C61-9D2A-3E5F6B8A1C20
+ * Clock Char:             5A4E0003-7B3F-4C61-9D2A-3E5F6B8A1C20
+ * Energy Ledger Char:     5A4E0004-7B3F-4C61-9D2A-3E5F6B8A1C20 (power.cpp)
+ * UUIDs are little endian
+ */
+static const uint8_t stream_service_uuid[16] = {0x20, 0x1C, 0x8A, 0x6B, 0x5F, 0x3E, 0x2A, 0x9D,
+												0x61, 0x4C, 0x3F, 0x7B, 0x01, 0x00, 0x4E, 0x5A};
+static const uint8_t stream_batch_uuid[16] = {0x20, 0x1C, 0x8A, 0x6B, 0x5F, 0x3E, 0x2A, 0x9D,
+											  0x61, 0x4C, 0x3F, 0x7B, 0x02, 0x00, 0x4E, 0x5A};
+static const uint8_t stream_clock_uuid[16] = {0x20, 0x1C, 0x8A, 0x6B, 0x5F, 0x3E, 0x2A, 0x9D,
+											  0x61, 0x4C, 0x3F, 0x7B, 0x03, 0x00, 0x4E, 0x5A};
+BLEService streams = BLEService(stream_service_uuid);
+BLECharacteristic streamc = BLECharacteristic(stream_batch_uuid);
+BLECharacteristic clockc = BLECharacteristic(stream_clock_uuid);
+
+/** Max length of one batch, max ATT MTU 247 - 3 bytes ATT header */
+#define STREAM_MAX_LEN 244
+/** Batch header: UINT16 sequence, UINT8 count, UINT32 time of the first sample */
+#define STREAM_HEADER_LEN 7
+/** Bytes per sample: UINT16 time offset + SFLOAT value */
+#define STREAM_SAMPLE_LEN 4
+#define STREAM_MAX_SAMPLES ((STREAM_MAX_LEN - STREAM_HEADER_LEN) / STREAM_SAMPLE_LEN)
+
+// The stream state is only used by the loop task, the BLE callbacks post STREAM_CONFIG
+/** Flag if notifications of the sample stream are enabled on at least one connection */
+static bool stream_active = false;
+/** Sequence number of the next batch, lets the receiver detect lost batches */
+static uint16_t stream_sequence = 0;
+
+/** Samples waiting to be sent */
+static uint32_t batch_start = 0;
+static uint16_t batch_offsets[STREAM_MAX_SAMPLES];
+static float batch_values[STREAM_MAX_SAMPLES];
+static uint8_t batch_count = 0;
+
+/** Samples per batch, fits the smallest MTU of the stream connections */
+static uint8_t stream_samples = 0;
+
+/**
+ * @brief Find the stream connections and the number of samples
+ * that fit into one notification for all of them.
+ * A dropped connection is already removed when the loop task runs this.
+ */
+static void stream_update(void)
+{
+	uint16_t payload = STREAM_MAX_LEN;
+	stream_active = false;
+	for (uint16_t conn_handle = 0; conn_handle < BLE_MAX_CONNECTION; conn_handle++)
+	{
+		BLEConnection *connection = Bluefruit.Connection(conn_handle);
+		if ((connection == NULL) || !connection->connected() || !streamc.notifyEnabled(conn_handle))
+		{
+			continue;
+		}
+		stream_active = true;
+		if (connection->getMtu() - 3 < payload)
+		{
+			payload = connection->getMtu() - 3;
+		}
+	}
+	stream_samples = (payload - STREAM_HEADER_LEN) / STREAM_SAMPLE_LEN;
+}
+
+/**
+ * @brief Callback for the CCCD of the sample batch characteristic
+ * Runs in the BLE task, the batch is changed only by the loop task
+ *
+ * @param conn_hdl Connection handle
+ * @param chr Pointer to characteristic
+ * @param cccd_value CCCD value
+ */
+static void stream_cccd_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint16_t cccd_value)
+{
+	(void)cccd_value;
+	MYLOG("BLE", "Sample stream %s on %d", chr->notifyEnabled(conn_hdl) ? "enabled" : "disabled", conn_hdl);
+	events_post(STREAM_CONFIG);
+}
+
+/**
+ * @brief Callback for writes to the clock characteristic
+ *
+ * @param conn_hdl Connection handle
+ * @param chr Pointer to characteristic
+ * @param data written data
+ * @param len length of the written data
+ */
+static void stream_clock_write_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint8_t *data, uint16_t len)
+{
+	(void)conn_hdl;
+	(void)chr;
+	if (len == 4)
+	{
+		clock_set(data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24));
+	}
+}
+
+/**
+ * @brief Setup the sample stream service
+ *
+ */
+void setup_stream(void)
+{
+	streams.begin();
+
+	// Configure the Sample Batch characteristic
+	// Properties = Notify
+	// Min Len    = 7
+	// Max Len    = 244
+	//    B1:0    = UINT16 - Sequence number of the batch
+	//    B2      = UINT8  - Number of samples N
+	//    B6:3    = UINT32 - Time of the first sample in ms since power on
+	//    followed by N times
+	//    UINT16  - Time of the sample in ms after the first sample
+	//    followed by N times
+	//    SFLOAT  - IEEE-11073 16-bit SFLOAT object temperature in Celsius
+	streamc.setProperties(CHR_PROPS_NOTIFY);
+	streamc.setPermission(SECMODE_OPEN, SECMODE_NO_ACCESS);
+	streamc.setMaxLen(STREAM_MAX_LEN);
+	streamc.setCccdWriteCallback(stream_cccd_callback);
+	streamc.begin();
+
+	// Configure the Clock characteristic, sets the wall clock
+	// for phones without Current Time Service
+	// Properties = Write
+	// Fixed Len  = 4
+	//    B3:0    = UINT32 - Local time in seconds since 1970-01-01
+	clockc.setProperties(CHR_PROPS_WRITE);
+	clockc.setPermission(SECMODE_NO_ACCESS, SECMODE_OPEN);
+	clockc.setFixedLen(4);
+	clockc.setWriteCallback(stream_clock_write_callback);
+	clockc.begin();
+
+	// Energy ledger of the power manager
+	setup_power_ble();
+}
+
+/**
+ * @brief Send the collected samples as one notification
+ *
+ */
+void stream_flush(void)
+{
+	if (batch_count == 0)
+	{
+		return;
+	}
+
+	uint8_t batch[STREAM_MAX_LEN];
+	batch[0] = (uint8_t)(stream_sequence);
+	batch[1] = (uint8_t)(stream_sequence >> 8);
+	batch[2] = batch_count;
+	batch[3] = (uint8_t)(batch_start);
+	batch[4] = (uint8_t)(batch_start >> 8);
+	batch[5] = (uint8_t)(batch_start >> 16);
+	batch[6] = (uint8_t)(batch_start >> 24);
+	size_t len = STREAM_HEADER_LEN;
+	for (uint8_t idx = 0; idx < batch_count; idx++)
+	{
+		batch[len++] = (uint8_t)(batch_offsets[idx]);
+		batch[len++] = (uint8_t)(batch_offsets[idx] >> 8);
+	}
+	len += IEEE11073pack(batch_values, batch_count, &batch[len], true);
+
+	ble_notify_all(streamc, batch, len);
+	stream_sequence++;
+	batch_count = 0;
+}
+
+/**
+ * @brief Add a sample to the stream, the batch is sent
+ * when it fills the MTU
+ *
+ * @param time time of the sample in ms
+ * @param value object temperature in Celsius
+ */
+void stream_add_sample(uint32_t time, float value)
+{
+	if (!stream_active)
+	{
+		return;
+	}
+
+	// Start a new batch if the time offset does not fit in 16 bit
+	if ((batch_count != 0) && ((time - batch_start) > UINT16_MAX))
+	{
+		stream_flush();
+	}
+	if (batch_count == 0)
+	{
+		batch_start = time;
+	}
+	batch_offsets[batch_count] = time - batch_start;
+	batch_values[batch_count] = value;
+	batch_count++;
+
+	if (batch_count >= stream_samples)
+	{
+		stream_flush();
+	}
+}
+
+/**
+ * @brief Recalculate the stream after a subscription, MTU or connection change,
+ * handler of the STREAM_CONFIG event
+ *
+ */
+void stream_config(void)
+{
+	// Send what was collected with the old batch size
+	stream_flush();
+	stream_update();
+	MYLOG("BLE", "Sample stream %s, %d samples per batch", stream_active ? "active" : "off", stream_samples);
+}
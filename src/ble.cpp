@@ -12,23 +12,146 @@
 #include "main.h"
 
 void setupHTM(void);
+void htm_interval_authorize_callback(uint16_t conn_hdl, BLECharacteristic *chr, ble_gatts_evt_write_t *request);
+void htm_timer_callback(TimerHandle_t unused);
+void htm_retry_callback(TimerHandle_t unused);
 
 /** OTA DFU service */
 BLEDfu ble_dfu;
 /** Device information service */
 BLEDis ble_dis;
+
+/** Battery service */
+BLEBas ble_bas;
+
 /* Health Thermometer Service Definitions
  * Health Thermometer Service:  0x1809
  * Temperature Measurement Char: 0x2A1C
+ * Intermediate Temperature Char: 0x2A1E
+ * Measurement Interval Char: 0x2A21
+ * Measurement Interval ms Char: 5A4E0101-7B3F-4C61-9D2A-3E5F6B8A1C20 (vendor specific)
  */
+static const uint8_t htm_interval_ms_uuid[16] = {0x20, 0x1C, 0x8A, 0x6B, 0x5F, 0x3E, 0x2A, 0x9D,
+												 0x61, 0x4C, 0x3F, 0x7B, 0x01, 0x01, 0x4E, 0x5A};
 BLEService htms = BLEService(UUID16_SVC_HEALTH_THERMOMETER);
 BLECharacteristic htmc = BLECharacteristic(UUID16_CHR_TEMPERATURE_MEASUREMENT);
+BLECharacteristic htmic = BLECharacteristic(UUID16_CHR_INTERMEDIATE_TEMPERATURE);
+BLECharacteristic htmmi = BLECharacteristic(UUID16_CHR_MEASUREMENT_INTERVAL);
+BLECharacteristic htmmims = BLECharacteristic(htm_interval_ms_uuid);
 
-/** Flag if HTM indication is active */
+/** Flag if HTM indication is active on at least one connection */
 bool htm_active = false;
+/** Flag if the timer asked for a new HTM value */
+static volatile bool htm_tick = false;
+/** Timer for the periodic HTM indications */
+SoftwareTimer htm_timer;
+/** One shot timer to send a failed HTM indication again */
+SoftwareTimer htm_retry_timer;
+/** Time between two HTM indications in ms, 0 = no periodic indications */
+volatile uint32_t htm_interval_ms = HTM_DEFAULT_INTERVAL;
+/** Interval written by a client, applied by the loop task */
+static volatile uint32_t htm_interval_written = 0;
+/** Flag if htm_interval_written holds a new value */
+static volatile bool htm_interval_changed = false;
+
+/** Encoded HTM indication waiting for a connection */
+struct htm_packet_s
+{
+	uint8_t len;
+	uint8_t data[13];
+};
+
+/**
+ * HTM state of one connection
+ * Written by the BLE callbacks and by the loop task, every read-modify-write
+ * is done in a critical section. The loop does not hold it during the
+ * blocking indicate(), it checks the handle and generation afterwards.
+ */
+struct htm_conn_s
+{
+	/** Connection handle, BLE_CONN_HANDLE_INVALID if the entry is free */
+	uint16_t handle;
+	/** Flag if the connection enabled the Temperature Measurement indication */
+	bool indicate;
+	/** Indications waiting to be sent, the oldest is dropped if the queue is full */
+	htm_packet_s queue[HTM_QUEUE_SIZE];
+	uint8_t queue_head;
+	uint8_t queue_count;
+	/** Failed attempts to send the oldest indication */
+	uint8_t retries;
+	/** Time of the next attempt after a failed indication */
+	uint32_t retry_time;
+	/** Flag if the connection enabled the indication and waits for its first value */
+	bool first;
+	/** Incremented when a callback resets the entry, the queue of an older generation is gone */
+	uint8_t generation;
+};
+static htm_conn_s htm_conns[BLE_MAX_CONN];
+/** Number of connections */
+static uint8_t ble_conn_count = 0;
+/** Attempts to send an HTM indication before it is dropped */
+#define HTM_SEND_RETRIES 3
+/** Time between two attempts to send an HTM indication in ms */
+#define HTM_RETRY_DELAY 100
+/** Valid Range descriptor */
+#define UUID16_DSC_VALID_RANGE 0x2906
+/** ATT error 0xFF of a value outside the Valid Range descriptor */
+#define HTM_ATT_OUT_OF_RANGE BLE_GATT_STATUS_ATTERR_CPS_OUT_OF_RANGE
+
+/**
+ * @brief Find the HTM state of a connection
+ *
+ * @param conn_handle connection handle, BLE_CONN_HANDLE_INVALID finds a free entry
+ * @return htm_conn_s* HTM state or NULL if not found
+ */
+static htm_conn_s *htm_conn_find(uint16_t conn_handle)
+{
+	for (int idx = 0; idx < BLE_MAX_CONN; idx++)
+	{
+		if (htm_conns[idx].handle == conn_handle)
+		{
+			return &htm_conns[idx];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Reset the HTM state of a connection, call in a critical section
+ *
+ * @param htm_conn entry to reset
+ * @param conn_handle new connection handle, BLE_CONN_HANDLE_INVALID to free the entry
+ * @param indicate flag if the connection enabled the indication
+ */
+static void htm_conn_reset(htm_conn_s &htm_conn, uint16_t conn_handle, bool indicate)
+{
+	htm_conn.handle = conn_handle;
+	htm_conn.indicate = indicate;
+	htm_conn.queue_head = 0;
+	htm_conn.queue_count = 0;
+	htm_conn.retries = 0;
+	htm_conn.first = indicate;
+	htm_conn.generation++;
+}
+
+/**
+ * @brief Update htm_active from the subscriptions of all connections,
+ * call in a critical section
+ */
+static void htm_update_active(void)
+{
+	bool active = false;
+	for (int idx = 0; idx < BLE_MAX_CONN; idx++)
+	{
+		active |= (htm_conns[idx].handle != BLE_CONN_HANDLE_INVALID) && htm_conns[idx].indicate;
+	}
+	htm_active = active;
+}
 
 // Connect callback
 void connect_callback(uint16_t conn_handle);
+// Secured callback
+void secured_callback(uint16_t conn_handle);
 // Disconnect callback
 void disconnect_callback(uint16_t conn_handle, uint8_t reason);
 // Uart RX callback
@@ -44,13 +167,18 @@ void init_ble(void)
 	// more SRAM required by SoftDevice
 	// Note: All config***() function must be called before begin()
 	Bluefruit.configPrphBandwidth(BANDWIDTH_MAX);
-	Bluefruit.configPrphConn(128, BLE_GAP_EVENT_LENGTH_MIN, 16, 16);
+	// MTU 247 for full stream batches, 7.5 ms event length for data length extension
+	Bluefruit.configPrphConn(247, 6, 16, 16);
 
-	// Start BLE
-	Bluefruit.begin(1, 0);
+	// Start BLE with BLE_MAX_CONN peripheral connections
+	Bluefruit.begin(BLE_MAX_CONN, 0);
+	for (int idx = 0; idx < BLE_MAX_CONN; idx++)
+	{
+		htm_conns[idx].handle = BLE_CONN_HANDLE_INVALID;
+	}
 
-	// Set max power. Accepted values are: (min) -40, -20, -16, -12, -8, -4, 0, 2, 3, 4, 5, 6, 7, 8 (max)
-	Bluefruit.setTxPower(8);
+	// TX power and advertising interval are set by power_apply() for the power state
+	// Accepted TX power values are: (min) -40, -20, -16, -12, -8, -4, 0, 2, 3, 4, 5, 6, 7, 8 (max)
 
 	// Create device name
 	char helper_string[256] = {0};
@@ -70,6 +198,13 @@ void init_ble(void)
 	// Set connection/disconnect callbacks
 	Bluefruit.Periph.setConnectCallback(connect_callback);
 	Bluefruit.Periph.setDisconnectCallback(disconnect_callback);
+	Bluefruit.Security.setSecuredCallback(secured_callback);
+
+	// Client for the Current Time Service of the phone
+	init_clock();
+
+	// Connection parameters follow the activity on the connection
+	init_conn_params();
 
 	// Configure and Start Device Information Service
 	ble_dis.setManufacturer("RAKwireless");
@@ -86,9 +221,16 @@ void init_ble(void)
 	// Start the DFU service
 	ble_dfu.begin();
 
+	// Start the battery service
+	ble_bas.begin();
+	ble_bas.write(battery_soc());
+
 	// Start the HTM service
 	setup_htm();
 
+	// Start the sample stream service
+	setup_stream();
+
 	// Advertising packet
 	Bluefruit.Advertising.addFlags(BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE); //
 	Bluefruit.Advertising.addService(htms);
@@ -108,6 +250,9 @@ void init_ble(void)
 	Bluefruit.Advertising.setInterval(32, 244); // in unit of 0.625 ms
 	Bluefruit.Advertising.setFastTimeout(15);	// number of seconds in fast mode
 	Bluefruit.Advertising.start(0);				// 0 = Don't stop advertising
+
+	// Switch to the settings of the power state
+	power_apply();
 }
 
 /**
@@ -116,8 +261,35 @@ void init_ble(void)
  */
 void connect_callback(uint16_t conn_handle)
 {
-	(void)conn_handle;
-	MYLOG("BLE", "Connected");
+	ble_conn_count++;
+	MYLOG("BLE", "Connected %d, %d connections", conn_handle, ble_conn_count);
+	taskENTER_CRITICAL();
+	htm_conn_s *htm_conn = htm_conn_find(BLE_CONN_HANDLE_INVALID);
+	if (htm_conn != NULL)
+	{
+		htm_conn_reset(*htm_conn, conn_handle, false);
+	}
+	taskEXIT_CRITICAL();
+	power_request(POWER_CONNECTED, true);
+	conn_params_connected(conn_handle);
+	// Get the time from the phone if it has the Current Time Service
+	clock_connected(conn_handle);
+
+	// Advertising stops on connect, keep it running while more centrals can connect
+	if (ble_conn_count < BLE_MAX_CONN)
+	{
+		Bluefruit.Advertising.start(0);
+	}
+}
+
+/**
+ * @brief  Callback when the connection is encrypted
+ * @param  conn_handle: Connection handle id
+ */
+void secured_callback(uint16_t conn_handle)
+{
+	MYLOG("BLE", "Connection secured");
+	clock_secured(conn_handle);
 }
 
 /**
@@ -127,10 +299,28 @@ void connect_callback(uint16_t conn_handle)
  */
 void disconnect_callback(uint16_t conn_handle, uint8_t reason)
 {
-	(void)conn_handle;
 	(void)reason;
-	MYLOG("BLE", "Disconnected");
-	htm_active = false;
+	if (ble_conn_count != 0)
+	{
+		ble_conn_count--;
+	}
+	MYLOG("BLE", "Disconnected %d, %d connections", conn_handle, ble_conn_count);
+	power_request(POWER_CONNECTED, ble_conn_count != 0);
+	conn_params_disconnected(conn_handle);
+	taskENTER_CRITICAL();
+	htm_conn_s *htm_conn = htm_conn_find(conn_handle);
+	if (htm_conn != NULL)
+	{
+		htm_conn_reset(*htm_conn, BLE_CONN_HANDLE_INVALID, false);
+	}
+	htm_update_active();
+	taskEXIT_CRITICAL();
+	if (!htm_active)
+	{
+		htm_stop();
+	}
+	// The sample stream is recalculated by the loop task
+	events_post(STREAM_CONFIG);
 }
 
 /**
@@ -149,20 +339,34 @@ void cccd_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint16_t cccd_valu
 	// this handler is used for multiple CCCD records.
 	if (chr->uuid == htmc.uuid)
 	{
-		if (chr->indicateEnabled(conn_hdl))
+		bool indicate = chr->indicateEnabled(conn_hdl);
+		taskENTER_CRITICAL();
+		htm_conn_s *htm_conn = htm_conn_find(conn_hdl);
+		if (htm_conn != NULL)
+		{
+			htm_conn_reset(*htm_conn, conn_hdl, indicate);
+			htm_update_active();
+		}
+		taskEXIT_CRITICAL();
+		if (htm_conn == NULL)
 		{
-			MYLOG("BLE", "HTM indication enabled");
+			return;
+		}
+		if (indicate)
+		{
+			MYLOG("BLE", "HTM indication enabled on %d", conn_hdl);
 			// Wake up loop to start BLE HTM indication
-			// Start task to read temperature every 1 second and indicate it
-			htm_active = true;
-			g_task_event_type = BLE_START_DATA;
-			xSemaphoreGiveFromISR(g_task_sem, &xHigherPriorityTaskWoken);
+			// The loop starts the timer to indicate the temperature every htm_interval_ms
+			events_post(BLE_START_DATA);
 		}
 		else
 		{
-			MYLOG("BLE", "HTM indication disabled");
-			// Stop BLE HTM indication
-			htm_active = false;
+			MYLOG("BLE", "HTM indication disabled on %d", conn_hdl);
+			// Stop BLE HTM indication if no other connection wants it
+			if (!htm_active)
+			{
+				htm_stop();
+			}
 		}
 	}
 }
@@ -181,8 +385,10 @@ void setup_htm(void)
 	// Temperature Measurement      0x2A1C  Mandatory   Indicate
 	//
 	// Temperature Type             0x2A1D  Optional    Read                  <-- Not used here
-	// Intermediate Temperature     0x2A1E  Optional    Read, Notify          <-- Not used here
-	// Measurement Interval         0x2A21  Optional    Read, Write, Indicate <-- Not used here
+	// Intermediate Temperature     0x2A1E  Optional    Notify
+	// Measurement Interval         0x2A21  Optional    Read, Write, Indicate
+	//
+	// Measurement Interval ms      custom  Vendor      Read, Write
 	htms.begin();
 
 	// Note: You must call .begin() on the BLEService before calling .begin() on
@@ -194,21 +400,28 @@ void setup_htm(void)
 	// See:https://www.bluetooth.com/specifications/gatt/viewer?attributeXmlFile=org.bluetooth.characteristic.temperature_measurement.xml
 	// Properties = Indicte
 	// Min Len    = 6
-	// Max Len    = 6
+	// Max Len    = 13
 	//    B0      = UINT8  - Flag (MANDATORY)
 	//      b3:7  = Reserved
 	//      b2    = Temperature Type Flag (0 = Not present, 1 = Present)
 	//      b1    = Timestamp Flag (0 = Not present, 1 = Present)
 	//      b0    = Unit Flag (0 = Celsius, 1 = Fahrenheit)
 	//    B4:1    = FLOAT  - IEEE-11073 32-bit FLOAT measurement value
-	//    B5      = Temperature Type
+	//    B11:5   = Timestamp, local time of the wall clock
+	//      B6:5  = UINT16 - Year, 0 = unknown
+	//      B7    = UINT8  - Month, 0 = unknown
+	//      B8    = UINT8  - Day, 0 = unknown
+	//      B9    = UINT8  - Hours
+	//      B10   = UINT8  - Minutes
+	//      B11   = UINT8  - Seconds
+	//    B5/B12  = Temperature Type
 	htmc.setProperties(CHR_PROPS_INDICATE);
 	htmc.setPermission(SECMODE_OPEN, SECMODE_NO_ACCESS);
-	htmc.setFixedLen(6);
+	htmc.setMaxLen(13);
 	htmc.setCccdWriteCallback(cccd_callback); // Optionally capture CCCD updates
 	htmc.begin();
-	uint8_t htmdata[6] = {0b00000100, 0, 0, 0, 0, 2}; // Set the characteristic to use Celsius, with type (body) but no timestamp field
-	htmc.write(htmdata, sizeof(htmdata));			  // Use .write for init data
+	uint8_t htmdata[13] = {0b00000110, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2}; // Set the characteristic to use Celsius, with timestamp and type (body)
+	htmc.write(htmdata, sizeof(htmdata));											  // Use .write for init data
 
 	// Temperature Type Value
 	// See: https://www.bluetooth.com/specifications/gatt/viewer?attributeXmlFile=org.bluetooth.characteristic.temperature_type.xml
@@ -224,27 +437,460 @@ void setup_htm(void)
 	//      8     = Toe
 	//      9     = Tympanum (ear drum)
 	//     10:255 = Reserved
+
+	// Configure the Intermediate Temperature characteristic
+	// See: https://www.bluetooth.com/specifications/gatt/viewer?attributeXmlFile=org.bluetooth.characteristic.intermediate_temperature.xml
+	// Properties = Notify
+	// Same format as the Temperature Measurement characteristic, with timestamp
+	// Sends the running mean while a measurement is going on
+	htmic.setProperties(CHR_PROPS_NOTIFY);
+	htmic.setPermission(SECMODE_OPEN, SECMODE_NO_ACCESS);
+	htmic.setMaxLen(13);
+	htmic.begin();
+
+	// Configure the Measurement Interval characteristic
+	// See: https://www.bluetooth.com/specifications/gatt/viewer?attributeXmlFile=org.bluetooth.characteristic.measurement_interval.xml
+	// Properties = Read, Write, Indicate
+	// Fixed Len  = 2
+	//    B1:0    = UINT16 - Time between two indications in seconds, 0 = no periodic indications
+	// Every change of the interval is indicated, see htm_indicate_interval()
+	// Valid Range descriptor, writes outside the range (except 0) are rejected with error 0xFF
+	htmmi.setProperties(CHR_PROPS_READ | CHR_PROPS_WRITE | CHR_PROPS_INDICATE);
+	htmmi.setPermission(SECMODE_OPEN, SECMODE_OPEN);
+	htmmi.setFixedLen(2);
+	htmmi.setWriteAuthorizeCallback(htm_interval_authorize_callback);
+	htmmi.begin();
+	uint16_t htmmi_range[2] = {(HTM_MIN_INTERVAL + 999) / 1000, HTM_MAX_INTERVAL / 1000};
+	htmmi.addDescriptor(BLEUuid(UUID16_DSC_VALID_RANGE), htmmi_range, sizeof(htmmi_range));
+
+	// Configure the vendor specific Measurement Interval ms characteristic
+	// for intervals below one second
+	// Properties = Read, Write
+	// Fixed Len  = 4
+	//    B3:0    = UINT32 - Time between two indications in ms, 0 = no periodic indications
+	// Valid Range descriptor like the Measurement Interval
+	htmmims.setProperties(CHR_PROPS_READ | CHR_PROPS_WRITE);
+	htmmims.setPermission(SECMODE_OPEN, SECMODE_OPEN);
+	htmmims.setFixedLen(4);
+	htmmims.setWriteAuthorizeCallback(htm_interval_authorize_callback);
+	htmmims.begin();
+	uint32_t htmmims_range[2] = {HTM_MIN_INTERVAL, HTM_MAX_INTERVAL};
+	htmmims.addDescriptor(BLEUuid(UUID16_DSC_VALID_RANGE), htmmims_range, sizeof(htmmims_range));
+	htm_set_interval(htm_interval_ms);
+
+	// Timer for the periodic indications, started when the indications are enabled
+	htm_timer.begin(HTM_DEFAULT_INTERVAL, htm_timer_callback);
+	// One shot timer for the next attempt of a failed indication
+	htm_retry_timer.begin(HTM_RETRY_DELAY, htm_retry_callback, NULL, false);
 }
 
 /**
- * @brief Get a single temperature measurement and send it over BLE by indicating
- * 
+ * @brief Timer callback, wakes up the loop to send the next HTM indication
+ *
+ * @param unused
+ */
+void htm_timer_callback(TimerHandle_t unused)
+{
+	(void)unused;
+	htm_tick = true;
+	events_post(BLE_DATA);
+}
+
+/**
+ * @brief Retry timer callback, wakes up the loop to send a failed HTM indication again
+ *
+ * @param unused
+ */
+void htm_retry_callback(TimerHandle_t unused)
+{
+	(void)unused;
+	events_post(BLE_DATA);
+}
+
+/**
+ * @brief Check and clear the request of the timer for a new HTM value
+ *
+ * @return true if a new value is due
+ */
+bool htm_take_tick(void)
+{
+	bool tick = htm_tick;
+	htm_tick = false;
+	return tick;
+}
+
+/**
+ * @brief Start the periodic HTM indications with htm_interval_ms
+ *
+ */
+void htm_start(void)
+{
+	if (htm_active && (htm_interval_ms != 0))
+	{
+		// Changing the period starts the timer as well
+		htm_timer.setPeriod(htm_interval_ms);
+	}
+	// Short intervals need a fast connection
+	conn_activity(CONN_ACT_FAST_HTM, htm_active && (htm_interval_ms != 0) && (htm_interval_ms < CONN_FAST_HTM_INTERVAL));
+}
+
+/**
+ * @brief Stop the periodic HTM indications
+ * The loop is woken up once more to switch off the LEDs
+ *
  */
-void htm_indicate_temp(void)
+void htm_stop(void)
 {
-	uint8_t htmdata[6] = {0b00000100, 0, 0, 0, 0, 2}; // Celsius unit, temperature type = body (2)
+	taskENTER_CRITICAL();
+	for (int idx = 0; idx < BLE_MAX_CONN; idx++)
+	{
+		htm_conn_reset(htm_conns[idx], htm_conns[idx].handle, false);
+	}
+	htm_active = false;
+	taskEXIT_CRITICAL();
+	htm_timer.stop();
+	conn_activity(CONN_ACT_FAST_HTM, false);
+	events_post(BLE_DATA);
+}
 
-	double single_measure = measure_single();
-	float2IEEE11073(single_measure, &htmdata[1]);
-	// Note: We use .indicate instead of .write!
-	// If it is connected but CCCD is not enabled
-	// The characteristic's value is still updated although indicate is not sent
-	if (htmc.indicate(htmdata, sizeof(htmdata)))
+/**
+ * @brief Set the time between two HTM indications
+ * Updates the values of both interval characteristics
+ *
+ * @param interval_ms interval in ms, 0 = no periodic indications
+ */
+void htm_set_interval(uint32_t interval_ms)
+{
+	if ((interval_ms != 0) && (interval_ms < HTM_MIN_INTERVAL))
 	{
-		MYLOG("BLE", "Temperature Measurement updated to: %.2f", single_measure);
+		interval_ms = HTM_MIN_INTERVAL;
+	}
+	htm_interval_ms = interval_ms;
+	MYLOG("BLE", "HTM interval %ld ms", interval_ms);
+	if (interval_ms == 0)
+	{
+		htm_timer.stop();
+		conn_activity(CONN_ACT_FAST_HTM, false);
 	}
 	else
 	{
-		MYLOG("BLE", "ERROR: Indicate not set in the CCCD or not connected!");
+		htm_start();
+	}
+
+	// Sub-second intervals are shown as 1 second in the standard characteristic
+	uint32_t interval_s = (interval_ms + 999) / 1000;
+	htmmi.write16(interval_s > UINT16_MAX ? UINT16_MAX : interval_s);
+	htmmims.write32(interval_ms);
+	// Indications wait for the confirmation, they are sent by the loop task
+	events_post(BLE_CONFIG);
+}
+
+/**
+ * @brief Indicate the Measurement Interval to every connection that enabled it,
+ * handler of the BLE_CONFIG event. An interval written by a client is applied
+ * first, htm_set_interval() posts the event again for the indication.
+ *
+ */
+void htm_indicate_interval(void)
+{
+	taskENTER_CRITICAL();
+	bool changed = htm_interval_changed;
+	uint32_t written = htm_interval_written;
+	htm_interval_changed = false;
+	taskEXIT_CRITICAL();
+	if (changed)
+	{
+		htm_set_interval(written);
+		return;
 	}
-}
\ No newline at end of file
+
+	uint16_t interval_s = htmmi.read16();
+	uint8_t data[2] = {(uint8_t)interval_s, (uint8_t)(interval_s >> 8)};
+	for (uint16_t conn_handle = 0; conn_handle < BLE_MAX_CONNECTION; conn_handle++)
+	{
+		if (Bluefruit.connected(conn_handle) && htmmi.indicateEnabled(conn_handle))
+		{
+			if (!htmmi.indicate(conn_handle, data, sizeof(data)))
+			{
+				MYLOG("BLE", "ERROR: Interval indicate to %d failed!", conn_handle);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Authorize callback for writes to the measurement interval characteristics
+ * Values outside the Valid Range descriptor are rejected with the ATT error
+ * Out of Range, 0 (no periodic indications) is always accepted.
+ * An accepted value is applied by the loop task on the BLE_CONFIG event.
+ *
+ * @param conn_hdl Connection handle
+ * @param chr Pointer to characteristic
+ * @param request write request
+ */
+void htm_interval_authorize_callback(uint16_t conn_hdl, BLECharacteristic *chr, ble_gatts_evt_write_t *request)
+{
+	const uint8_t *data = request->data;
+	uint16_t status = BLE_GATT_STATUS_SUCCESS;
+	uint32_t interval_ms = 0;
+	if ((request->op != BLE_GATTS_OP_WRITE_REQ) || (request->offset != 0))
+	{
+		status = BLE_GATT_STATUS_ATTERR_REQUEST_NOT_SUPPORTED;
+	}
+	else if ((chr->uuid == htmmi.uuid) && (request->len == 2))
+	{
+		interval_ms = (data[0] | (data[1] << 8)) * 1000UL;
+	}
+	else if ((chr->uuid == htmmims.uuid) && (request->len == 4))
+	{
+		interval_ms = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+	}
+	else
+	{
+		status = BLE_GATT_STATUS_ATTERR_INVALID_ATT_VAL_LENGTH;
+	}
+	if ((status == BLE_GATT_STATUS_SUCCESS) && (interval_ms != 0) && ((interval_ms < HTM_MIN_INTERVAL) || (interval_ms > HTM_MAX_INTERVAL)))
+	{
+		status = HTM_ATT_OUT_OF_RANGE;
+	}
+
+	ble_gatts_rw_authorize_reply_params_t reply;
+	memset(&reply, 0, sizeof(reply));
+	reply.type = BLE_GATTS_AUTHORIZE_TYPE_WRITE;
+	reply.params.write.gatt_status = status;
+	if (status != BLE_GATT_STATUS_SUCCESS)
+	{
+		MYLOG("BLE", "Interval write rejected, status 0x%04X", status);
+		sd_ble_gatts_rw_authorize_reply(conn_hdl, &reply);
+		return;
+	}
+	// The value of both characteristics is written by htm_set_interval()
+	reply.params.write.update = 0;
+	sd_ble_gatts_rw_authorize_reply(conn_hdl, &reply);
+
+	taskENTER_CRITICAL();
+	htm_interval_written = interval_ms;
+	htm_interval_changed = true;
+	taskEXIT_CRITICAL();
+	events_post(BLE_CONFIG);
+}
+
+/**
+ * @brief Get the latest temperature and queue it as HTM indication for every
+ * subscribed connection. The sensor is only read if the cached result is stale,
+ * the value is encoded once for all connections.
+ * htm_send_queued() sends the indications.
+ * 
+ * @param only_first true to queue the value only for connections that
+ * just enabled the indication and did not get a value yet
+ */
+void htm_indicate_temp(bool only_first)
+{
+	htm_packet_s packet;
+	packet.len = 13;
+	packet.data[0] = 0b00000110; // Celsius unit, timestamp and temperature type present
+
+	measure_result_s result;
+	measure_latest(result);
+	float2IEEE11073(result.value, &packet.data[1]);
+	htm_encode_time(&packet.data[5], clock_now());
+	packet.data[12] = 2; // Temperature type = body (2)
+	MYLOG("BLE", "Temperature Measurement updated to: %.2f, N = %d", result.value, result.n);
+
+	taskENTER_CRITICAL();
+	for (int idx = 0; idx < BLE_MAX_CONN; idx++)
+	{
+		htm_conn_s &htm_conn = htm_conns[idx];
+		if ((htm_conn.handle == BLE_CONN_HANDLE_INVALID) || !htm_conn.indicate || (only_first && !htm_conn.first))
+		{
+			continue;
+		}
+		htm_conn.first = false;
+		if (htm_conn.queue_count == HTM_QUEUE_SIZE)
+		{
+			// Client is too slow, drop the oldest value
+			htm_conn.queue_head = (htm_conn.queue_head + 1) % HTM_QUEUE_SIZE;
+			htm_conn.queue_count--;
+		}
+		htm_conn.queue[(htm_conn.queue_head + htm_conn.queue_count) % HTM_QUEUE_SIZE] = packet;
+		htm_conn.queue_count++;
+	}
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief Send one queued HTM indication to every connection that has one
+ * Each indication waits for the confirmation of its client, sending one
+ * per connection and round keeps a slow client from blocking the others.
+ * A failed indication stays queued and is sent again in the next round,
+ * it is only dropped after HTM_SEND_RETRIES attempts
+ *
+ * @return true if more indications are waiting
+ */
+bool htm_send_queued(void)
+{
+	bool pending = false;
+	bool retry = false;
+	for (int idx = 0; idx < BLE_MAX_CONN; idx++)
+	{
+		htm_conn_s &htm_conn = htm_conns[idx];
+		// Take the packet in a critical section, indicate() blocks until the client confirms
+		taskENTER_CRITICAL();
+		uint16_t conn_handle = htm_conn.handle;
+		uint8_t generation = htm_conn.generation;
+		bool skip = (conn_handle == BLE_CONN_HANDLE_INVALID) || (htm_conn.queue_count == 0);
+		bool wait = !skip && (htm_conn.retries != 0) && ((int32_t)(millis() - htm_conn.retry_time) < 0);
+		htm_packet_s packet = htm_conn.queue[htm_conn.queue_head];
+		taskEXIT_CRITICAL();
+		if (skip)
+		{
+			continue;
+		}
+		if (wait)
+		{
+			// Wait for the retry timer
+			retry = true;
+			continue;
+		}
+		bool sent = htmc.indicate(conn_handle, packet.data, packet.len);
+
+		taskENTER_CRITICAL();
+		if ((htm_conn.handle != conn_handle) || (htm_conn.generation != generation) || (htm_conn.queue_count == 0))
+		{
+			// Disconnected or CCCD written during indicate(), the queue was reset
+			taskEXIT_CRITICAL();
+			continue;
+		}
+		bool failed = false;
+		if (sent)
+		{
+			htm_conn.retries = 0;
+		}
+		else if (++htm_conn.retries < HTM_SEND_RETRIES)
+		{
+			htm_conn.retry_time = millis() + HTM_RETRY_DELAY;
+			taskEXIT_CRITICAL();
+			MYLOG("BLE", "Indicate to %d failed, retry", conn_handle);
+			retry = true;
+			continue;
+		}
+		else
+		{
+			htm_conn.retries = 0;
+			failed = true;
+		}
+		htm_conn.queue_head = (htm_conn.queue_head + 1) % HTM_QUEUE_SIZE;
+		htm_conn.queue_count--;
+		pending |= htm_conn.queue_count != 0;
+		taskEXIT_CRITICAL();
+		if (failed)
+		{
+			MYLOG("BLE", "ERROR: Indicate to %d failed!", conn_handle);
+		}
+	}
+	if (retry)
+	{
+		// A failed indication is sent again after HTM_RETRY_DELAY, not in a tight loop
+		htm_retry_timer.start();
+	}
+	return pending;
+}
+
+/**
+ * @brief Update the battery level of the battery service, handler of the
+ * BATT_UPDATE event. Connected centrals with enabled notifications are informed
+ */
+void ble_battery_update(void)
+{
+	uint8_t soc = battery_soc();
+	ble_bas.write(soc);
+	for (uint16_t conn_handle = 0; conn_handle < BLE_MAX_CONNECTION; conn_handle++)
+	{
+		if (Bluefruit.connected(conn_handle))
+		{
+			ble_bas.notify(conn_handle, soc);
+		}
+	}
+}
+
+/**
+ * @brief Send the running mean of a measurement as
+ * HTM Intermediate Temperature notification
+ *
+ * @param value temperature in Celsius
+ */
+void htm_notify_intermediate(float value)
+{
+	uint8_t htmdata[13] = {0b00000110}; // Celsius unit, timestamp and temperature type present
+	float2IEEE11073(value, &htmdata[1]);
+	htm_encode_time(&htmdata[5], clock_now());
+	htmdata[12] = 2; // Temperature type = body (2)
+	ble_notify_all(htmic, htmdata, sizeof(htmdata));
+}
+
+/**
+ * @brief Write a time as BLE Date Time
+ *
+ * @param data receives the 7 bytes Date Time
+ * @param epoch seconds since 1970-01-01, 0 = unknown
+ */
+void htm_encode_time(uint8_t *data, uint32_t epoch)
+{
+	// Year, month and day 0 mean unknown
+	clock_date_s date;
+	clock_to_date(epoch, date);
+	data[0] = (uint8_t)date.year;
+	data[1] = (uint8_t)(date.year >> 8);
+	data[2] = date.month;
+	data[3] = date.day;
+	data[4] = date.hours;
+	data[5] = date.minutes;
+	data[6] = date.seconds;
+}
+
+/**
+ * @brief Send a record from the measurement log as HTM indication with timestamp
+ * to every subscribed connection, waits for the confirmation of the clients
+ *
+ * @param record stored measurement
+ * @return true if the client confirmed the indication
+ */
+bool htm_indicate_record(const log_record_s &record)
+{
+	uint8_t htmdata[13] = {0b00000110}; // Celsius unit, timestamp and temperature type present
+	float2IEEE11073(record.mean, &htmdata[1]);
+	htm_encode_time(&htmdata[5], record.epoch);
+	htmdata[12] = 2; // Temperature type = body (2)
+
+	// The record counts as sent if at least one client confirmed it
+	bool confirmed = false;
+	for (int idx = 0; idx < BLE_MAX_CONN; idx++)
+	{
+		taskENTER_CRITICAL();
+		uint16_t conn_handle = htm_conns[idx].indicate ? htm_conns[idx].handle : BLE_CONN_HANDLE_INVALID;
+		taskEXIT_CRITICAL();
+		if (conn_handle != BLE_CONN_HANDLE_INVALID)
+		{
+			confirmed |= htmc.indicate(conn_handle, htmdata, sizeof(htmdata));
+		}
+	}
+	return confirmed;
+}
+
+/**
+ * @brief Send a notification to every connection that enabled it
+ *
+ * @param chr characteristic
+ * @param data value
+ * @param len length of the value
+ */
+void ble_notify_all(BLECharacteristic &chr, const void *data, uint16_t len)
+{
+	for (uint16_t conn_handle = 0; conn_handle < BLE_MAX_CONNECTION; conn_handle++)
+	{
+		if (Bluefruit.connected(conn_handle) && chr.notifyEnabled(conn_handle))
+		{
+			chr.notify(conn_handle, data, len);
+		}
+	}
+}
@@ -0,0 +1,212 @@
+/**
+ * @file clock.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Wall clock, set over BLE and kept running by the RTC based millis()
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+/** Current Time Service client, used if the phone offers it (iOS) */
+BLEClientCts ble_cts;
+
+/** Timer to move the reference point before millis() overflows */
+SoftwareTimer clock_timer;
+/** Move the reference point every hour */
+#define CLOCK_ROLL_INTERVAL 3600000
+
+/** Time at the reference point in seconds since 1970-01-01, 0 = not set */
+static volatile uint32_t clock_epoch = 0;
+/** millis() at the reference point */
+static volatile uint32_t clock_ms = 0;
+
+/**
+ * @brief Set the wall clock
+ *
+ * @param epoch local time in seconds since 1970-01-01
+ */
+void clock_set(uint32_t epoch)
+{
+	taskENTER_CRITICAL();
+	clock_epoch = epoch;
+	clock_ms = millis();
+	taskEXIT_CRITICAL();
+	MYLOG("CLK", "Clock set to %ld", epoch);
+}
+
+/**
+ * @brief Get the wall clock time
+ *
+ * @return uint32_t local time in seconds since 1970-01-01, 0 if the clock was not set
+ */
+uint32_t clock_now(void)
+{
+	taskENTER_CRITICAL();
+	uint32_t epoch = clock_epoch;
+	uint32_t elapsed = millis() - clock_ms;
+	taskEXIT_CRITICAL();
+	if (epoch == 0)
+	{
+		return 0;
+	}
+	return epoch + elapsed / 1000;
+}
+
+/**
+ * @brief Move the reference point to now, keeps the
+ * elapsed time far away from the millis() overflow
+ *
+ * @param unused
+ */
+static void clock_roll(TimerHandle_t unused)
+{
+	(void)unused;
+	taskENTER_CRITICAL();
+	if (clock_epoch != 0)
+	{
+		uint32_t elapsed_s = (millis() - clock_ms) / 1000;
+		clock_epoch += elapsed_s;
+		clock_ms += elapsed_s * 1000;
+	}
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief Convert a date to seconds since 1970-01-01
+ *
+ * @param date date and time
+ * @return uint32_t seconds since 1970-01-01, 0 if the date is unknown
+ */
+uint32_t clock_from_date(const clock_date_s &date)
+{
+	if ((date.year < 1970) || (date.month == 0) || (date.month > 12) || (date.day == 0))
+	{
+		return 0;
+	}
+	// Days since 1970-01-01 from the civil date, see http://howardhinnant.github.io/date_algorithms.html
+	uint32_t year = date.year - (date.month <= 2 ? 1 : 0);
+	uint32_t era = year / 400;
+	uint32_t yoe = year - era * 400;
+	uint32_t doy = (153 * (date.month > 2 ? date.month - 3 : date.month + 9) + 2) / 5 + date.day - 1;
+	uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	uint32_t days = era * 146097 + doe - 719468;
+	return days * 86400 + date.hours * 3600 + date.minutes * 60 + date.seconds;
+}
+
+/**
+ * @brief Convert seconds since 1970-01-01 to a date
+ *
+ * @param epoch seconds since 1970-01-01, 0 = unknown
+ * @param date receives the date, all 0 if unknown
+ */
+void clock_to_date(uint32_t epoch, clock_date_s &date)
+{
+	memset(&date, 0, sizeof(date));
+	if (epoch == 0)
+	{
+		return;
+	}
+	uint32_t days = epoch / 86400;
+	uint32_t secs = epoch % 86400;
+
+	// Civil date from days since 1970-01-01, see http://howardhinnant.github.io/date_algorithms.html
+	uint32_t z = days + 719468;
+	uint32_t era = z / 146097;
+	uint32_t doe = z - era * 146097;
+	uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	uint32_t mp = (5 * doy + 2) / 153;
+	date.day = doy - (153 * mp + 2) / 5 + 1;
+	date.month = mp < 10 ? mp + 3 : mp - 9;
+	date.year = yoe + era * 400 + (date.month <= 2 ? 1 : 0);
+	date.hours = secs / 3600;
+	date.minutes = (secs / 60) % 60;
+	date.seconds = secs % 60;
+}
+
+/**
+ * @brief Set the clock from the Current Time Service of the phone
+ *
+ */
+static void clock_from_cts(void)
+{
+	clock_date_s date;
+	date.year = ble_cts.Time.year;
+	date.month = ble_cts.Time.month;
+	date.day = ble_cts.Time.day;
+	date.hours = ble_cts.Time.hour;
+	date.minutes = ble_cts.Time.minute;
+	date.seconds = ble_cts.Time.second;
+	uint32_t epoch = clock_from_date(date);
+	if (epoch != 0)
+	{
+		clock_set(epoch);
+	}
+}
+
+/**
+ * @brief Callback when the phone changed its time
+ *
+ * @param reason adjust reason
+ */
+static void clock_cts_adjust_callback(uint8_t reason)
+{
+	(void)reason;
+	clock_from_cts();
+}
+
+/**
+ * @brief Initialize the Current Time Service client,
+ * must be called before the services are started
+ *
+ */
+void init_clock(void)
+{
+	ble_cts.begin();
+	ble_cts.setAdjustCallback(clock_cts_adjust_callback);
+
+	clock_timer.begin(CLOCK_ROLL_INTERVAL, clock_roll);
+	clock_timer.start();
+}
+
+/**
+ * @brief Look for the Current Time Service of a new connection
+ * Reading the time requires an encrypted connection, so pairing
+ * is requested if the phone has the service
+ *
+ * @param conn_handle Connection handle
+ */
+void clock_connected(uint16_t conn_handle)
+{
+	if (ble_cts.discover(conn_handle))
+	{
+		MYLOG("CLK", "Current Time Service found");
+		BLEConnection *connection = Bluefruit.Connection(conn_handle);
+		if (connection != NULL)
+		{
+			connection->requestPairing();
+		}
+	}
+}
+
+/**
+ * @brief Read the time after the connection is encrypted
+ *
+ * @param conn_handle Connection handle
+ */
+void clock_secured(uint16_t conn_handle)
+{
+	(void)conn_handle;
+	if (ble_cts.discovered())
+	{
+		ble_cts.enableAdjust();
+		if (ble_cts.getCurrentTime())
+		{
+			clock_from_cts();
+		}
+	}
+}
@@ -14,14 +14,436 @@
 /** Display class */
 SSD1306Wire display(0x3c, WB_I2C1_SDA, WB_I2C1_SCL, GEOMETRY_128_64);
 
-/** Battery level in mV */
-float batt_level;
-/** Millivolts per LSB 3.0V ADC range and 12-bit ADC resolution = 3000mV/4096 */
-#define VBAT_MV_PER_LSB (0.73242188F)
-/** Compensation factor for the VBAT divider */
-#define VBAT_DIVIDER_COMP (1.73)
-/** Real milli Volts per LSB including compensation */
-#define REAL_VBAT_MV_PER_LSB (VBAT_DIVIDER_COMP * VBAT_MV_PER_LSB)
+/** Display size */
+#define DISPLAY_WIDTH 128
+#define DISPLAY_PAGES 8
+
+/** Screen layout */
+#define TOP_LINE_Y 1
+#define BOTTOM_LINE_Y 28
+#define FOOTER_Y 54
+#define PROGRESS_WIDTH 81
+#define LINE_LEN 24
+
+/** Glyph cache size */
+#define CACHED_FONTS 2
+
+/** Retained content of the screen, changed by the display_* functions */
+struct display_scene_s
+{
+	bool on;
+	char lines[2][LINE_LEN];
+	bool show_batt;
+	bool show_progress;
+	uint8_t progress;
+	/** Battery voltage in mV, sampled when the battery level is requested */
+	int32_t batt_mv;
+};
+
+/** Scene requested by the application */
+static display_scene_s scene = {false, {"", ""}, false, false, 0, 0};
+/** Scene that is currently on the screen */
+static display_scene_s rendered = {false, {"", ""}, false, false, 0, 0};
+/** Width of the text lines on the screen */
+static uint16_t rendered_width[2] = {0, 0};
+/** Battery text on the screen */
+static char rendered_batt[16] = "";
+static uint16_t rendered_batt_width = 0;
+
+/** Changed columns per display page, a page is clean if first > last */
+static uint8_t dirty_first[DISPLAY_PAGES] = {DISPLAY_WIDTH, DISPLAY_WIDTH, DISPLAY_WIDTH, DISPLAY_WIDTH,
+											 DISPLAY_WIDTH, DISPLAY_WIDTH, DISPLAY_WIDTH, DISPLAY_WIDTH};
+static uint8_t dirty_last[DISPLAY_PAGES] = {0};
+/** Nesting level of display_begin_frame() */
+static volatile uint8_t frame_depth = 0;
+
+/** Render task */
+static TaskHandle_t display_task_handle = NULL;
+/** Flag if the scene changed since the last frame */
+static volatile bool render_pending = false;
+/** Min time between two frames in ms, 0 = no limit */
+static uint32_t frame_interval = 1000 / DISPLAY_DEFAULT_FPS;
+/** Time of the last frame */
+static uint32_t last_frame = 0;
+
+/** Statistics of the running second and of the last full second */
+static display_stats_s stats_running = {0, 0, 0};
+static display_stats_s stats_last = {0, 0, 0};
+static uint32_t stats_start = 0;
+
+/**
+ * @brief Mark an area of the display as changed
+ *
+ * @param x left edge
+ * @param y top edge
+ * @param width width in pixels
+ * @param height height in pixels
+ */
+static void display_mark_dirty(int16_t x, int16_t y, int16_t width, int16_t height)
+{
+	int16_t x_end = x + width - 1;
+	int16_t y_end = y + height - 1;
+	if ((x_end < 0) || (y_end < 0) || (x >= DISPLAY_WIDTH) || (y >= DISPLAY_PAGES * 8))
+	{
+		return;
+	}
+	x = x < 0 ? 0 : x;
+	y = y < 0 ? 0 : y;
+	x_end = x_end >= DISPLAY_WIDTH ? DISPLAY_WIDTH - 1 : x_end;
+	y_end = y_end >= DISPLAY_PAGES * 8 ? DISPLAY_PAGES * 8 - 1 : y_end;
+
+	for (int16_t page = y / 8; page <= y_end / 8; page++)
+	{
+		if (x < dirty_first[page])
+		{
+			dirty_first[page] = x;
+		}
+		if (x_end > dirty_last[page])
+		{
+			dirty_last[page] = x_end;
+		}
+	}
+}
+
+/**
+ * @brief Send the changed parts of the display buffer to the display
+ * Only the changed columns of the changed pages are sent.
+ */
+static void display_commit(void)
+{
+	for (uint8_t page = 0; page < DISPLAY_PAGES; page++)
+	{
+		if (dirty_first[page] <= dirty_last[page])
+		{
+			uint8_t len = dirty_last[page] - dirty_first[page] + 1;
+			hal_display_write(page, dirty_first[page], &display.buffer[page * DISPLAY_WIDTH + dirty_first[page]], len);
+			stats_running.bytes += len;
+		}
+		dirty_first[page] = DISPLAY_WIDTH;
+		dirty_last[page] = 0;
+	}
+}
+
+/** Fonts with a glyph cache */
+static const uint8_t *const cached_fonts[CACHED_FONTS] = {ArialMT_Plain_24, ArialMT_Plain_10};
+/** Characters in the glyph cache, enough for temperature and battery values */
+static const char cached_chars[] = " -.0123456789CV\xBA";
+/** Glyph cache, rendered once from the font data */
+static glyph_s glyph_cache[CACHED_FONTS][sizeof(cached_chars) - 1];
+
+/**
+ * @brief Render the cached characters from the font data
+ */
+static void display_init_glyph_cache(void)
+{
+	for (uint8_t font_idx = 0; font_idx < CACHED_FONTS; font_idx++)
+	{
+		for (uint8_t char_idx = 0; char_idx < sizeof(cached_chars) - 1; char_idx++)
+		{
+			glyph_render(cached_fonts[font_idx], (uint8_t)cached_chars[char_idx], glyph_cache[font_idx][char_idx]);
+		}
+	}
+}
+
+/**
+ * @brief Find a character in the glyph cache
+ *
+ * @param font_idx index in cached_fonts
+ * @param code character
+ * @return glyph_s* cached glyph or NULL if the character is not cached
+ */
+static glyph_s *display_find_glyph(uint8_t font_idx, uint8_t code)
+{
+	const char *found = (const char *)memchr(cached_chars, code, sizeof(cached_chars) - 1);
+	if ((found == NULL) || (code == 0))
+	{
+		return NULL;
+	}
+	glyph_s *glyph = &glyph_cache[font_idx][found - cached_chars];
+	return glyph->valid ? glyph : NULL;
+}
+
+/**
+ * @brief Draw a text from the glyph cache
+ * Falls back to drawString() if a character is not cached
+ *
+ * @param x reference position of the text, depends on the alignment
+ * @param y top edge of the text
+ * @param font_idx index in cached_fonts
+ * @param text text to draw, UTF-8
+ * @param align TEXT_ALIGN_LEFT, TEXT_ALIGN_CENTER or TEXT_ALIGN_RIGHT
+ * @return uint16_t width of the text in pixels
+ */
+static uint16_t display_draw_text(int16_t x, int16_t y, uint8_t font_idx, const char *text, OLEDDISPLAY_TEXT_ALIGNMENT align)
+{
+	glyph_s *glyphs[LINE_LEN];
+	uint8_t num_glyphs = 0;
+	uint16_t width = 0;
+	bool cached = true;
+
+	for (const char *next = text; *next != 0; next++)
+	{
+		// Latin-1 characters are 0xC2 + code in UTF-8
+		if ((uint8_t)*next == 0xC2)
+		{
+			continue;
+		}
+		glyph_s *glyph = display_find_glyph(font_idx, (uint8_t)*next);
+		if ((glyph == NULL) || (num_glyphs == LINE_LEN))
+		{
+			cached = false;
+			break;
+		}
+		glyphs[num_glyphs++] = glyph;
+		width += glyph->advance;
+	}
+
+	if (!cached)
+	{
+		display.setFont(cached_fonts[font_idx]);
+		display.setTextAlignment(align);
+		display.drawString(x, y, text);
+		return display.getStringWidth(text, strlen(text));
+	}
+
+	if (align == TEXT_ALIGN_CENTER)
+	{
+		x -= width / 2;
+	}
+	else if (align == TEXT_ALIGN_RIGHT)
+	{
+		x -= width;
+	}
+
+	for (uint8_t glyph_idx = 0; glyph_idx < num_glyphs; glyph_idx++)
+	{
+		glyph_blit(display.buffer, DISPLAY_WIDTH, DISPLAY_PAGES, x, y, *glyphs[glyph_idx]);
+		x += glyphs[glyph_idx]->advance;
+	}
+	return width;
+}
+
+/**
+ * @brief Draw one of the text lines
+ *
+ * @param line_idx 0 = top line, 1 = bottom line
+ * @param text new text
+ */
+static void display_render_line(uint8_t line_idx, const char *text)
+{
+	int16_t line_y = line_idx == 0 ? TOP_LINE_Y : BOTTOM_LINE_Y;
+	int16_t band_y = line_idx == 0 ? 0 : BOTTOM_LINE_Y;
+	int16_t band_height = line_idx == 0 ? BOTTOM_LINE_Y : FOOTER_Y - BOTTOM_LINE_Y;
+
+	// Remove the old text
+	display.setColor(BLACK);
+	display.fillRect(0, band_y, DISPLAY_WIDTH, band_height);
+	display.setColor(WHITE);
+	display_mark_dirty(64 - rendered_width[line_idx] / 2 - 1, band_y, rendered_width[line_idx] + 2, band_height);
+
+	uint16_t width = display_draw_text(64, line_y, 0, text, TEXT_ALIGN_CENTER);
+	display_mark_dirty(64 - width / 2 - 1, band_y, width + 2, band_height);
+	rendered_width[line_idx] = width;
+}
+
+/**
+ * @brief Draw the battery level in the lower right corner
+ *
+ * @param show if false the battery level is removed
+ * @param batt_mv battery voltage in mV
+ */
+static void display_render_batt(bool show, int32_t batt_mv)
+{
+	char batt_text[16] = {0};
+	if (show)
+	{
+		format_voltage(batt_text, batt_mv);
+	}
+	if (strcmp(batt_text, rendered_batt) == 0)
+	{
+		return;
+	}
+	MYLOG("DIS", "Batt: %s", batt_text);
+
+	uint16_t old_width = rendered_batt_width;
+	display.setColor(BLACK);
+	display.fillRect(DISPLAY_WIDTH - 1 - old_width, FOOTER_Y, old_width + 1, DISPLAY_PAGES * 8 - FOOTER_Y);
+	display.setColor(WHITE);
+	display_mark_dirty(DISPLAY_WIDTH - 1 - old_width, FOOTER_Y, old_width + 1, DISPLAY_PAGES * 8 - FOOTER_Y);
+
+	uint16_t width = display_draw_text(DISPLAY_WIDTH - 1, FOOTER_Y, 1, batt_text, TEXT_ALIGN_RIGHT);
+	display_mark_dirty(DISPLAY_WIDTH - 1 - width, FOOTER_Y, width + 1, DISPLAY_PAGES * 8 - FOOTER_Y);
+	strcpy(rendered_batt, batt_text);
+	rendered_batt_width = width;
+}
+
+/**
+ * @brief Draw the progress bar
+ *
+ * @param show if false the progress bar is removed
+ * @param progress 0-100%
+ */
+static void display_render_progress(bool show, uint8_t progress)
+{
+	display.setColor(BLACK);
+	display.fillRect(0, FOOTER_Y, PROGRESS_WIDTH, DISPLAY_PAGES * 8 - FOOTER_Y);
+	display.setColor(WHITE);
+	if (show)
+	{
+		display.drawProgressBar(0, FOOTER_Y, PROGRESS_WIDTH - 1, 9, progress);
+	}
+	display_mark_dirty(0, FOOTER_Y, PROGRESS_WIDTH, DISPLAY_PAGES * 8 - FOOTER_Y);
+}
+
+/**
+ * @brief Render the differences between the requested scene and the screen
+ *
+ */
+static void display_render(void)
+{
+	uint32_t render_start = micros();
+
+	// Take a consistent copy of the scene
+	display_scene_s next;
+	taskENTER_CRITICAL();
+	next = scene;
+	taskEXIT_CRITICAL();
+
+	if (next.on != rendered.on)
+	{
+		// Power changes always start with a clean screen
+		display.clear();
+		rendered = {next.on, {"", ""}, false, false, 0, 0};
+		rendered_width[0] = rendered_width[1] = 0;
+		rendered_batt[0] = 0;
+		rendered_batt_width = 0;
+		display_mark_dirty(0, 0, DISPLAY_WIDTH, DISPLAY_PAGES * 8);
+		if (!next.on)
+		{
+			display_commit();
+			hal_display_power(false);
+		}
+		else
+		{
+			hal_display_power(true);
+		}
+	}
+
+	if (next.on)
+	{
+		for (uint8_t line_idx = 0; line_idx < 2; line_idx++)
+		{
+			if (strcmp(next.lines[line_idx], rendered.lines[line_idx]) != 0)
+			{
+				display_render_line(line_idx, next.lines[line_idx]);
+			}
+		}
+		if ((next.show_progress != rendered.show_progress) || (next.progress != rendered.progress))
+		{
+			display_render_progress(next.show_progress, next.progress);
+		}
+		display_render_batt(next.show_batt, next.batt_mv);
+		display_commit();
+		rendered = next;
+	}
+
+	stats_running.frames++;
+	stats_running.busy_us += micros() - render_start;
+}
+
+/**
+ * @brief Render task, draws the scene when it changed,
+ * but not more often than the frame rate limit
+ *
+ * @param pvParameters unused
+ */
+static void display_task(void *pvParameters)
+{
+	(void)pvParameters;
+	while (true)
+	{
+		// Wake up at least once per second for the statistics
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+
+		if ((millis() - stats_start) >= 1000)
+		{
+			stats_last = stats_running;
+			stats_running = {0, 0, 0};
+			stats_start = millis();
+			if (stats_last.frames != 0)
+			{
+				MYLOG("DIS", "%ld frames, %ld bytes, %ld us", stats_last.frames, stats_last.bytes, stats_last.busy_us);
+			}
+		}
+
+		if (!render_pending || (frame_depth != 0))
+		{
+			continue;
+		}
+
+		// Limit the frame rate, changes during the wait end up in the same frame
+		uint32_t since_last = millis() - last_frame;
+		if ((frame_interval != 0) && (since_last < frame_interval))
+		{
+			delay(frame_interval - since_last);
+		}
+		render_pending = false;
+		last_frame = millis();
+		display_render();
+	}
+}
+
+/**
+ * @brief Request a new frame from the render task
+ */
+static void display_request_frame(void)
+{
+	render_pending = true;
+	if ((frame_depth == 0) && (display_task_handle != NULL))
+	{
+		xTaskNotifyGive(display_task_handle);
+	}
+}
+
+/**
+ * @brief Start a frame, no frame is rendered until display_end_frame()
+ */
+void display_begin_frame(void)
+{
+	frame_depth++;
+}
+
+/**
+ * @brief End a frame, all changes of the frame are rendered in one frame
+ */
+void display_end_frame(void)
+{
+	if (frame_depth != 0)
+	{
+		frame_depth--;
+	}
+	display_request_frame();
+}
+
+/**
+ * @brief Set the max frame rate
+ *
+ * @param fps frames per second, 0 renders every change immediately
+ */
+void display_set_frame_rate(uint8_t fps)
+{
+	frame_interval = fps == 0 ? 0 : 1000 / fps;
+}
+
+/**
+ * @brief Get the render statistics of the last second
+ *
+ * @param stats receives frames, bytes sent and render time
+ */
+void display_get_stats(display_stats_s *stats)
+{
+	*stats = stats_last;
+}
 
 /**
  * @brief Initialize the display
@@ -38,14 +460,15 @@ void init_display(void)
 	display.setContrast(128);
 	display.setFont(ArialMT_Plain_24);
 	display.setTextAlignment(TEXT_ALIGN_CENTER);
-	display.display();
-
-	// Battery voltage reading initializing
-	// Set the analog reference to 3.0V (default = 3.6V)
-	analogReference(AR_INTERNAL_3_0);
+	hal_display_flush();
+	display_init_glyph_cache();
+	scene.on = true;
+	rendered.on = true;
+	power_request(POWER_DISPLAY, true);
 
-	// Set the resolution to 12-bit (0..4095)
-	analogReadResolution(12); // Can be 8, 10, 12 or 14
+	// Start the render task, lower priority than the application
+	stats_start = millis();
+	xTaskCreate(display_task, "DISP", 1024, NULL, TASK_PRIO_LOWEST, &display_task_handle);
 }
 
 /**
@@ -54,8 +477,13 @@ void init_display(void)
  */
 void display_clear(void)
 {
-	display.clear();
-	display.display();
+	taskENTER_CRITICAL();
+	scene.lines[0][0] = 0;
+	scene.lines[1][0] = 0;
+	scene.show_batt = false;
+	scene.show_progress = false;
+	taskEXIT_CRITICAL();
+	display_request_frame();
 }
 
 /**
@@ -66,32 +494,26 @@ void display_clear(void)
  */
 void display_status(char *disp_line, bool top_line)
 {
-	display.setFont(ArialMT_Plain_24);
-	display.setTextAlignment(TEXT_ALIGN_CENTER);
-	if (top_line)
-	{
-		display.drawString(64, 1, disp_line);
-	}
-	else
-	{
-		display.drawString(64, 28, disp_line);
-	}
-	display.display();
+	taskENTER_CRITICAL();
+	strncpy(scene.lines[top_line ? 0 : 1], disp_line, LINE_LEN - 1);
+	scene.lines[top_line ? 0 : 1][LINE_LEN - 1] = 0;
+	taskEXIT_CRITICAL();
+	display_request_frame();
 }
 
 /**
  * @brief Write battery level status on the screen
+ * The voltage is sampled here, the render task only draws it
  * 
  */
 void display_batt(void)
 {
-	display.setFont(ArialMT_Plain_10);
-	display.setTextAlignment(TEXT_ALIGN_RIGHT);
-	char batt_level[16] = {0};
-	sprintf(batt_level, "%.3fV", (readVBAT() / 1000.0));
-	MYLOG("DIS", "Batt: %.3fV", (readVBAT() / 1000.0));
-	display.drawString(127, 54, batt_level);
-	display.display();
+	int32_t batt_mv = readVBAT_mv();
+	taskENTER_CRITICAL();
+	scene.show_batt = true;
+	scene.batt_mv = batt_mv;
+	taskEXIT_CRITICAL();
+	display_request_frame();
 }
 
 /**
@@ -101,8 +523,11 @@ void display_batt(void)
  */
 void display_busy(uint8_t progress)
 {
-	display.drawProgressBar(0, 54, 80, 9, progress);
-	display.display();
+	taskENTER_CRITICAL();
+	scene.show_progress = true;
+	scene.progress = progress;
+	taskEXIT_CRITICAL();
+	display_request_frame();
 }
 
 /**
@@ -111,9 +536,11 @@ void display_busy(uint8_t progress)
  */
 void display_on(void)
 {
-	display.clear();
-	display.displayOn();
-	display.display();
+	taskENTER_CRITICAL();
+	scene = {true, {"", ""}, false, false, 0, 0};
+	taskEXIT_CRITICAL();
+	display_request_frame();
+	power_request(POWER_DISPLAY, true);
 }
 
 /**
@@ -123,26 +550,9 @@ void display_on(void)
  */
 void display_off(TimerHandle_t unused)
 {
-	display.clear();
-	display.displayOff();
-	display.display();
-}
-
-/**
- * @brief Read the analog value from the battery analog pin
- * and convert it to milli volt
- * 
- * @return float Battery level in milli volts
- */
-float readVBAT(void)
-{
-	float raw;
-
-	// Get the raw 12-bit, 0..3000mV ADC value
-	raw = analogRead(WB_A0);
-
-	// Convert the raw value to compensated mv, taking the resistor-
-	// divider into account (providing the actual LIPO voltage)
-	// ADC range is 0..3000mV and resolution is 12-bit (0..4095)
-	return raw * REAL_VBAT_MV_PER_LSB;
+	taskENTER_CRITICAL();
+	scene = {false, {"", ""}, false, false, 0, 0};
+	taskEXIT_CRITICAL();
+	display_request_frame();
+	power_request(POWER_DISPLAY, false);
 }
@@ -0,0 +1,163 @@
+/**
+ * @file events.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Event flags and dispatch to the loop task
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * The flags are a std::atomic, posting and dispatching never lose an
+ * event. Only the wake up of the loop task depends on the platform,
+ * on the host it is a condition variable for the native tests.
+ */
+
+#ifdef ARDUINO
+#include "main.h"
+#else
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "events.h"
+#define MYLOG(...)
+#endif
+#include <atomic>
+
+/** Number of event flags */
+#define NUM_EVENTS 16
+
+/** Pending events, set by any task or IRQ, cleared only by the loop task */
+static std::atomic<uint32_t> pending_events{NO_EVENT};
+
+/** Handlers of the events, index is the bit number of the event */
+static event_handler_t event_handlers[NUM_EVENTS] = {NULL};
+
+#ifdef ARDUINO
+/** Loop task, woken up by a task notification */
+static TaskHandle_t loop_task_handle = NULL;
+#else
+/** Wake up of the thread that calls events_wait() */
+static std::mutex wake_mutex;
+static std::condition_variable wake_cond;
+static bool wake_pending = false;
+#endif
+
+/**
+ * @brief Initialize the event handling
+ * Must be called from the task that calls events_wait()
+ *
+ */
+void init_events(void)
+{
+#ifdef ARDUINO
+	loop_task_handle = xTaskGetCurrentTaskHandle();
+#endif
+}
+
+/**
+ * @brief Register the handler of an event
+ *
+ * @param event event flag, exactly one bit
+ * @param handler function called by events_dispatch() from the loop task
+ * @return true if the handler was registered
+ */
+bool events_register(uint16_t event, event_handler_t handler)
+{
+	if ((event == NO_EVENT) || ((event & (event - 1)) != 0))
+	{
+		return false;
+	}
+	event_handlers[__builtin_ctz(event)] = handler;
+	return true;
+}
+
+/**
+ * @brief Post an event from a task or a callback
+ * Multiple posts of the same event before it was handled
+ * are handled once, different events never overwrite each other
+ *
+ * @param event one or more event flags
+ */
+void events_post(uint16_t event)
+{
+	pending_events.fetch_or(event);
+#ifdef ARDUINO
+	if (loop_task_handle != NULL)
+	{
+		xTaskNotifyGive(loop_task_handle);
+	}
+#else
+	{
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		wake_pending = true;
+	}
+	wake_cond.notify_one();
+#endif
+}
+
+/**
+ * @brief Post an event from an interrupt handler
+ *
+ * @param event one or more event flags
+ */
+void events_post_from_isr(uint16_t event)
+{
+#ifdef ARDUINO
+	pending_events.fetch_or(event);
+	if (loop_task_handle != NULL)
+	{
+		BaseType_t higher_prio_task_woken = pdFALSE;
+		vTaskNotifyGiveFromISR(loop_task_handle, &higher_prio_task_woken);
+		portYIELD_FROM_ISR(higher_prio_task_woken);
+	}
+#else
+	events_post(event);
+#endif
+}
+
+/**
+ * @brief Sleep until at least one event was posted
+ *
+ * @param timeout max time to wait in ticks, ms on the host
+ * @return true if events are pending
+ */
+bool events_wait(uint32_t timeout)
+{
+	if (pending_events.load() == NO_EVENT)
+	{
+#ifdef ARDUINO
+		ulTaskNotifyTake(pdTRUE, timeout);
+#else
+		std::unique_lock<std::mutex> lock(wake_mutex);
+		wake_cond.wait_for(lock, std::chrono::milliseconds(timeout), [] { return wake_pending; });
+		wake_pending = false;
+#endif
+	}
+	return pending_events.load() != NO_EVENT;
+}
+
+/**
+ * @brief Call the handlers of all pending events
+ * Events posted while handlers run are handled in the same call
+ *
+ */
+void events_dispatch(void)
+{
+	uint32_t events;
+	while ((events = pending_events.exchange(NO_EVENT)) != NO_EVENT)
+	{
+		while (events != NO_EVENT)
+		{
+			uint32_t event_idx = __builtin_ctz(events);
+			events &= ~(1UL << event_idx);
+			if (event_handlers[event_idx] != NULL)
+			{
+				event_handlers[event_idx]();
+			}
+			else
+			{
+				MYLOG("EVT", "No handler for event 0x%04X", 1U << event_idx);
+			}
+		}
+	}
+}
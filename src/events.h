@@ -0,0 +1,41 @@
+/**
+ * @file events.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Event flags and dispatch to the loop task
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdint.h>
+
+/** Wake up events */
+#define NO_EVENT 0
+#define STATUS 0b0000000000000001
+#define BLE_CONFIG 0b0000000000000010
+#define BLE_DATA 0b0000000000000100
+#define BLE_START_DATA 0b0000000000001000
+#define LIGHT 0b0000000000010000
+#define PIR_TRIGGER 0b0000000000100000
+#define BUTTON 0b0000000001000000
+#define MEASURE_DATA 0b0000000010000000
+#define POWER_CHANGE 0b0000000100000000
+#define STREAM_CONFIG 0b0000001000000000
+#define CONN_UPDATE 0b0000010000000000
+#define BATT_UPDATE 0b0000100000000000
+#define POWER_UPDATE 0b0001000000000000
+
+/** Event handling */
+typedef void (*event_handler_t)(void);
+void init_events(void);
+bool events_register(uint16_t event, event_handler_t handler);
+void events_post(uint16_t event);
+void events_post_from_isr(uint16_t event);
+bool events_wait(uint32_t timeout);
+void events_dispatch(void);
+
+#endif // EVENTS_H
@@ -0,0 +1,81 @@
+/**
+ * @file format.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Integer only formatting of the measurement values
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <string.h>
+#include "format.h"
+
+/**
+ * @brief Write a fixed point number as text, without float math
+ *
+ * @param buffer receives the text, at least 13 chars
+ * @param value value in 1/10^decimals units, e.g. 3652 with 2 decimals is "36.52"
+ * @param decimals number of digits after the decimal point, max 9
+ * @return size_t length of the text
+ */
+size_t format_fixed(char *buffer, int32_t value, uint8_t decimals)
+{
+	char digits[12];
+	uint8_t num_digits = 0;
+	size_t len = 0;
+
+	uint32_t abs_value = value < 0 ? 0U - (uint32_t)value : (uint32_t)value;
+	if (value < 0)
+	{
+		buffer[len++] = '-';
+	}
+
+	// Digits in reverse order, at least one digit before the decimal point
+	do
+	{
+		digits[num_digits++] = '0' + (abs_value % 10);
+		abs_value /= 10;
+	} while ((abs_value != 0) || (num_digits <= decimals));
+
+	while (num_digits != 0)
+	{
+		if (num_digits == decimals)
+		{
+			buffer[len++] = '.';
+		}
+		buffer[len++] = digits[--num_digits];
+	}
+	buffer[len] = 0;
+	return len;
+}
+
+/**
+ * @brief Write a temperature as text, e.g. "36.52 ºC"
+ *
+ * @param buffer receives the text, at least 17 chars
+ * @param centi_celsius temperature in 1/100 ºC
+ * @return size_t length of the text
+ */
+size_t format_temp(char *buffer, int32_t centi_celsius)
+{
+	size_t len = format_fixed(buffer, centi_celsius, 2);
+	strcpy(&buffer[len], " ºC");
+	return len + strlen(" ºC");
+}
+
+/**
+ * @brief Write a voltage as text, e.g. "3.912V"
+ *
+ * @param buffer receives the text, at least 14 chars
+ * @param millivolt voltage in mV
+ * @return size_t length of the text
+ */
+size_t format_voltage(char *buffer, int32_t millivolt)
+{
+	size_t len = format_fixed(buffer, millivolt, 3);
+	buffer[len++] = 'V';
+	buffer[len] = 0;
+	return len;
+}
@@ -0,0 +1,21 @@
+/**
+ * @file format.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Integer only formatting of the measurement values
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+size_t format_fixed(char *buffer, int32_t value, uint8_t decimals);
+size_t format_temp(char *buffer, int32_t centi_celsius);
+size_t format_voltage(char *buffer, int32_t millivolt);
+
+#endif // FORMAT_H
@@ -0,0 +1,92 @@
+/**
+ * @file glyph.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Pre-rendered characters for the display
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * The characters are decoded once from the font data of the display
+ * library, drawing them is a copy of a few columns into the buffer.
+ * Nothing here depends on the hardware, see test/test_glyph.
+ */
+
+#include <string.h>
+#include "glyph.h"
+
+/**
+ * @brief Render a character from the font data
+ * The fonts are column oriented, each column has one byte per 8 rows
+ *
+ * @param font font in the format of the display library
+ * @param code character
+ * @param glyph receives the column bitmaps
+ * @return true if the character could be rendered
+ */
+bool glyph_render(const uint8_t *font, uint8_t code, glyph_s &glyph)
+{
+	uint8_t raster_height = 1 + ((font[1] - 1) / 8);
+	uint8_t first_char = font[2];
+	uint8_t num_chars = font[3];
+	const uint8_t *font_data = &font[4 + num_chars * 4];
+
+	glyph.valid = false;
+	if ((raster_height > 4) || (code < first_char) || (code >= first_char + num_chars))
+	{
+		return false;
+	}
+	const uint8_t *jump = &font[4 + (code - first_char) * 4];
+	uint16_t offset = (jump[0] << 8) | jump[1];
+	uint8_t size = jump[2];
+	glyph.advance = jump[3];
+	glyph.columns = 0;
+	memset(glyph.bits, 0, sizeof(glyph.bits));
+	if (offset != 0xFFFF)
+	{
+		// Characters without bitmap (space) have offset 0xFFFF
+		glyph.columns = (size + raster_height - 1) / raster_height;
+		if (glyph.columns > GLYPH_MAX_WIDTH)
+		{
+			return false;
+		}
+		for (uint8_t byte_idx = 0; byte_idx < size; byte_idx++)
+		{
+			glyph.bits[byte_idx / raster_height] |= (uint32_t)font_data[offset + byte_idx] << ((byte_idx % raster_height) * 8);
+		}
+	}
+	glyph.valid = true;
+	return true;
+}
+
+/**
+ * @brief Copy a character into a display buffer
+ * The columns are shifted to the row inside the page and ORed into the buffer
+ *
+ * @param buffer display buffer, one byte per column and page
+ * @param width width of the display in pixels
+ * @param pages height of the display in pages of 8 rows
+ * @param x left edge of the character
+ * @param y top edge of the character
+ * @param glyph pre-rendered character
+ */
+void glyph_blit(uint8_t *buffer, uint8_t width, uint8_t pages, int16_t x, int16_t y, const glyph_s &glyph)
+{
+	uint8_t shift = y & 7;
+	for (uint8_t col = 0; col < glyph.columns; col++)
+	{
+		int16_t col_x = x + col;
+		if ((col_x < 0) || (col_x >= width) || (glyph.bits[col] == 0))
+		{
+			continue;
+		}
+		uint64_t column = (uint64_t)glyph.bits[col] << shift;
+		for (int16_t page = y >> 3; column != 0; page++, column >>= 8)
+		{
+			if ((page >= 0) && (page < pages))
+			{
+				buffer[page * width + col_x] |= (uint8_t)column;
+			}
+		}
+	}
+}
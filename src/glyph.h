@@ -0,0 +1,34 @@
+/**
+ * @file glyph.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Pre-rendered characters for the display
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef GLYPH_H
+#define GLYPH_H
+
+#include <stdint.h>
+
+/** Max columns of a cached character */
+#define GLYPH_MAX_WIDTH 24
+
+/**
+ * @brief Column bitmaps of one pre-rendered character
+ * Bit 0 of a column is the top row of the character
+ */
+struct glyph_s
+{
+	bool valid;
+	uint8_t advance;
+	uint8_t columns;
+	uint32_t bits[GLYPH_MAX_WIDTH];
+};
+
+bool glyph_render(const uint8_t *font, uint8_t code, glyph_s &glyph);
+void glyph_blit(uint8_t *buffer, uint8_t width, uint8_t pages, int16_t x, int16_t y, const glyph_s &glyph);
+
+#endif // GLYPH_H
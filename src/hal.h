@@ -0,0 +1,67 @@
+/**
+ * @file hal.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Hardware abstraction for sensor, display transport and clock
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * The application code (measurement, statistics, encoding) only uses
+ * these functions to access the hardware. The backend is selected at
+ * link time, hal_rak4631.cpp implements them for the WisBlock hardware.
+ * ir-sim.cpp replaces the sensor functions with a replayed trace and
+ * hal_native.cpp implements the rest on the host for the native tests.
+ * There is no virtual dispatch, each call is a plain function call.
+ */
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Clock
+uint32_t hal_millis(void);
+void hal_delay(uint32_t ms);
+
+// IR temperature sensor
+bool hal_ir_begin(void);
+void hal_ir_continuous(void);
+void hal_ir_sleep(void);
+/** Waits for the next sample, returns NAN on a sensor error */
+float hal_ir_object_temp(void);
+/** Sensor temperature of the sample of the last hal_ir_object_temp(), does not start a conversion */
+float hal_ir_sensor_temp(void);
+bool hal_ir_read_register(uint16_t addr, uint16_t &value);
+bool hal_ir_write_eeprom(uint16_t addr, uint16_t value);
+
+// Display transport, drawing is done in the display buffer
+void hal_display_flush(void);
+void hal_display_write(uint8_t page, uint8_t column, const uint8_t *data, size_t len);
+void hal_display_power(bool on);
+
+// Sensor simulation (ir-sim.cpp)
+/** Errors added by the sensor simulation */
+struct ir_sim_settings_s
+{
+	/** Standard deviation of the noise in degree */
+	float noise_std;
+	/** Drift in degree per minute */
+	float drift_per_min;
+	/** Probability of an outlier per sample, 0 .. 1 */
+	float outlier_rate;
+	/** Size of an outlier in degree */
+	float outlier_size;
+	/** Seed of the random generator, the same seed gives the same samples */
+	uint32_t seed;
+};
+extern ir_sim_settings_s g_ir_sim_settings;
+
+#ifndef ARDUINO
+// Host backend (hal_native.cpp), the clock only advances in hal_delay()
+void hal_native_set_millis(uint32_t ms);
+/** Display transfers of the host backend */
+extern uint32_t hal_native_display_bytes;
+#endif
+
+#endif // HAL_H
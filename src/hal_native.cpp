@@ -0,0 +1,68 @@
+/**
+ * @file hal_native.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Hardware abstraction for the host, used by the native tests
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * The clock is simulated, hal_delay() advances it immediately, so a
+ * 10 second measurement runs in a few microseconds on the host and
+ * every run gives the same timing. The sensor is the trace replay of
+ * ir-sim.cpp, the display transport only counts the bytes.
+ */
+
+#ifndef ARDUINO
+
+#include "hal.h"
+
+/** Simulated time in ms */
+static uint32_t native_millis = 0;
+
+/** Bytes sent to the display */
+uint32_t hal_native_display_bytes = 0;
+
+/**
+ * @brief Milliseconds since start
+ */
+uint32_t hal_millis(void)
+{
+	return native_millis;
+}
+
+/**
+ * @brief Sleep for some milliseconds, advances the simulated time
+ */
+void hal_delay(uint32_t ms)
+{
+	native_millis += ms;
+}
+
+/**
+ * @brief Set the simulated time, e.g. at the start of a test
+ */
+void hal_native_set_millis(uint32_t ms)
+{
+	native_millis = ms;
+}
+
+void hal_display_flush(void)
+{
+	hal_native_display_bytes += 1024;
+}
+
+void hal_display_write(uint8_t page, uint8_t column, const uint8_t *data, size_t len)
+{
+	(void)page;
+	(void)column;
+	(void)data;
+	hal_native_display_bytes += len;
+}
+
+void hal_display_power(bool on)
+{
+	(void)on;
+}
+
+#endif // ARDUINO
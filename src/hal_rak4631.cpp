@@ -0,0 +1,377 @@
+/**
+ * @file hal_rak4631.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Hardware abstraction for the RAK4631 with RAK12003 and RAK1921
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+#if IR_SIMULATION == 0
+/** RAK12003 MLX90632 I2C address */
+#define MLX90632_ADDRESS 0x3A
+/** MLX90632 library */
+MLX90632 RAK_TempSensor;
+/** Sensor temperature of the last object temperature conversion */
+static float ir_sensor_temp = NAN;
+
+/** MLX90632 status register, new_data flag and cycle position */
+#define MLX90632_REG_STATUS 0x3FFF
+#define MLX90632_STAT_NEW_DATA 0x0001
+#define MLX90632_STAT_CYCLE_POS(status) (((status) >> 2) & 0x1F)
+/** MLX90632 RAM cells RAM_1 .. RAM_9 */
+#define MLX90632_RAM(cell) (0x4000 + (cell) - 1)
+/** MLX90632 EEPROM addresses of the calibration constants */
+#define MLX90632_EE_P_R 0x240C
+#define MLX90632_EE_P_G 0x240E
+#define MLX90632_EE_P_T 0x2410
+#define MLX90632_EE_P_O 0x2412
+#define MLX90632_EE_EA 0x2424
+#define MLX90632_EE_EB 0x2426
+#define MLX90632_EE_FA 0x2428
+#define MLX90632_EE_FB 0x242A
+#define MLX90632_EE_GA 0x242C
+#define MLX90632_EE_GB 0x242E
+#define MLX90632_EE_KA 0x242F
+#define MLX90632_EE_HA 0x2481
+#define MLX90632_EE_HB 0x2482
+/** Status polls per refresh period while waiting for new data */
+#define IR_POLLS_PER_REFRESH 8
+/** Iterations of the object temperature, see the MLX90632 datasheet */
+#define IR_OBJECT_ITERATIONS 5
+
+/** Calibration constants of the sensor, scaled, read once in hal_ir_begin() */
+struct ir_calibration_s
+{
+	double P_R, P_G, P_T, P_O;
+	double Ea, Eb, Fa, Fb, Ga, Gb, Ka, Ha, Hb;
+};
+static ir_calibration_s ir_cal;
+#endif
+
+/** Display class, drawing functions are in display.cpp */
+extern SSD1306Wire display;
+/** RAK1921 SSD1306 I2C address */
+#define SSD1306_ADDRESS 0x3C
+/** Max data bytes per I2C transfer, the Wire buffer has to hold the control byte as well */
+#define SSD1306_CHUNK 16
+
+/**
+ * @brief Milliseconds since start
+ */
+uint32_t hal_millis(void)
+{
+	return millis();
+}
+
+/**
+ * @brief Sleep for some milliseconds
+ */
+void hal_delay(uint32_t ms)
+{
+	delay(ms);
+}
+
+#if IR_SIMULATION == 0
+/**
+ * @brief Write a 16 bit register of the sensor
+ *
+ * @param addr register address
+ * @param value new value
+ * @return true if the register was written
+ */
+static bool ir_write_register(uint16_t addr, uint16_t value)
+{
+	i2c_lock();
+	bool result = RAK_TempSensor.writeRegister16(addr, value) == MLX90632::SENSOR_SUCCESS;
+	i2c_unlock();
+	return result;
+}
+
+/**
+ * @brief Read a signed 32 bit value, low word first
+ *
+ * @param addr address of the low word
+ * @param value receives the value
+ * @return true if both words could be read
+ */
+static bool ir_read_word32(uint16_t addr, int32_t &value)
+{
+	uint16_t low, high;
+	if (!hal_ir_read_register(addr, low) || !hal_ir_read_register(addr + 1, high))
+	{
+		return false;
+	}
+	value = (int32_t)(((uint32_t)high << 16) | low);
+	return true;
+}
+
+/**
+ * @brief Read a signed 16 bit register, EEPROM or RAM cell
+ *
+ * @param addr address
+ * @param value receives the value
+ * @return true if the word could be read
+ */
+static bool ir_read_word(uint16_t addr, int16_t &value)
+{
+	uint16_t word;
+	if (!hal_ir_read_register(addr, word))
+	{
+		return false;
+	}
+	value = (int16_t)word;
+	return true;
+}
+
+/**
+ * @brief Read the calibration constants of the sensor, one short bus lock per word
+ *
+ * @return true if all constants could be read
+ */
+static bool ir_read_calibration(void)
+{
+	int32_t P_R, P_G, P_T, P_O, Ea, Eb, Fa, Fb, Ga;
+	int16_t Gb, Ka, Ha, Hb;
+	if (!ir_read_word32(MLX90632_EE_P_R, P_R) || !ir_read_word32(MLX90632_EE_P_G, P_G) || !ir_read_word32(MLX90632_EE_P_T, P_T) || !ir_read_word32(MLX90632_EE_P_O, P_O) || !ir_read_word32(MLX90632_EE_EA, Ea) || !ir_read_word32(MLX90632_EE_EB, Eb) || !ir_read_word32(MLX90632_EE_FA, Fa) || !ir_read_word32(MLX90632_EE_FB, Fb) || !ir_read_word32(MLX90632_EE_GA, Ga) || !ir_read_word(MLX90632_EE_GB, Gb) || !ir_read_word(MLX90632_EE_KA, Ka) || !ir_read_word(MLX90632_EE_HA, Ha) || !ir_read_word(MLX90632_EE_HB, Hb))
+	{
+		return false;
+	}
+	// Fixed point scaling of the datasheet
+	ir_cal.P_R = P_R / 256.0;
+	ir_cal.P_G = P_G / 1048576.0;
+	ir_cal.P_T = P_T / 17592186044416.0;
+	ir_cal.P_O = P_O / 256.0;
+	ir_cal.Ea = Ea / 65536.0;
+	ir_cal.Eb = Eb / 256.0;
+	ir_cal.Fa = Fa / 70368744177664.0;
+	ir_cal.Fb = Fb / 68719476736.0;
+	ir_cal.Ga = Ga / 68719476736.0;
+	ir_cal.Gb = Gb / 1024.0;
+	ir_cal.Ka = Ka / 1024.0;
+	ir_cal.Ha = Ha / 16384.0;
+	ir_cal.Hb = Hb / 1024.0;
+	return true;
+}
+
+/**
+ * @brief Initialize the I2C bus and the MLX90632
+ *
+ * @return true if the sensor was found
+ */
+bool hal_ir_begin(void)
+{
+	MLX90632::status returnError;
+
+	// Initialize I2C
+	Wire.begin();
+
+	i2c_lock();
+	bool result = RAK_TempSensor.begin(MLX90632_ADDRESS, Wire, returnError);
+	i2c_unlock();
+	return result && ir_read_calibration();
+}
+
+/**
+ * @brief Switch the sensor into continuous measurement mode
+ */
+void hal_ir_continuous(void)
+{
+	i2c_lock();
+	RAK_TempSensor.continuousMode();
+	i2c_unlock();
+}
+
+/**
+ * @brief Switch the sensor into sleep mode
+ */
+void hal_ir_sleep(void)
+{
+	i2c_lock();
+	RAK_TempSensor.sleepMode();
+	i2c_unlock();
+}
+
+/**
+ * @brief Get the next object temperature, waits for new data of the sensor
+ * The bus is only locked per register transfer, between the status polls
+ * the task sleeps, so the display can use the bus during a conversion.
+ * Object and sensor temperature are calculated from the RAM cells of the
+ * same conversion, like getObjectTemp() and gatherSensorTemp() of the library.
+ *
+ * @return float object temperature in Celsius, NAN if the sensor did not deliver new data
+ */
+float hal_ir_object_temp(void)
+{
+	ir_sensor_temp = NAN;
+
+	// Clear new_data, then wait for the next conversion
+	uint16_t status;
+	if (!hal_ir_read_register(MLX90632_REG_STATUS, status) || !ir_write_register(MLX90632_REG_STATUS, status & ~MLX90632_STAT_NEW_DATA))
+	{
+		return NAN;
+	}
+	uint32_t poll_ms = ir_refresh_ms / IR_POLLS_PER_REFRESH;
+	poll_ms = poll_ms == 0 ? 1 : poll_ms;
+	uint32_t start = hal_millis();
+	do
+	{
+		// A conversion takes one refresh period per cycle position
+		if ((hal_millis() - start) > (uint32_t)(2 * ir_refresh_ms))
+		{
+			return NAN;
+		}
+		hal_delay(poll_ms);
+		if (!hal_ir_read_register(MLX90632_REG_STATUS, status))
+		{
+			return NAN;
+		}
+	} while ((status & MLX90632_STAT_NEW_DATA) == 0);
+
+	// Object data of the finished cycle position, sensor data of the same conversion
+	uint8_t cycle_pos = MLX90632_STAT_CYCLE_POS(status);
+	if ((cycle_pos != 1) && (cycle_pos != 2))
+	{
+		return NAN;
+	}
+	int16_t ram_obj_1, ram_obj_2, ram_6, ram_9;
+	if (!ir_read_word(MLX90632_RAM(cycle_pos == 2 ? 4 : 7), ram_obj_1) || !ir_read_word(MLX90632_RAM(cycle_pos == 2 ? 5 : 8), ram_obj_2) || !ir_read_word(MLX90632_RAM(6), ram_6) || !ir_read_word(MLX90632_RAM(9), ram_9))
+	{
+		return NAN;
+	}
+
+	// Sensor temperature
+	double amb = (ram_6 / 12.0) / (ram_9 + ir_cal.Gb * (ram_6 / 12.0)) * 524288.0;
+	double amb_sub = amb - ir_cal.P_R;
+	ir_sensor_temp = (float)(ir_cal.P_O + amb_sub / ir_cal.P_G + ir_cal.P_T * amb_sub * amb_sub);
+
+	// Object temperature, emissivity 1, the pipeline corrects the emissivity
+	double sto = ((ram_obj_1 + ram_obj_2) / 2.0 / 12.0) / (ram_9 + ir_cal.Ka * (ram_6 / 12.0)) * 524288.0;
+	double ta_dut = (amb - ir_cal.Eb) / ir_cal.Ea + 25.0;
+	double ta_dut4 = pow(ta_dut + 273.15, 4);
+	double object = 25.0;
+	for (int idx = 0; idx < IR_OBJECT_ITERATIONS; idx++)
+	{
+		double alpha = ir_cal.Fa * ir_cal.Ha * (1 + ir_cal.Ga * (object - 25.0) + ir_cal.Fb * (ta_dut - 25.0));
+		double radiance = sto / alpha + ta_dut4;
+		if (radiance <= 0)
+		{
+			ir_sensor_temp = NAN;
+			return NAN;
+		}
+		object = sqrt(sqrt(radiance)) - 273.15 - ir_cal.Hb;
+	}
+	return (float)object;
+}
+
+/**
+ * @brief Get the sensor (ambient) temperature of the last object temperature.
+ * getSensorTemp() of the library waits for a new conversion, which
+ * would pair the object temperature with a later sensor temperature
+ *
+ * @return float sensor temperature in Celsius, NAN if there was no valid sample
+ */
+float hal_ir_sensor_temp(void)
+{
+	return ir_sensor_temp;
+}
+
+/**
+ * @brief Read a 16 bit register or EEPROM cell of the sensor
+ *
+ * @param addr register address
+ * @param value receives the register content
+ * @return true if the register could be read
+ */
+bool hal_ir_read_register(uint16_t addr, uint16_t &value)
+{
+	i2c_lock();
+	bool result = RAK_TempSensor.readRegister16(addr, value) == MLX90632::SENSOR_SUCCESS;
+	i2c_unlock();
+	return result;
+}
+
+/**
+ * @brief Write a 16 bit EEPROM cell of the sensor
+ *
+ * @param addr EEPROM address
+ * @param value new value
+ * @return true if the EEPROM cell was written
+ */
+bool hal_ir_write_eeprom(uint16_t addr, uint16_t value)
+{
+	i2c_lock();
+	bool result = RAK_TempSensor.writeEEPROM(addr, value) == MLX90632::SENSOR_SUCCESS;
+	i2c_unlock();
+	return result;
+}
+
+#endif // IR_SIMULATION
+
+/**
+ * @brief Send the display buffer to the display
+ */
+void hal_display_flush(void)
+{
+	i2c_lock();
+	display.display();
+	i2c_unlock();
+}
+
+/**
+ * @brief Send a part of one display page
+ *
+ * @param page display page (8 pixel rows) 0 .. 7
+ * @param column first column
+ * @param data pixel columns, one byte per column
+ * @param len number of columns
+ */
+void hal_display_write(uint8_t page, uint8_t column, const uint8_t *data, size_t len)
+{
+	if (len == 0)
+	{
+		return;
+	}
+	i2c_lock();
+	// Set the address window to the columns of this page
+	Wire.beginTransmission(SSD1306_ADDRESS);
+	Wire.write(0x00); // Command stream
+	Wire.write(COLUMNADDR);
+	Wire.write(column);
+	Wire.write(column + len - 1);
+	Wire.write(PAGEADDR);
+	Wire.write(page);
+	Wire.write(page);
+	Wire.endTransmission();
+
+	for (size_t idx = 0; idx < len; idx += SSD1306_CHUNK)
+	{
+		size_t chunk = (len - idx) < SSD1306_CHUNK ? (len - idx) : SSD1306_CHUNK;
+		Wire.beginTransmission(SSD1306_ADDRESS);
+		Wire.write(0x40); // Data stream
+		Wire.write(&data[idx], chunk);
+		Wire.endTransmission();
+	}
+	i2c_unlock();
+}
+
+/**
+ * @brief Switch the display on or off
+ */
+void hal_display_power(bool on)
+{
+	i2c_lock();
+	if (on)
+	{
+		display.displayOn();
+	}
+	else
+	{
+		display.displayOff();
+	}
+	i2c_unlock();
+}
@@ -11,14 +11,41 @@
 
 #include "main.h"
 
-/** RAK12003 MLX90632 I2C address */
-#define MLX90632_ADDRESS 0x3A
-/** MLX90632 library */
-MLX90632 RAK_TempSensor;
+/** MLX90632 EEPROM measurement settings, bits 10:8 hold the refresh rate */
+#define MLX90632_EE_MEAS_1 0x24E1
+#define MLX90632_EE_MEAS_2 0x24E2
+#define MLX90632_REFRESH_MASK 0x0700
+#define MLX90632_REFRESH_SHIFT 8
+/** Wake up this many ms before the next sample is due */
+#define SAMPLE_WAKE_MARGIN 5
+/** Abort the measurement after this many sensor errors in a row */
+#define MAX_SENSOR_ERRORS 3
 
 /** For calculating the average standard of the measurments */
 AvgStd tempSamples;
 
+/** Time between two new samples of the sensor in ms */
+time_t ir_refresh_ms = 500;
+/** Time when the next sample is expected */
+static time_t next_sample_time = 0;
+/** Last sample read from the sensor, to detect duplicates */
+static float last_sample = NAN;
+
+/** Processing of the samples, the settings of the stages can be changed with stage<N>() */
+body_pipeline_t g_body_pipeline;
+
+/** Queue with the samples from the measurement task to the loop task */
+SpscQueue<measure_sample_s, MEASURE_QUEUE_SIZE> g_measure_queue;
+/** Handle of the measurement task */
+static TaskHandle_t measure_task_handle = NULL;
+/** Flag if the measurement task is running a measurement */
+volatile bool measure_active = false;
+/** Number of samples dropped because the queue was full */
+static uint32_t measure_queue_drops = 0;
+
+/** Stop policy of the measurement, stop early once the mean is stable */
+measure_settings_s g_measure_settings = MEASURE_SETTINGS_DEFAULT;
+
 /**
  * @brief Initialize the IR temperature sensor
  * 
@@ -27,18 +54,14 @@ AvgStd tempSamples;
  */
 bool init_ir(void)
 {
-	MLX90632::status returnError;
-
 	tempSamples = AvgStd();
 	tempSamples.reset();
 
-	// Initialize I2C
-	Wire.begin();
-
 	// MLX90632 init
-	if (RAK_TempSensor.begin(MLX90632_ADDRESS, Wire, returnError) == true)
+	if (hal_ir_begin())
 	{
 		MYLOG("IR", "MLX90632 Init Succeed");
+		ir_get_refresh_rate();
 		return true;
 	}
 	else
@@ -46,62 +69,361 @@ bool init_ir(void)
 		MYLOG("IR", "MLX90632 Init Failed");
 		return false;
 	}
-	RAK_TempSensor.continuousMode();
 }
 
 /**
- * @brief Measures temperature for 10 seconds
+ * @brief Read the refresh rate setting from the sensor EEPROM
+ * and update the sample period
+ *
+ * @return uint8_t refresh rate code, 0 = 0.5Hz, 1 = 1Hz, 2 = 2Hz ... 7 = 64Hz
+ */
+uint8_t ir_get_refresh_rate(void)
+{
+	uint16_t meas_1 = 0;
+	if (!hal_ir_read_register(MLX90632_EE_MEAS_1, meas_1))
+	{
+		MYLOG("IR", "Could not read refresh rate");
+		return 2;
+	}
+	uint8_t rate = (meas_1 & MLX90632_REFRESH_MASK) >> MLX90632_REFRESH_SHIFT;
+	ir_refresh_ms = 2000 >> rate;
+	MYLOG("IR", "Refresh rate %d, sample every %ld ms", rate, ir_refresh_ms);
+	return rate;
+}
+
+/**
+ * @brief Set the refresh rate of the sensor
+ * The setting is stored in the sensor EEPROM, it is only
+ * written if it differs from the current setting
+ *
+ * @param rate refresh rate code, 0 = 0.5Hz, 1 = 1Hz, 2 = 2Hz ... 7 = 64Hz
+ * @return true if the refresh rate was set
+ */
+bool ir_set_refresh_rate(uint8_t rate)
+{
+	if (rate > 7)
+	{
+		return false;
+	}
+	uint16_t meas_addr[2] = {MLX90632_EE_MEAS_1, MLX90632_EE_MEAS_2};
+	for (int idx = 0; idx < 2; idx++)
+	{
+		uint16_t meas = 0;
+		if (!hal_ir_read_register(meas_addr[idx], meas))
+		{
+			return false;
+		}
+		uint16_t new_meas = (meas & ~MLX90632_REFRESH_MASK) | ((uint16_t)rate << MLX90632_REFRESH_SHIFT);
+		if (new_meas != meas)
+		{
+			// Avoid EEPROM wear, only write if the value changes
+			if (!hal_ir_write_eeprom(meas_addr[idx], new_meas))
+			{
+				return false;
+			}
+		}
+	}
+	return ir_get_refresh_rate() == rate;
+}
+
+/**
+ * @brief Wait for the next sample of the sensor
+ * Sleeps until shortly before the next sample is due, then reads it.
+ * hal_ir_object_temp() waits itself for the new data flag, so only a few
+ * status polls are needed and no sample is read twice.
+ *
+ * @param sample receives the new object and sensor temperature,
+ * the object temperature is NAN on a sensor error
+ * @return true if a new sample was read, false if the value is a duplicate or invalid
+ */
+static bool ir_next_sample(temp_sample_s &sample)
+{
+	time_t now = hal_millis();
+	if ((time_t)(next_sample_time - now) > SAMPLE_WAKE_MARGIN)
+	{
+		hal_delay(next_sample_time - now - SAMPLE_WAKE_MARGIN);
+	}
+
+	sample.object = hal_ir_object_temp();
+	sample.time = hal_millis();
+	next_sample_time = sample.time + ir_refresh_ms;
+
+	// Skip identical values, they are not an independent sample
+	if (isnan(sample.object) || (sample.object == last_sample))
+	{
+		return false;
+	}
+	last_sample = sample.object;
+	sample.ambient = hal_ir_sensor_temp();
+	return true;
+}
+
+/**
+ * @brief Send a sample to the loop task
+ *
+ * @param sample sample to send
+ */
+static void measure_post(measure_sample_s &sample)
+{
+	while (!g_measure_queue.push(sample))
+	{
+		if (!sample.done)
+		{
+			// Loop task is busy, intermediate samples can be skipped
+			measure_queue_drops++;
+			break;
+		}
+		// The result must not get lost
+		hal_delay(10);
+	}
+	events_post(MEASURE_DATA);
+}
+
+/**
+ * @brief Measurement task, sleeps until measure_start() is called,
+ * runs measure_loop() and sends the result to the loop task
+ *
+ * @param pvParameters unused
+ */
+static void measure_task(void *pvParameters)
+{
+	(void)pvParameters;
+	while (true)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		measure_sample_s result;
+		result.value = measure_loop();
+		result.mean = result.value;
+		result.time = hal_millis();
+		result.progress = 100;
+		result.done = true;
+		// The loop task logs the result, the file system needs more stack than this task has
+		measure_active = false;
+		power_request(POWER_MEASURING, false);
+		conn_activity(CONN_ACT_LIVE, false);
+		measure_post(result);
+		measure_cache_stats_s stats;
+		measure_cache_get_stats(stats);
+		MYLOG("IR", "Measurement finished, %ld samples dropped", measure_queue_drops);
+		MYLOG("IR", "Cache %ld hits, sensor %ld wakeups, %ld reads", stats.hits, stats.wakeups, stats.reads);
+	}
+}
+
+/**
+ * @brief Create the measurement task
+ *
+ * @return true if the task was created
+ */
+bool init_measure_task(void)
+{
+	if (xTaskCreate(measure_task, "MEAS", 1024, NULL, TASK_PRIO_LOW, &measure_task_handle) != pdPASS)
+	{
+		MYLOG("IR", "Could not create measurement task");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Start a measurement in the measurement task
+ * Returns immediately, the samples and the result
+ * are delivered through g_measure_queue
+ *
+ * @return true if the measurement was started, false if one is already running
+ */
+bool measure_start(void)
+{
+	if (measure_active || (measure_task_handle == NULL))
+	{
+		return false;
+	}
+	measure_active = true;
+	power_request(POWER_MEASURING, true);
+	conn_activity(CONN_ACT_LIVE, true);
+	xTaskNotifyGive(measure_task_handle);
+	return true;
+}
+
+/**
+ * @brief Store the running statistics of the measurement in the result cache
+ *
+ * @param final true for the result of the measurement
+ */
+static void measure_update_cache(bool final)
+{
+	measure_result_s result;
+	result.value = tempSamples.getMean();
+	result.std = tempSamples.getStd();
+	result.min = tempSamples.getMin();
+	result.max = tempSamples.getMax();
+	result.n = tempSamples.getN();
+	result.final = final;
+	result.time = hal_millis();
+	// A running value is replaced by the next sample
+	result.max_age = final ? MEASURE_RESULT_MAX_AGE : 2 * ir_refresh_ms;
+	measure_cache_put(result);
+}
+
+/**
+ * @brief Measures temperature until the mean is stable,
+ * but at least g_measure_settings.min_time and max
+ * g_measure_settings.max_time milliseconds.
+ * Runs in the measurement task, every sample is
+ * sent to the loop task through g_measure_queue
+ * and the running mean is kept in the result cache.
+ * The samples are processed by g_body_pipeline into the
+ * core temperature, dropped outliers are not counted.
+ * The loop task gets the raw samples for the sample stream
+ * and the running mean of the processed samples.
+ * The time limit is checked for every read, so a sensor that
+ * delivers no new data cannot block the measurement.
  * 
- * @return float average temperature in Celsius from 10 seconds measuring
+ * @return float average temperature in Celsius, NAN on a sensor error
  */
 float measure_loop(void)
 {
 	// Wake up the sensor
-	RAK_TempSensor.continuousMode();
+	hal_ir_continuous();
 
-	time_t max_measure_time = 10000;
+	time_t max_measure_time = g_measure_settings.max_time;
 
 	bool stop_measure = false;
 
-	time_t measure_start = millis();
+	time_t measure_start = hal_millis();
 
 	tempSamples.reset();
+	tempSamples.clearHistory();
+	// Results of an older measurement must not be used for this one
+	measure_cache_clear();
+	tempSamples.setSamplingInterval(ir_refresh_ms);
+	next_sample_time = measure_start;
+	last_sample = NAN;
+	g_body_pipeline.reset();
+	uint32_t reads = 0;
+	uint8_t sensor_errors = 0;
 
-	digitalWrite(LED_BUILTIN, HIGH);
-	digitalWrite(LED_CONN, LOW);
 	while (!stop_measure)
 	{
-		digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
-		digitalWrite(LED_CONN, !digitalRead(LED_CONN));
-		tempSamples.checkAndAddReading(RAK_TempSensor.getObjectTemp());
+		measure_sample_s sample;
+		temp_sample_s raw;
+		reads++;
+		bool new_sample = ir_next_sample(raw);
 
-		// Stop after max_measure_time
-		if ((millis()-measure_start) > max_measure_time)
+		// Stop after max_measure_time, even if no new sample was read
+		time_t elapsed = hal_millis() - measure_start;
+		if (elapsed > max_measure_time)
 		{
 			stop_measure = true;
 		}
-		delay(10);
-		display_busy((millis() - measure_start)/100);
+
+		if (isnan(raw.object))
+		{
+			sensor_errors++;
+			if (sensor_errors >= MAX_SENSOR_ERRORS)
+			{
+				MYLOG("IR", "Sensor error, measurement aborted");
+				break;
+			}
+			continue;
+		}
+		sensor_errors = 0;
+		if (!new_sample)
+		{
+			continue;
+		}
+		// The sample stream gets every raw sample, also the ones the pipeline drops
+		sample.value = raw.object;
+		sample.time = raw.time;
+		if (g_body_pipeline.process(raw))
+		{
+			tempSamples.checkAndAddReading(raw.object);
+			measure_update_cache(false);
+
+			// Stop when the result is stable
+			if (measure_converged(tempSamples, g_measure_settings, elapsed))
+			{
+				stop_measure = true;
+			}
+		}
+		time_t progress = ((hal_millis() - measure_start) * 100) / max_measure_time;
+		sample.progress = progress > 100 ? 100 : progress;
+		sample.mean = tempSamples.getN() != 0 ? tempSamples.getMean() : NAN;
+		sample.done = false;
+		measure_post(sample);
 	}
-	digitalWrite(LED_BUILTIN, LOW);
-	digitalWrite(LED_CONN, LOW);
-	MYLOG("IR", "Result is %.2f", tempSamples.getMean());
+	MYLOG("IR", "Result is %.2f after %ld ms, N = %d", tempSamples.getMean(), hal_millis() - measure_start, tempSamples.getN());
 	// Set the sensor back into sleep mode
-	RAK_TempSensor.sleepMode();
+	hal_ir_sleep();
+	measure_cache_count_wakeup(reads);
+	if ((sensor_errors >= MAX_SENSOR_ERRORS) || (tempSamples.getN() == 0))
+	{
+		// No result, the running values must not be used
+		measure_cache_clear();
+		return NAN;
+	}
+	measure_update_cache(true);
 	return tempSamples.getMean();
 }
 
 /**
- * @brief Do a single temperature measurement
+ * @brief Get the latest temperature for BLE and display
+ * The sensor is only woken up if the cached result is stale.
+ * While the measurement task is running, its running mean
+ * is used instead of accessing the sensor, even before the first
+ * running mean is available
  * 
- * @return float measured temperature in Celsius
+ * @param result receives the latest result, value is NAN and n is 0 on a sensor error
+ * or if a measurement just started and no earlier result is cached
  */
-float measure_single(void)
+void measure_latest(measure_result_s &result)
 {
+	bool fresh = measure_cache_get(result);
+	if (fresh)
+	{
+		return;
+	}
+	if (measure_active)
+	{
+		// The measurement task owns the sensor, its mode must not change here.
+		// Before the first running mean the last result is used, if there is one
+		if (result.n == 0)
+		{
+			result.value = NAN;
+		}
+		return;
+	}
 	// Wake up the sensor
-	RAK_TempSensor.continuousMode();
-	float measure_result =  RAK_TempSensor.getObjectTemp();
+	hal_ir_continuous();
+	temp_sample_s sample;
+	sample.object = hal_ir_object_temp();
+	sample.ambient = hal_ir_sensor_temp();
+	sample.time = hal_millis();
 	// Set the sensor back into sleep mode
-	RAK_TempSensor.sleepMode();
-	return measure_result;
-}
\ No newline at end of file
+	hal_ir_sleep();
+	measure_cache_count_wakeup(1);
+	if (isnan(sample.object))
+	{
+		// Sensor error, nothing to cache
+		result.value = NAN;
+		result.n = 0;
+		return;
+	}
+
+	// Same settings as the measurement, but its own state.
+	// A single sample cannot be checked for outliers
+	static body_pipeline_t single_pipeline;
+	single_pipeline = g_body_pipeline;
+	single_pipeline.stage<0>().min_count = 1;
+	single_pipeline.reset();
+	single_pipeline.process(sample);
+	result.value = sample.object;
+
+	result.std = 0.0;
+	result.min = result.value;
+	result.max = result.value;
+	result.n = 1;
+	result.final = false;
+	result.time = hal_millis();
+	result.max_age = MEASURE_SINGLE_MAX_AGE;
+	measure_cache_put(result);
+}
@@ -0,0 +1,193 @@
+/**
+ * @file ir-sim.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Simulated MLX90632, replays a recorded trace
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * Replaces the sensor functions of the HAL when IR_SIMULATION is set.
+ * The trace from ir-trace.h is replayed at the refresh rate set in the
+ * emulated EEPROM. Noise, drift and outliers can be added to test the
+ * filtering and the timing of the measurement without a sensor.
+ */
+
+#ifdef ARDUINO
+#include "main.h"
+#else
+#include <math.h>
+#include "hal.h"
+#define MYLOG(...)
+#endif
+
+#if IR_SIMULATION > 0
+
+#include "ir-trace.h"
+
+/** Emulated EEPROM measurement settings, see ir-sensor.cpp */
+#define SIM_EE_MEAS_1 0x24E1
+#define SIM_EE_MEAS_2 0x24E2
+/** Default of the MLX90632, refresh rate 2Hz */
+#define SIM_EE_MEAS_DEFAULT 0x820D
+
+/** Number of samples in the trace */
+#define SIM_TRACE_LEN (sizeof(ir_trace_object) / sizeof(ir_trace_object[0]))
+
+/** Errors added to the replayed trace */
+ir_sim_settings_s g_ir_sim_settings = {
+	0.03,  // noise_std
+	0.0,   // drift_per_min
+	0.0,   // outlier_rate
+	5.0,   // outlier_size
+	12345, // seed
+};
+
+/** Emulated EEPROM cells with the refresh rate */
+static uint16_t sim_ee_meas[2] = {SIM_EE_MEAS_DEFAULT, SIM_EE_MEAS_DEFAULT};
+/** Start of the replay */
+static uint32_t sim_start = 0;
+/** Time when the last sample was delivered */
+static uint32_t sim_last_sample = 0;
+/** Sensor temperature of the last sample */
+static float sim_sensor_temp = NAN;
+/** Random generator state */
+static uint32_t sim_random = 0;
+
+/**
+ * @brief xorshift32 random number generator
+ *
+ * @return float random number 0 <= value < 1
+ */
+static float sim_uniform(void)
+{
+	sim_random ^= sim_random << 13;
+	sim_random ^= sim_random >> 17;
+	sim_random ^= sim_random << 5;
+	return (float)(sim_random >> 8) / 16777216.0f;
+}
+
+/**
+ * @brief Normal distributed random number (Box-Muller)
+ *
+ * @return float random number with mean 0 and standard deviation 1
+ */
+static float sim_gaussian(void)
+{
+	float u1 = sim_uniform();
+	float u2 = sim_uniform();
+	if (u1 < 1e-7f)
+	{
+		u1 = 1e-7f;
+	}
+	return sqrtf(-2.0f * logf(u1)) * cosf(2.0f * (float)M_PI * u2);
+}
+
+/**
+ * @brief Refresh period from the emulated EEPROM
+ */
+static uint32_t sim_refresh_ms(void)
+{
+	return 2000 >> ((sim_ee_meas[0] & 0x0700) >> 8);
+}
+
+/**
+ * @brief Value of the trace at a given time, linear interpolation between the samples
+ *
+ * @param trace trace column
+ * @param elapsed time since start of the replay in ms
+ * @return float value in degree Celsius
+ */
+static float sim_trace_value(const int16_t *trace, uint32_t elapsed)
+{
+	uint32_t idx = (elapsed / IR_TRACE_PERIOD) % SIM_TRACE_LEN;
+	uint32_t next_idx = (idx + 1) % SIM_TRACE_LEN;
+	float fraction = (float)(elapsed % IR_TRACE_PERIOD) / IR_TRACE_PERIOD;
+	return (trace[idx] + (trace[next_idx] - trace[idx]) * fraction) / 100.0f;
+}
+
+bool hal_ir_begin(void)
+{
+#ifdef ARDUINO
+	// Display is still on the I2C bus
+	Wire.begin();
+#endif
+
+	sim_start = hal_millis();
+	sim_last_sample = sim_start;
+	sim_sensor_temp = NAN;
+	sim_random = g_ir_sim_settings.seed != 0 ? g_ir_sim_settings.seed : 1;
+	MYLOG("SIM", "Replaying %d samples trace", (int)SIM_TRACE_LEN);
+	return true;
+}
+
+void hal_ir_continuous(void)
+{
+}
+
+void hal_ir_sleep(void)
+{
+}
+
+/**
+ * @brief Like the real sensor, wait for the next sample
+ * and return the trace value with the simulated errors
+ */
+float hal_ir_object_temp(void)
+{
+	uint32_t period = sim_refresh_ms();
+	uint32_t now = hal_millis();
+	uint32_t next_sample = sim_last_sample + period;
+	if ((int32_t)(next_sample - now) > 0)
+	{
+		hal_delay(next_sample - now);
+	}
+	else
+	{
+		// Sensor was idle, next sample is aligned to the refresh period
+		next_sample = now - ((now - sim_start) % period) + period;
+		hal_delay(next_sample - now);
+	}
+	sim_last_sample = next_sample;
+
+	uint32_t elapsed = next_sample - sim_start;
+	sim_sensor_temp = sim_trace_value(ir_trace_ambient, elapsed);
+	float value = sim_trace_value(ir_trace_object, elapsed);
+	value += g_ir_sim_settings.drift_per_min * (float)elapsed / 60000.0f;
+	value += g_ir_sim_settings.noise_std * sim_gaussian();
+	if (sim_uniform() < g_ir_sim_settings.outlier_rate)
+	{
+		value += sim_uniform() < 0.5f ? g_ir_sim_settings.outlier_size : -g_ir_sim_settings.outlier_size;
+	}
+	return value;
+}
+
+/**
+ * @brief Like the real sensor, the sensor temperature of the last sample
+ */
+float hal_ir_sensor_temp(void)
+{
+	return sim_sensor_temp;
+}
+
+bool hal_ir_read_register(uint16_t addr, uint16_t &value)
+{
+	if ((addr != SIM_EE_MEAS_1) && (addr != SIM_EE_MEAS_2))
+	{
+		return false;
+	}
+	value = sim_ee_meas[addr - SIM_EE_MEAS_1];
+	return true;
+}
+
+bool hal_ir_write_eeprom(uint16_t addr, uint16_t value)
+{
+	if ((addr != SIM_EE_MEAS_1) && (addr != SIM_EE_MEAS_2))
+	{
+		return false;
+	}
+	sim_ee_meas[addr - SIM_EE_MEAS_1] = value;
+	return true;
+}
+
+#endif // IR_SIMULATION
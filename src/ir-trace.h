@@ -0,0 +1,51 @@
+/**
+ * @file ir-trace.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief MLX90632 trace replayed by the sensor simulation
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * Example trace of one measurement cycle at 2Hz refresh rate: sensor pointed at
+ * a wall, moved to the forehead, held there for 20 seconds and moved away.
+ * Values are in 1/100 degree Celsius.
+ *
+ * To replay another recording, convert a CSV file with the columns
+ * object,ambient (degree Celsius, one line per sample) into this format,
+ * e.g. with
+ *   awk -F, '{printf "%d, ", $1 * 100}' trace.csv    (object column)
+ *   awk -F, '{printf "%d, ", $2 * 100}' trace.csv    (ambient column)
+ * and set IR_TRACE_PERIOD to the refresh period of the recording.
+ */
+#ifndef IR_TRACE_H
+#define IR_TRACE_H
+
+#include <stdint.h>
+
+/** Time between two samples of the trace in ms */
+#define IR_TRACE_PERIOD 500
+
+/** Object temperatures */
+static const int16_t ir_trace_object[] = {
+	2479, 2480, 2475, 2475, 2483, 2482, 2474, 2480, 2475, 2475, 2480, 2483,
+	2708, 3045, 3394, 3575, 3635, 3645, 3649, 3652, 3653, 3653, 3646, 3655,
+	3651, 3654, 3656, 3656, 3654, 3653, 3654, 3654, 3652, 3650, 3649, 3652,
+	3655, 3655, 3657, 3649, 3654, 3653, 3655, 3648, 3656, 3653, 3653, 3655,
+	3655, 3649, 3655, 3648, 3658, 3658, 3652, 3658, 3648, 3320, 2904, 2612,
+	2482, 2481, 2485, 2486, 2481, 2485, 2483, 2485, 2483, 2484, 2482, 2480,
+};
+
+/** Ambient (sensor) temperatures */
+static const int16_t ir_trace_ambient[] = {
+	2449, 2448, 2452, 2450, 2448, 2449, 2448, 2451, 2449, 2452, 2448, 2448,
+	2453, 2453, 2452, 2450, 2453, 2452, 2451, 2450, 2452, 2451, 2454, 2451,
+	2450, 2450, 2450, 2452, 2455, 2453, 2455, 2453, 2452, 2452, 2455, 2455,
+	2453, 2454, 2452, 2456, 2453, 2453, 2455, 2452, 2456, 2454, 2456, 2457,
+	2453, 2455, 2453, 2455, 2457, 2456, 2456, 2455, 2456, 2455, 2454, 2454,
+	2456, 2455, 2457, 2454, 2457, 2458, 2455, 2458, 2457, 2457, 2455, 2455,
+};
+
+static_assert(sizeof(ir_trace_object) == sizeof(ir_trace_ambient), "Trace columns must have the same length");
+
+#endif // IR_TRACE_H
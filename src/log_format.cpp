@@ -0,0 +1,376 @@
+/**
+ * @file log_format.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Compact block format of the measurement log
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "log_format.h"
+#include <string.h>
+#include <math.h>
+
+/**
+ * @brief Update a CRC-16/CCITT-FALSE (poly 0x1021, start 0xFFFF)
+ *
+ * @param crc CRC of the data before, 0xFFFF for the first call
+ * @param data data to add
+ * @param len length of the data
+ * @return uint16_t new CRC
+ */
+uint16_t log_crc16(uint16_t crc, const uint8_t *data, size_t len)
+{
+	for (size_t idx = 0; idx < len; idx++)
+	{
+		crc ^= (uint16_t)data[idx] << 8;
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+/**
+ * @brief Convert a temperature to 0.01 ºC, NaN becomes 0
+ */
+static int32_t to_centi(float value)
+{
+	if (isnan(value))
+	{
+		return 0;
+	}
+	float centi = value * 100.0f;
+	if (centi >= 2147483520.0f)
+	{
+		return INT32_MAX;
+	}
+	if (centi <= -2147483648.0f)
+	{
+		return INT32_MIN;
+	}
+	return (int32_t)lrintf(centi);
+}
+
+/** Zig-zag encoding, small negative and positive values become small unsigned values */
+static uint32_t zigzag_encode(int32_t value)
+{
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t zigzag_decode(uint32_t value)
+{
+	return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+/**
+ * @brief Write a LEB128 varint
+ *
+ * @param buffer receives max 5 bytes
+ * @param value value to write
+ * @return size_t number of bytes written
+ */
+static size_t write_varint(uint8_t *buffer, uint32_t value)
+{
+	size_t len = 0;
+	while (value >= 0x80)
+	{
+		buffer[len++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	buffer[len++] = (uint8_t)value;
+	return len;
+}
+
+LogBlockWriter::LogBlockWriter(uint8_t *buffer, size_t size)
+	: _buffer(buffer), _size(size)
+{
+	reset();
+}
+
+/**
+ * @brief Start a new, empty block
+ */
+void LogBlockWriter::reset(void)
+{
+	_len = LOG_BLOCK_HEADER_LEN;
+	_count = 0;
+	memset(&_prev, 0, sizeof(_prev));
+	_prev_mean = 0;
+}
+
+/**
+ * @brief Add a record to the block
+ *
+ * @param record record to add
+ * @return true if added, false if the block is full
+ */
+bool LogBlockWriter::add(const log_record_s &record)
+{
+	if ((_count == UINT8_MAX) || (_len + LOG_RECORD_MAX_LEN + LOG_BLOCK_CRC_LEN > _size) || (_len + LOG_RECORD_MAX_LEN > UINT16_MAX))
+	{
+		return false;
+	}
+
+	int32_t mean = to_centi(record.mean);
+	uint8_t *next = &_buffer[_len];
+	next += write_varint(next, record.seq - _prev.seq);
+	next += write_varint(next, zigzag_encode((int32_t)(record.epoch - _prev.epoch)));
+	next += write_varint(next, zigzag_encode((int32_t)(record.uptime - _prev.uptime)));
+	next += write_varint(next, zigzag_encode((int32_t)((uint32_t)mean - (uint32_t)_prev_mean)));
+	next += write_varint(next, (uint32_t)to_centi(record.std));
+	next += write_varint(next, zigzag_encode((int32_t)((uint32_t)mean - (uint32_t)to_centi(record.min))));
+	next += write_varint(next, zigzag_encode((int32_t)((uint32_t)to_centi(record.max) - (uint32_t)mean)));
+	next += write_varint(next, record.n);
+	next += write_varint(next, record.flags);
+	_len = next - _buffer;
+
+	_prev = record;
+	_prev_mean = mean;
+	_count++;
+	return true;
+}
+
+/**
+ * @brief Write the header and the CRC of the block
+ * More records can be added after finish(), finish() must be called again then
+ *
+ * @return size_t length of the block in the buffer
+ */
+size_t LogBlockWriter::finish(void)
+{
+	uint16_t data_len = _len - LOG_BLOCK_HEADER_LEN;
+	_buffer[0] = LOG_BLOCK_MAGIC;
+	_buffer[1] = LOG_FORMAT_VERSION;
+	_buffer[2] = _count;
+	_buffer[3] = (uint8_t)data_len;
+	_buffer[4] = (uint8_t)(data_len >> 8);
+	uint16_t crc = log_crc16(0xFFFF, _buffer, _len);
+	_buffer[_len] = (uint8_t)crc;
+	_buffer[_len + 1] = (uint8_t)(crc >> 8);
+	return _len + LOG_BLOCK_CRC_LEN;
+}
+
+LogReader::LogReader(read_fn_t read_fn, void *context)
+	: _read_fn(read_fn), _context(context), _offset(0), _block_start(0), _data_end(0),
+	  _in_block(false), _block_first(false), _remaining(0), _crc(0xFFFF), _prev_mean(0)
+{
+	memset(&_prev, 0, sizeof(_prev));
+}
+
+/**
+ * @brief Read one byte from the source and add it to the CRC
+ *
+ * @return int byte or -1 at the end of the source
+ */
+int LogReader::readByte(void)
+{
+	int data = _read_fn(_context);
+	if (data >= 0)
+	{
+		uint8_t byte = (uint8_t)data;
+		_crc = log_crc16(_crc, &byte, 1);
+		_offset++;
+	}
+	return data;
+}
+
+/**
+ * @brief Read a LEB128 varint
+ *
+ * @param value receives the value
+ * @return true if a valid varint was read
+ */
+bool LogReader::readVarint(uint32_t &value)
+{
+	value = 0;
+	for (int shift = 0; shift < 35; shift += 7)
+	{
+		int data = readByte();
+		if (data < 0)
+		{
+			return false;
+		}
+		value |= (uint32_t)(data & 0x7F) << shift;
+		if ((data & 0x80) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Check the length and the CRC at the end of a block
+ */
+log_read_result_e LogReader::endBlock(void)
+{
+	_in_block = false;
+	if (_offset != _data_end)
+	{
+		return LOG_READ_BAD_FORMAT;
+	}
+	uint16_t crc = _crc;
+	int crc_low = readByte();
+	int crc_high = readByte();
+	if ((crc_low < 0) || (crc_high < 0) || (((crc_high << 8) | crc_low) != crc))
+	{
+		return LOG_READ_BAD_CRC;
+	}
+	return LOG_READ_RECORD;
+}
+
+/**
+ * @brief Decode the next record
+ *
+ * @param record receives the record
+ * @return log_read_result_e LOG_READ_RECORD if a record was decoded,
+ * LOG_READ_END at the end of the source, or an error.
+ * After an error the reader cannot continue.
+ */
+log_read_result_e LogReader::next(log_record_s &record)
+{
+	if (_in_block && (_remaining == 0))
+	{
+		log_read_result_e result = endBlock();
+		if (result != LOG_READ_RECORD)
+		{
+			return result;
+		}
+	}
+
+	_block_first = false;
+	while (!_in_block)
+	{
+		// Start of the next block
+		_crc = 0xFFFF;
+		_block_start = _offset;
+		int magic = readByte();
+		if (magic < 0)
+		{
+			return LOG_READ_END;
+		}
+		int version = readByte();
+		int count = readByte();
+		int len_low = readByte();
+		int len_high = readByte();
+		if ((magic != LOG_BLOCK_MAGIC) || (version != LOG_FORMAT_VERSION) || (len_high < 0))
+		{
+			return LOG_READ_BAD_FORMAT;
+		}
+		_data_end = _offset + ((len_high << 8) | len_low);
+		_remaining = count;
+		_in_block = true;
+		_block_first = true;
+		memset(&_prev, 0, sizeof(_prev));
+		_prev_mean = 0;
+		if (_remaining == 0)
+		{
+			// Empty block, only check it
+			log_read_result_e result = endBlock();
+			if (result != LOG_READ_RECORD)
+			{
+				return result;
+			}
+		}
+	}
+
+	uint32_t fields[9];
+	for (int idx = 0; idx < 9; idx++)
+	{
+		if (!readVarint(fields[idx]) || (_offset > _data_end))
+		{
+			return LOG_READ_BAD_FORMAT;
+		}
+	}
+	int32_t mean = (int32_t)((uint32_t)_prev_mean + (uint32_t)zigzag_decode(fields[3]));
+	record.seq = _prev.seq + fields[0];
+	record.epoch = _prev.epoch + zigzag_decode(fields[1]);
+	record.uptime = _prev.uptime + zigzag_decode(fields[2]);
+	record.mean = mean / 100.0f;
+	record.std = (int32_t)fields[4] / 100.0f;
+	record.min = (int32_t)((uint32_t)mean - (uint32_t)zigzag_decode(fields[5])) / 100.0f;
+	record.max = (int32_t)((uint32_t)mean + (uint32_t)zigzag_decode(fields[6])) / 100.0f;
+	record.n = fields[7];
+	record.flags = fields[8];
+
+	_prev = record;
+	_prev_mean = mean;
+	_remaining--;
+	return LOG_READ_RECORD;
+}
+
+/**
+ * @brief Read the next byte of a buffer, used by LogReader
+ *
+ * @param context log_buffer_source_s of the buffer
+ * @return int next byte or -1 at the end of the buffer
+ */
+int log_buffer_read(void *context)
+{
+	log_buffer_source_s *source = (log_buffer_source_s *)context;
+	if (source->pos == source->len)
+	{
+		return -1;
+	}
+	return source->data[source->pos++];
+}
+
+/**
+ * @brief Read one complete block and check its CRC,
+ * so none of its records is used before the block is known to be valid.
+ * Decode the records with a LogReader over the buffer.
+ *
+ * @param read_fn byte source
+ * @param context context of the byte source
+ * @param buffer receives the block
+ * @param size size of the buffer
+ * @param len receives the length of the block
+ * @return log_read_result_e LOG_READ_RECORD if a valid block was read,
+ * LOG_READ_END at the end of the source, or an error
+ */
+log_read_result_e log_read_block(LogReader::read_fn_t read_fn, void *context, uint8_t *buffer, size_t size, size_t &len)
+{
+	len = 0;
+	if (size < LOG_BLOCK_HEADER_LEN + LOG_BLOCK_CRC_LEN)
+	{
+		return LOG_READ_BAD_FORMAT;
+	}
+	for (; len < LOG_BLOCK_HEADER_LEN; len++)
+	{
+		int data = read_fn(context);
+		if (data < 0)
+		{
+			return len == 0 ? LOG_READ_END : LOG_READ_BAD_FORMAT;
+		}
+		buffer[len] = (uint8_t)data;
+	}
+	if ((buffer[0] != LOG_BLOCK_MAGIC) || (buffer[1] != LOG_FORMAT_VERSION))
+	{
+		return LOG_READ_BAD_FORMAT;
+	}
+	size_t block_len = LOG_BLOCK_HEADER_LEN + (buffer[3] | (buffer[4] << 8)) + LOG_BLOCK_CRC_LEN;
+	if (block_len > size)
+	{
+		return LOG_READ_BAD_FORMAT;
+	}
+	for (; len < block_len; len++)
+	{
+		int data = read_fn(context);
+		if (data < 0)
+		{
+			// Cut off, e.g. power loss while writing
+			return LOG_READ_BAD_CRC;
+		}
+		buffer[len] = (uint8_t)data;
+	}
+	uint16_t crc = log_crc16(0xFFFF, buffer, block_len - LOG_BLOCK_CRC_LEN);
+	if ((buffer[block_len - 2] | (buffer[block_len - 1] << 8)) != crc)
+	{
+		return LOG_READ_BAD_CRC;
+	}
+	return LOG_READ_RECORD;
+}
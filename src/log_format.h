@@ -0,0 +1,159 @@
+/**
+ * @file log_format.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Compact block format of the measurement log
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef LOG_FORMAT_H
+#define LOG_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Block format, version 1, all values little endian
+ *
+ *    B0      = UINT8  - Magic 0x4D ('M')
+ *    B1      = UINT8  - Format version
+ *    B2      = UINT8  - Number of records
+ *    B4:3    = UINT16 - Length of the record data
+ *    ...     = Record data
+ *    +2      = UINT16 - CRC-16/CCITT-FALSE of header and record data
+ *
+ * Every field of a record is a LEB128 varint. Signed values are zig-zag
+ * encoded. Temperatures are in 0.01 ºC. Deltas are to the previous
+ * record of the same block, the first record of a block is a delta to 0,
+ * so every block can be decoded on its own.
+ *
+ *    seq     - delta, unsigned
+ *    epoch   - delta, signed
+ *    uptime  - delta, signed
+ *    mean    - delta, signed
+ *    std     - absolute, unsigned
+ *    min     - mean - min, signed
+ *    max     - max - mean, signed
+ *    n       - absolute, unsigned
+ *    flags   - absolute, unsigned
+ */
+#define LOG_BLOCK_MAGIC 0x4D
+#define LOG_FORMAT_VERSION 1
+#define LOG_BLOCK_HEADER_LEN 5
+#define LOG_BLOCK_CRC_LEN 2
+/** Max encoded size of one record, 9 varints of max 5 bytes */
+#define LOG_RECORD_MAX_LEN 45
+
+/** Result of one measurement as stored in the log */
+struct log_record_s
+{
+	/** Sequence number, increases with every record */
+	uint32_t seq;
+	/** Time of the measurement in seconds since 1970-01-01, 0 = unknown */
+	uint32_t epoch;
+	/** Time of the measurement in seconds since power on */
+	uint32_t uptime;
+	float mean;
+	float std;
+	float min;
+	float max;
+	uint16_t n;
+	uint16_t flags;
+};
+
+uint16_t log_crc16(uint16_t crc, const uint8_t *data, size_t len);
+
+/**
+ * @brief Encodes records into one block in a buffer
+ */
+class LogBlockWriter
+{
+public:
+	/**
+	 * @param buffer receives the block
+	 * @param size size of the buffer, max 65535 + header and CRC
+	 */
+	LogBlockWriter(uint8_t *buffer, size_t size);
+
+	void reset(void);
+	bool add(const log_record_s &record);
+	size_t finish(void);
+
+	/** Number of records in the block */
+	uint8_t count(void) const { return _count; }
+
+private:
+	uint8_t *_buffer;
+	size_t _size;
+	size_t _len;
+	uint8_t _count;
+	log_record_s _prev;
+	int32_t _prev_mean;
+};
+
+/** Result of LogReader::next() */
+enum log_read_result_e
+{
+	LOG_READ_RECORD,
+	LOG_READ_END,
+	LOG_READ_BAD_CRC,
+	LOG_READ_BAD_FORMAT
+};
+
+/**
+ * @brief Decodes blocks record by record from a byte source,
+ * without buffering the block.
+ * The CRC of a block is checked after its last record, so records
+ * are only known to be valid once next() did not return LOG_READ_BAD_CRC
+ * for their block. Use log_read_block() to check a block before
+ * its records are used.
+ */
+class LogReader
+{
+public:
+	/** Byte source, returns the next byte or -1 at the end */
+	typedef int (*read_fn_t)(void *context);
+
+	LogReader(read_fn_t read_fn, void *context);
+
+	log_read_result_e next(log_record_s &record);
+
+	/** Number of bytes read from the source */
+	size_t offset(void) const { return _offset; }
+	/** Offset of the block of the last record */
+	size_t blockStart(void) const { return _block_start; }
+	/** Flag if the last record is the first one of its block */
+	bool blockFirst(void) const { return _block_first; }
+
+private:
+	int readByte(void);
+	bool readVarint(uint32_t &value);
+	log_read_result_e endBlock(void);
+
+	read_fn_t _read_fn;
+	void *_context;
+	size_t _offset;
+	size_t _block_start;
+	size_t _data_end;
+	bool _in_block;
+	bool _block_first;
+	uint8_t _remaining;
+	uint16_t _crc;
+	log_record_s _prev;
+	int32_t _prev_mean;
+};
+
+/** Byte source over a buffer, for LogReader */
+struct log_buffer_source_s
+{
+	const uint8_t *data;
+	size_t len;
+	size_t pos;
+};
+int log_buffer_read(void *context);
+
+log_read_result_e log_read_block(LogReader::read_fn_t read_fn, void *context, uint8_t *buffer, size_t size, size_t &len);
+
+#endif // LOG_FORMAT_H
@@ -11,17 +11,35 @@
 
 #include "main.h"
 
-/** Semaphore used by events to wake up loop task */
-SemaphoreHandle_t g_task_sem = NULL;
+/** Timer to switch off the display */
+SoftwareTimer oled_off;
 
-/** Priority required to give semaphore from an interrupt */
-BaseType_t xHigherPriorityTaskWoken = pdTRUE;
+/** Mutex for the I2C bus, shared by the sensor and the display */
+SemaphoreHandle_t g_i2c_mutex = NULL;
 
-/** Flag for the event type */
-uint16_t g_task_event_type = NO_EVENT;
+/**
+ * @brief Get exclusive access to the I2C bus
+ * 
+ */
+void i2c_lock(void)
+{
+	if (g_i2c_mutex != NULL)
+	{
+		xSemaphoreTake(g_i2c_mutex, portMAX_DELAY);
+	}
+}
 
-/** Timer to switch off the display */
-SoftwareTimer oled_off;
+/**
+ * @brief Release the I2C bus
+ * 
+ */
+void i2c_unlock(void)
+{
+	if (g_i2c_mutex != NULL)
+	{
+		xSemaphoreGive(g_i2c_mutex);
+	}
+}
 
 /**
  * @brief IRQ callback when the button is pushed.
@@ -30,11 +48,191 @@ SoftwareTimer oled_off;
 void button_trigger(void)
 {
 
-	g_task_event_type = BUTTON;
-	xSemaphoreGiveFromISR(g_task_sem, &xHigherPriorityTaskWoken);
+	events_post_from_isr(BUTTON);
 	detachInterrupt(WB_IO1);
 }
 
+/**
+ * @brief Button pushed, start measurement
+ * 
+ */
+void handle_button(void)
+{
+	MYLOG("APP", "Button push detected");
+	if (power_leds_enabled())
+	{
+		digitalWrite(LED_CONN, HIGH);
+	}
+	oled_off.stop();
+	tone(WB_IO2, 698); //play the note "F6" (FA5)
+	delay(100);
+	tone(WB_IO2, 880); //play the note "A5" (LA5)
+	delay(100);
+	noTone(WB_IO2);
+
+	display_begin_frame();
+	display_on();
+	display_status((char *)"START", true);
+	display_status((char *)"MEASURE", false);
+	display_batt();
+	display_end_frame();
+
+	// Start measurement, the samples are delivered with MEASURE_DATA events
+	// The display raised the power state, the LEDs are allowed if it has them
+	if (power_leds_enabled())
+	{
+		digitalWrite(LED_BUILTIN, HIGH);
+	}
+	digitalWrite(LED_CONN, LOW);
+	if (!measure_start())
+	{
+		attachInterrupt(WB_IO1, button_trigger, FALLING);
+	}
+}
+
+/**
+ * @brief New samples from the measurement task
+ * 
+ */
+void handle_measure_data(void)
+{
+	measure_sample_s sample;
+	while (g_measure_queue.pop(sample))
+	{
+		if (!sample.done)
+		{
+			stream_add_sample(sample.time, sample.value);
+			if (!isnan(sample.mean))
+			{
+				htm_notify_intermediate(sample.mean);
+			}
+			if (power_leds_enabled())
+			{
+				digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+				digitalWrite(LED_CONN, !digitalRead(LED_CONN));
+			}
+			display_busy(sample.progress);
+			continue;
+		}
+
+		// Measurement finished, send the rest of the samples and show the result
+		stream_flush();
+		digitalWrite(LED_BUILTIN, LOW);
+		measure_result_s result;
+		if (measure_cache_get(result))
+		{
+			// Only the loop task writes to the log, the replay reads it from here as well
+			log_add(result);
+		}
+		else
+		{
+			result.value = sample.value;
+		}
+		display_begin_frame();
+		display_clear();
+		if (isnan(result.value))
+		{
+			display_status((char *)"SENSOR", true);
+			display_status((char *)"ERROR", false);
+		}
+		else
+		{
+			char result_str[32];
+			format_temp(result_str, lrintf(result.value * 100.0f));
+			display_status((char *)"Temp:", true);
+			display_status(result_str, false);
+		}
+		display_batt();
+		display_end_frame();
+
+		for (int idx = 0; idx < 3; idx++)
+		{
+			tone(WB_IO2, 880); //play the note "A5" (LA5)
+			delay(100);
+			tone(WB_IO2, 698); //play the note "F6" (FA5)
+		}
+		delay(100);
+		noTone(WB_IO2);
+
+		digitalWrite(LED_CONN, LOW);
+		attachInterrupt(WB_IO1, button_trigger, FALLING);
+		// Forward the stored result if a client is connected
+		if (htm_active && log_replay_start())
+		{
+			events_post(BLE_DATA);
+		}
+		oled_off.setPeriod(DISPLAY_OFF_TIME);
+		oled_off.start();
+	}
+}
+
+/**
+ * @brief OLED timeout, shut down
+ * 
+ */
+void handle_status(void)
+{
+	MYLOG("APP", "Display timeout");
+}
+
+/**
+ * @brief Measure for HTM when posted by htm_timer and send
+ * the queued indications to the subscribed connections
+ * 
+ */
+void handle_ble_data(void)
+{
+	if (htm_active && log_replay_pending())
+	{
+		// Send the stored records first, a few at a time
+		if (log_replay(LOG_REPLAY_BATCH))
+		{
+			events_post(BLE_DATA);
+		}
+	}
+	else if (htm_active)
+	{
+		if (htm_take_tick())
+		{
+			// One measurement for all connections
+			htm_indicate_temp(false);
+			if (power_leds_enabled())
+			{
+				digitalWrite(LED_CONN, !digitalRead(LED_CONN));
+			}
+		}
+		if (htm_send_queued())
+		{
+			events_post(BLE_DATA);
+		}
+	}
+	else
+	{
+		// Indications were stopped
+		digitalWrite(LED_CONN, LOW);
+	}
+}
+
+/**
+ * @brief HTM indication enabled, send the first temperature
+ * and start the timer for the next ones
+ * 
+ */
+void handle_ble_start_data(void)
+{
+	if (power_leds_enabled())
+	{
+		digitalWrite(LED_CONN, HIGH);
+	}
+	// The first value only goes to the new subscribers, the others get the next tick
+	htm_indicate_temp(true);
+	htm_start();
+	// Send the measurements that were taken while no client was connected,
+	// then the queued temperature
+	log_replay_start();
+	events_post(BLE_DATA);
+}
+
 /**
  * @brief Arduino setup function
  * 
@@ -49,13 +247,38 @@ void setup(void)
 	pinMode(LED_CONN, OUTPUT);
 	digitalWrite(LED_CONN, HIGH);
 
+	// Start the energy ledger
+	init_power();
+
+	// Initialize the event handling, setup() runs in the loop task
+	init_events();
+	events_register(BUTTON, handle_button);
+	events_register(MEASURE_DATA, handle_measure_data);
+	events_register(STATUS, handle_status);
+	events_register(BLE_DATA, handle_ble_data);
+	events_register(BLE_START_DATA, handle_ble_start_data);
+	events_register(BLE_CONFIG, htm_indicate_interval);
+	events_register(POWER_CHANGE, power_apply);
+	events_register(STREAM_CONFIG, stream_config);
+	events_register(CONN_UPDATE, conn_params_apply);
+	events_register(BATT_UPDATE, ble_battery_update);
+	events_register(POWER_UPDATE, power_update_ble);
+
+	// Create the I2C bus mutex
+	g_i2c_mutex = xSemaphoreCreateMutex();
+
+	// Start the battery monitor, the display shows its value
+	init_battery();
+
 	// Initialize OLED
 	init_display();
 	oled_off.begin(DISPLAY_INIT_TIME, display_off, NULL, false);
 	oled_off.start();
+	display_begin_frame();
 	display_status((char *)"POWER", true);
 	display_status((char *)"ON", false);
 	display_batt();
+	display_end_frame();
 
 #if MY_DEBUG > 0
 	// Initialize Serial for debug output
@@ -101,26 +324,31 @@ void setup(void)
 			// Print error message on the screen
 			digitalWrite(LED_BUILTIN, HIGH);
 			digitalWrite(LED_CONN, LOW);
+			display_begin_frame();
 			display_status((char *)"SENSOR", true);
 			display_status((char *)"ERROR", false);
+			display_end_frame();
 			delay(1000);
 			// Clear screen
 			digitalWrite(LED_BUILTIN, LOW);
 			digitalWrite(LED_CONN, HIGH);
+			display_begin_frame();
 			display_status((char *)"CHECK", true);
 			display_status((char *)"SENSOR", false);
+			display_end_frame();
 			delay(1000);
 		}
 	}
 
+	// Open the measurement log
+	init_log();
+
+	// Start the measurement task
+	init_measure_task();
+
 	// Initialize BLE
 	init_ble();
 
-	// Create the task event semaphore
-	g_task_sem = xSemaphoreCreateBinary();
-	// Initialize semaphore
-	xSemaphoreGive(g_task_sem);
-
 	pinMode(WB_IO1, INPUT_PULLUP);
 	attachInterrupt(WB_IO1, button_trigger, FALLING);
 
@@ -130,8 +358,6 @@ void setup(void)
 	// Delay just to show debug output
 	delay(500);
 #endif
-	// Take the semaphore so the loop will go to sleep until an event happens
-	xSemaphoreTake(g_task_sem, 10);
 }
 
 /**
@@ -141,89 +367,20 @@ void setup(void)
 void loop(void)
 {
 	// Sleep until we are woken up by an event
-	if (xSemaphoreTake(g_task_sem, portMAX_DELAY) == pdTRUE)
+	if (events_wait(portMAX_DELAY))
 	{
-		// Switch on green LED to show we are awake
-		digitalWrite(LED_BUILTIN, HIGH);
-		while (g_task_event_type != NO_EVENT)
+		// Switch on green LED to show we are awake, unless the power state saves the LED current
+		bool leds = power_leds_enabled();
+		if (leds)
 		{
-			if ((g_task_event_type & BUTTON) == BUTTON)
-			{
-				g_task_event_type &= N_BUTTON;
-				// Button pushed, start measurement
-				MYLOG("APP", "Button push detected");
-				digitalWrite(LED_CONN, HIGH);
-				oled_off.stop();
-				tone(WB_IO2, 698); //play the note "F6" (FA5)
-				delay(100);
-				tone(WB_IO2, 880); //play the note "A5" (LA5)
-				delay(100);
-				noTone(WB_IO2);
-
-				display_on();
-				display_status((char *)"START", true);
-				display_status((char *)"MEASURE", false);
-				display_batt();
-
-				// Start measurement
-				float measured_result = measure_loop();
-				char result_str[32];
-				sprintf(result_str, "%.2f ºC", measured_result);
-				display_clear();
-				display_status((char *)"Temp:", true);
-				display_status(result_str, false);
-				display_batt();
-
-				for (int idx = 0; idx < 3; idx++)
-				{
-					tone(WB_IO2, 880); //play the note "A5" (LA5)
-					delay(100);
-					tone(WB_IO2, 698); //play the note "F6" (FA5)
-				}
-				delay(100);
-				noTone(WB_IO2);
-
-				digitalWrite(LED_CONN, LOW);
-				attachInterrupt(WB_IO1, button_trigger, FALLING);
-				oled_off.setPeriod(DISPLAY_OFF_TIME);
-				oled_off.start();
-			}
-			if ((g_task_event_type & STATUS) == STATUS)
-			{
-				g_task_event_type &= N_STATUS;
-				// OLED timeout, shut down
-				MYLOG("APP", "Display timeout");
-			}
-			if ((g_task_event_type & BLE_DATA) == BLE_DATA)
-			{
-				g_task_event_type &= N_BLE_DATA;
-				if (htm_active)
-				{
-					htm_indicate_temp();
-				}
-			}
-			if ((g_task_event_type & BLE_START_DATA) == BLE_START_DATA)
-			{
-				g_task_event_type &= N_BLE_START_DATA;
-				digitalWrite(LED_BUILTIN, HIGH);
-				digitalWrite(LED_CONN, LOW);
-				while (htm_active)
-				{
-					htm_indicate_temp();
-					delay(1000);
-					digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
-					digitalWrite(LED_CONN, !digitalRead(LED_CONN));
-				}
-				digitalWrite(LED_BUILTIN, LOW);
-				digitalWrite(LED_CONN, LOW);
-			}
+			digitalWrite(LED_BUILTIN, HIGH);
 		}
+		events_dispatch();
 		MYLOG("APP", "Loop goes to sleep");
-		g_task_event_type = 0;
-		// Go back to sleep
-		xSemaphoreTake(g_task_sem, 10);
 		// Switch off green LED to show we go to sleep
-		digitalWrite(LED_BUILTIN, LOW);
-		delay(10);
+		if (leds)
+		{
+			digitalWrite(LED_BUILTIN, LOW);
+		}
 	}
-}
\ No newline at end of file
+}
@@ -19,6 +19,10 @@
 #include "avg.h"
 #include <bluefruit.h>
 #include "IEEE11073float.h"
+#include "spsc_queue.h"
+#include "hal.h"
+#include "temp_pipeline.h"
+#include "measure_policy.h"
 
 // SW version
 #define SW_V_MAIN 1 // Version number main
@@ -30,6 +34,11 @@
 #define MY_DEBUG 0
 #endif
 
+// Replace the MLX90632 with a replayed trace, set to 1 to enable
+#ifndef IR_SIMULATION
+#define IR_SIMULATION 0
+#endif
+
 #if MY_DEBUG > 0
 #define MYLOG(tag, ...)                  \
 	do                                   \
@@ -43,56 +52,207 @@
 #define MYLOG(...)
 #endif
 
-/** Wake up events */
-#define NO_EVENT 0
-#define STATUS 0b0000000000000001
-#define N_STATUS 0b1111111111111110
-#define BLE_CONFIG 0b0000000000000010
-#define N_BLE_CONFIG 0b1111111111111101
-#define BLE_DATA 0b0000000000000100
-#define N_BLE_DATA 0b1111111111111011
-#define BLE_START_DATA 0b0000000000001000
-#define N_BLE_START_DATA 0b1111111111110111
-#define LIGHT 0b0000000000010000
-#define N_LIGHT 0b1111111111101111
-#define PIR_TRIGGER 0b0000000000100000
-#define N_PIR_TRIGGER 0b1111111111011111
-#define BUTTON 0b0000000001000000
-#define N_BUTTON 0b1111111110111111
-
-/** Semaphore used by events to wake up loop task */
-extern SemaphoreHandle_t g_task_sem;
-
-/** Flag for the event type */
-extern uint16_t g_task_event_type;
+#include "events.h"
 
 /** Timer to switch off the OLED after some time */
 extern SoftwareTimer oled_off;
-/** Required for giving a semaphore from an IRQ handler */
-extern BaseType_t xHigherPriorityTaskWoken;
+/** Access to the I2C bus shared by sensor and display */
+void i2c_lock(void);
+void i2c_unlock(void);
 
 // IR thermometer stuff
+extern measure_settings_s g_measure_settings;
+/** Sample sent from the measurement task to the loop task */
+struct measure_sample_s
+{
+	/** Latest raw sample before the processing pipeline, or the result if done is true */
+	float value;
+	/** Running mean of the processed samples, NAN before the first one */
+	float mean;
+	/** Time of the sample in ms */
+	uint32_t time;
+	/** Progress of the measurement 0-100% */
+	uint8_t progress;
+	/** Flag if the measurement is finished */
+	bool done;
+};
+#define MEASURE_QUEUE_SIZE 32
+extern SpscQueue<measure_sample_s, MEASURE_QUEUE_SIZE> g_measure_queue;
+extern volatile bool measure_active;
+/** Result shared by BLE, display and log */
+struct measure_result_s
+{
+	/** Temperature in Celsius, the mean if n > 1 */
+	float value;
+	/** Standard deviation, min and max of the samples */
+	float std;
+	float min;
+	float max;
+	/** Number of samples */
+	uint16_t n;
+	/** Flag if the result is the final result of measure_loop() */
+	bool final;
+	/** millis() when the result was taken */
+	uint32_t time;
+	/** Time in ms after which the result is stale */
+	uint32_t max_age;
+};
+/** Usage counters of the result cache */
+struct measure_cache_stats_s
+{
+	/** Results taken from the cache */
+	uint32_t hits;
+	/** Wakeups of the sensor */
+	uint32_t wakeups;
+	/** Samples read from the sensor */
+	uint32_t reads;
+};
+/** A single reading is reused for this time in ms */
+#define MEASURE_SINGLE_MAX_AGE 2000
+/** A final result of measure_loop() is reused for this time in ms */
+#define MEASURE_RESULT_MAX_AGE 30000
+void measure_cache_clear(void);
+void measure_cache_put(const measure_result_s &result);
+bool measure_cache_get(measure_result_s &result);
+void measure_cache_count_wakeup(uint32_t reads);
+void measure_cache_get_stats(measure_cache_stats_s &stats);
+/** Processing of the sensor samples into the body (core) temperature */
+typedef TempPipeline<OutlierStage<5>, EmissivityStage, AmbientStage, SkinToCoreStage> body_pipeline_t;
+extern body_pipeline_t g_body_pipeline;
 bool init_ir(void);
+bool init_measure_task(void);
+bool measure_start(void);
 float measure_loop(void);
-float measure_single(void);
+void measure_latest(measure_result_s &result);
+uint8_t ir_get_refresh_rate(void);
+bool ir_set_refresh_rate(uint8_t rate);
+extern time_t ir_refresh_ms;
 
 /** Display stuff */
 #define DISPLAY_INIT_TIME 5000
 #define DISPLAY_OFF_TIME 30000
+#define DISPLAY_DEFAULT_FPS 10
+/** Render statistics of one second */
+struct display_stats_s
+{
+	uint32_t frames;
+	uint32_t bytes;
+	uint32_t busy_us;
+};
 void init_display(void);
+void display_begin_frame(void);
+void display_end_frame(void);
+void display_set_frame_rate(uint8_t fps);
+void display_get_stats(display_stats_s *stats);
 void display_clear(void);
 void display_status(char *line, bool top_line);
 void display_busy(uint8_t progress);
 void display_on(void);
 void display_off(TimerHandle_t unused);
 void display_batt(void);
+
+// Battery
+/** Time between two battery readings in ms */
+#define BATT_READ_INTERVAL 10000
+void init_battery(void);
 float readVBAT(void);
+int32_t readVBAT_mv(void);
+uint8_t battery_soc(void);
+uint8_t battery_soc_from_mv(int32_t mv);
+
+// Formatting
+#include "format.h"
+#include "glyph.h"
+
+// Wall clock
+/** Date and time, year, month and day 0 = unknown */
+struct clock_date_s
+{
+	uint16_t year;
+	uint8_t month;
+	uint8_t day;
+	uint8_t hours;
+	uint8_t minutes;
+	uint8_t seconds;
+};
+void init_clock(void);
+void clock_set(uint32_t epoch);
+uint32_t clock_now(void);
+uint32_t clock_from_date(const clock_date_s &date);
+void clock_to_date(uint32_t epoch, clock_date_s &date);
+void clock_connected(uint16_t conn_handle);
+void clock_secured(uint16_t conn_handle);
+
+// Power management
+#include "power_ledger.h"
+extern power_state_config_s g_power_config[POWER_NUM_STATES];
+void init_power(void);
+void power_request(power_state_e state, bool active);
+power_state_e power_get_state(void);
+bool power_leds_enabled(void);
+void power_get_ledger(power_ledger_s *ledger);
+void power_apply(void);
+void setup_power_ble(void);
+void power_update_ble(void);
+
+// Measurement log
+#include "log_format.h"
+/** Records sent per BLE_DATA event while the log is replayed */
+#define LOG_REPLAY_BATCH 4
+bool init_log(void);
+bool log_add(const measure_result_s &result);
+bool log_replay_start(void);
+bool log_replay_pending(void);
+bool log_replay(uint8_t max_records);
 
 // BLE
 #include <bluefruit.h>
 void init_ble(void);
 void setup_htm(void);
-void htm_indicate_temp(void);
+void htm_indicate_temp(bool only_first);
+bool htm_send_queued(void);
+bool htm_take_tick(void);
+void htm_notify_intermediate(float value);
+void htm_encode_time(uint8_t *data, uint32_t epoch);
+bool htm_indicate_record(const log_record_s &record);
+void htm_set_interval(uint32_t interval_ms);
+void htm_indicate_interval(void);
+void htm_start(void);
+void htm_stop(void);
+/** Default, min and max time between two HTM indications in ms, min and max are the Valid Range */
+#define HTM_DEFAULT_INTERVAL 1000
+#define HTM_MIN_INTERVAL 100
+#define HTM_MAX_INTERVAL 3600000
+extern volatile uint32_t htm_interval_ms;
+void ble_battery_update(void);
+void ble_notify_all(BLECharacteristic &chr, const void *data, uint16_t len);
+/** Max number of concurrent connections, e.g. a gateway and a phone */
+#define BLE_MAX_CONN 2
+/** HTM indications queued per connection */
+#define HTM_QUEUE_SIZE 4
+/** Activities that need a fast connection */
+enum conn_activity_e
+{
+	/** Service discovery after connect */
+	CONN_ACT_DISCOVERY = 0,
+	/** Replay of the measurement log */
+	CONN_ACT_REPLAY,
+	/** Measurement running, intermediate values and sample stream */
+	CONN_ACT_LIVE,
+	/** HTM indications faster than CONN_FAST_HTM_INTERVAL */
+	CONN_ACT_FAST_HTM
+};
+/** HTM intervals below this need a fast connection */
+#define CONN_FAST_HTM_INTERVAL 1000
+void init_conn_params(void);
+void conn_params_connected(uint16_t handle);
+void conn_params_disconnected(uint16_t handle);
+void conn_activity(conn_activity_e activity, bool active);
+void conn_params_apply(void);
+void setup_stream(void);
+void stream_add_sample(uint32_t time, float value);
+void stream_flush(void);
+void stream_config(void);
 extern bool htm_active;
 extern SoftwareTimer htm_timer;
 
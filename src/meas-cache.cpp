@@ -0,0 +1,90 @@
+/**
+ * @file meas-cache.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Latest temperature result shared by BLE, display and log
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+/** Latest result, written by the measurement task and the loop task */
+static measure_result_s cache_result;
+/** Flag if cache_result holds a value */
+static bool cache_valid = false;
+/** Usage counters of the cache */
+static measure_cache_stats_s cache_stats;
+
+/**
+ * @brief Store a new result in the cache
+ *
+ * @param result new result, result.time must be set
+ */
+void measure_cache_put(const measure_result_s &result)
+{
+	taskENTER_CRITICAL();
+	cache_result = result;
+	cache_valid = true;
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief Drop the cached result, e.g. when a new measurement starts
+ *
+ */
+void measure_cache_clear(void)
+{
+	taskENTER_CRITICAL();
+	cache_valid = false;
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief Get the latest result if it is still fresh
+ * A result is fresh for result.max_age ms after it was taken
+ *
+ * @param result receives the latest result, also if it is stale
+ * @return true if the result is fresh, false if it is stale or the cache is empty
+ */
+bool measure_cache_get(measure_result_s &result)
+{
+	taskENTER_CRITICAL();
+	bool valid = cache_valid;
+	result = cache_result;
+	taskEXIT_CRITICAL();
+	if (!valid)
+	{
+		result.n = 0;
+		return false;
+	}
+	bool fresh = (uint32_t)(millis() - result.time) <= result.max_age;
+	if (fresh)
+	{
+		cache_stats.hits++;
+	}
+	return fresh;
+}
+
+/**
+ * @brief Count a wakeup of the sensor
+ *
+ * @param reads number of samples read from the sensor during the wakeup
+ */
+void measure_cache_count_wakeup(uint32_t reads)
+{
+	cache_stats.wakeups++;
+	cache_stats.reads += reads;
+}
+
+/**
+ * @brief Get the usage counters of the cache
+ *
+ * @param stats receives the counters
+ */
+void measure_cache_get_stats(measure_cache_stats_s &stats)
+{
+	stats = cache_stats;
+}
@@ -0,0 +1,432 @@
+/**
+ * @file meas-log.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Log of the measurement results in the internal flash
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+#include <Adafruit_LittleFS.h>
+#include <InternalFileSystem.h>
+#include "log_format.h"
+
+using namespace Adafruit_LittleFS_Namespace;
+
+/** Log files, when the current file is full it becomes the old file */
+#define LOG_FILE "/mlog.bin"
+#define LOG_OLD_FILE "/mlog.old"
+/** Sequence number of the last record that was confirmed by a BLE client */
+#define LOG_SENT_FILE "/mlog.snt"
+/** Records of the open block, one block per record, removed when the block is appended to the log */
+#define LOG_JOURNAL_FILE "/mlog.jnl"
+/** Size of a log file before it is rotated, the log keeps up to 2 files */
+#define LOG_FILE_SIZE 8192
+/** Max size of one block of records, see log_format.h */
+#define LOG_BLOCK_SIZE 512
+
+/** Sequence number of the next record */
+static uint32_t log_next_seq = 1;
+/** Sequence number of the last record confirmed by a BLE client */
+static uint32_t log_sent_seq = 0;
+/** Flag if stored records are waiting to be sent */
+static volatile bool log_replay_active = false;
+
+/** The open block, records are collected here until it is full and appended to the log file */
+static uint8_t block_buffer[LOG_BLOCK_SIZE];
+static LogBlockWriter block_writer(block_buffer, sizeof(block_buffer));
+/** Journal entry, a block with a single record */
+static uint8_t journal_buffer[LOG_BLOCK_HEADER_LEN + LOG_RECORD_MAX_LEN + LOG_BLOCK_CRC_LEN];
+static LogBlockWriter journal_writer(journal_buffer, sizeof(journal_buffer));
+/** Number of rotations, a rotation moves the records into the old file */
+static uint32_t log_rotations = 0;
+
+/** Replay position: file in replay_paths and offset of the next block */
+static const char *replay_paths[2] = {LOG_OLD_FILE, LOG_FILE};
+static uint8_t replay_file = 0;
+static uint32_t replay_offset = 0;
+static uint32_t replay_rotations = 0;
+/** Block in replay, all records are checked before the first is sent */
+static uint8_t replay_block[LOG_BLOCK_SIZE];
+
+/** Byte source for LogReader, reads the file in small chunks */
+struct log_source_s
+{
+	File *file;
+	uint8_t buffer[32];
+	uint8_t len;
+	uint8_t pos;
+};
+
+/**
+ * @brief Read the next byte of a log file, used by LogReader
+ *
+ * @param context log_source_s of the file
+ * @return int next byte or -1 at the end of the file
+ */
+static int log_source_read(void *context)
+{
+	log_source_s *source = (log_source_s *)context;
+	if (source->pos == source->len)
+	{
+		int len = source->file->read(source->buffer, sizeof(source->buffer));
+		source->len = len > 0 ? len : 0;
+		source->pos = 0;
+		if (source->len == 0)
+		{
+			return -1;
+		}
+	}
+	return source->buffer[source->pos++];
+}
+
+/**
+ * @brief Scan a log file for the last record
+ * For the current log file a damaged end of the file
+ * (e.g. power loss while writing) is cut off
+ *
+ * @param path log file
+ * @param cut_damaged true for the current log file
+ * @return true if the file has at least one record
+ */
+static bool log_scan(const char *path, bool cut_damaged)
+{
+	File file(InternalFS);
+	if (!file.open(path, cut_damaged ? FILE_O_WRITE : FILE_O_READ))
+	{
+		return false;
+	}
+	file.seek(0);
+	log_source_s source = {&file, {0}, 0, 0};
+	LogReader reader(log_source_read, &source);
+	log_record_s record;
+	log_read_result_e result;
+	bool found = false;
+
+	while ((result = reader.next(record)) == LOG_READ_RECORD)
+	{
+		log_next_seq = record.seq + 1;
+		found = true;
+	}
+
+	if (cut_damaged && (result != LOG_READ_END))
+	{
+		MYLOG("LOG", "Log damaged at %d, cut off", (int)reader.blockStart());
+		file.truncate(reader.blockStart());
+	}
+	file.close();
+	return found;
+}
+
+/**
+ * @brief Load the records of the open block from the journal
+ * Records that are already in the log file (power loss after the block
+ * was appended) are skipped, a damaged end of the journal is cut off
+ */
+static void log_load_journal(void)
+{
+	block_writer.reset();
+	File file(InternalFS);
+	if (!file.open(LOG_JOURNAL_FILE, FILE_O_WRITE))
+	{
+		return;
+	}
+	file.seek(0);
+	log_source_s source = {&file, {0}, 0, 0};
+	size_t len;
+	uint32_t valid_len = 0;
+	log_read_result_e result;
+	while ((result = log_read_block(log_source_read, &source, journal_buffer, sizeof(journal_buffer), len)) == LOG_READ_RECORD)
+	{
+		log_buffer_source_s block_source = {journal_buffer, len, 0};
+		LogReader reader(log_buffer_read, &block_source);
+		log_record_s record;
+		if ((reader.next(record) == LOG_READ_RECORD) && (record.seq >= log_next_seq) && block_writer.add(record))
+		{
+			log_next_seq = record.seq + 1;
+		}
+		valid_len += len;
+	}
+	if (result != LOG_READ_END)
+	{
+		MYLOG("LOG", "Journal damaged at %ld, cut off", valid_len);
+		file.truncate(valid_len);
+	}
+	file.close();
+	if (block_writer.count() == 0)
+	{
+		InternalFS.remove(LOG_JOURNAL_FILE);
+	}
+}
+
+/**
+ * @brief Append the open block to the log file and remove the journal
+ * A full log file is rotated first
+ *
+ * @return true if the block was written
+ */
+static bool log_flush_block(void)
+{
+	File file(InternalFS);
+	uint32_t size = 0;
+	if (file.open(LOG_FILE, FILE_O_READ))
+	{
+		size = file.size();
+		file.close();
+	}
+	if (size >= LOG_FILE_SIZE)
+	{
+		// Rotate, LittleFS spreads the writes over the whole flash area
+		InternalFS.remove(LOG_OLD_FILE);
+		InternalFS.rename(LOG_FILE, LOG_OLD_FILE);
+		log_rotations++;
+	}
+
+	if (!file.open(LOG_FILE, FILE_O_WRITE))
+	{
+		MYLOG("LOG", "Could not open the log");
+		return false;
+	}
+	size_t len = block_writer.finish();
+	file.seek(file.size());
+	bool written = file.write(block_buffer, len) == len;
+	file.close();
+	if (written)
+	{
+		InternalFS.remove(LOG_JOURNAL_FILE);
+	}
+	return written;
+}
+
+/**
+ * @brief Save the sequence number of the last sent record
+ * The file is overwritten in place, LittleFS commits the new
+ * content on close, a power loss keeps the old value
+ *
+ */
+static void log_save_sent(void)
+{
+	File file(InternalFS);
+	if (file.open(LOG_SENT_FILE, FILE_O_WRITE))
+	{
+		file.seek(0);
+		file.write((uint8_t *)&log_sent_seq, sizeof(log_sent_seq));
+		file.close();
+	}
+}
+
+/**
+ * @brief Mount the file system and find the end of the log
+ *
+ * @return true if the file system is available
+ */
+bool init_log(void)
+{
+	if (!InternalFS.begin())
+	{
+		MYLOG("LOG", "Could not mount the file system");
+		return false;
+	}
+
+	log_scan(LOG_OLD_FILE, false);
+	log_scan(LOG_FILE, true);
+	log_load_journal();
+
+	File file(InternalFS);
+	if (file.open(LOG_SENT_FILE, FILE_O_READ))
+	{
+		file.read(&log_sent_seq, sizeof(log_sent_seq));
+		file.close();
+	}
+	MYLOG("LOG", "Next record %ld, %ld not sent", log_next_seq, log_next_seq - 1 - log_sent_seq);
+	return true;
+}
+
+/**
+ * @brief Append the result of a measurement to the log
+ * The record is added to the open block in RAM and appended to the journal
+ * as a block of its own. Only a full block is appended to the log file, so
+ * every record is written about twice instead of rewriting the growing block.
+ * Called from the loop task only, like log_replay(), so the log needs no lock
+ *
+ * @param result result of the measurement from the result cache
+ * @return true if the record was written
+ */
+bool log_add(const measure_result_s &result)
+{
+	log_record_s record;
+	record.seq = log_next_seq;
+	record.epoch = clock_now();
+	record.uptime = millis() / 1000;
+	record.mean = result.value;
+	record.std = result.std;
+	record.min = result.min;
+	record.max = result.max;
+	record.n = result.n;
+	record.flags = 0;
+
+	if (!block_writer.add(record))
+	{
+		// Block is full, append it to the log file and start a new one
+		if (!log_flush_block())
+		{
+			return false;
+		}
+		block_writer.reset();
+		block_writer.add(record);
+	}
+	// The record is in the open block now, it is written with the block even if the journal fails
+	log_next_seq++;
+
+	journal_writer.reset();
+	journal_writer.add(record);
+	size_t len = journal_writer.finish();
+	File file(InternalFS);
+	if (!file.open(LOG_JOURNAL_FILE, FILE_O_WRITE))
+	{
+		MYLOG("LOG", "Could not open the journal");
+		return false;
+	}
+	file.seek(file.size());
+	bool written = file.write(journal_buffer, len) == len;
+	file.close();
+	return written;
+}
+
+/**
+ * @brief Start to send the records that were not confirmed by a client yet
+ * The replay continues at the position of the last replay
+ *
+ * @return true if there are records to send
+ */
+bool log_replay_start(void)
+{
+	log_replay_active = (log_next_seq - 1) > log_sent_seq;
+	conn_activity(CONN_ACT_REPLAY, log_replay_active);
+	return log_replay_active;
+}
+
+/**
+ * @brief Check if stored records are waiting to be sent
+ *
+ * @return true if log_replay() has more records to send
+ */
+bool log_replay_pending(void)
+{
+	return log_replay_active;
+}
+
+/**
+ * @brief Send the records of one block that were not confirmed yet
+ *
+ * @param block checked block, replay_block or the open block
+ * @param len length of the block
+ * @param sent number of records sent in this call, incremented
+ * @param max_records max number of records to send in this call
+ * @return true if all records of the block were sent
+ */
+static bool log_replay_block(const uint8_t *block, size_t len, uint8_t &sent, uint8_t max_records)
+{
+	log_buffer_source_s source = {block, len, 0};
+	LogReader reader(log_buffer_read, &source);
+	log_record_s record;
+	while (reader.next(record) == LOG_READ_RECORD)
+	{
+		if (record.seq <= log_sent_seq)
+		{
+			continue;
+		}
+		if ((sent == max_records) || !htm_indicate_record(record))
+		{
+			return false;
+		}
+		log_sent_seq = record.seq;
+		sent++;
+	}
+	return true;
+}
+
+/**
+ * @brief Send the next stored records as HTM indications
+ * Each indication waits for the confirmation of the client,
+ * so only a few records are sent per call to keep the loop responsive.
+ * Every block is read completely and its CRC is checked before
+ * the first of its records is sent. The position of the block
+ * is kept for the next call, the file is only read again from the
+ * start after a rotation of the log. The records of the open block
+ * are sent from RAM after the log file.
+ *
+ * @param max_records max number of records to send
+ * @return true if more records are waiting
+ */
+bool log_replay(uint8_t max_records)
+{
+	uint8_t sent = 0;
+	bool confirmed = true;
+
+	if (replay_rotations != log_rotations)
+	{
+		// The records moved into the old file, the position is not valid anymore
+		replay_rotations = log_rotations;
+		replay_file = 0;
+		replay_offset = 0;
+	}
+
+	while (confirmed && (sent < max_records) && (replay_file < 2))
+	{
+		File file(InternalFS);
+		bool at_end = true;
+		if (file.open(replay_paths[replay_file], FILE_O_READ))
+		{
+			file.seek(replay_offset);
+			log_source_s source = {&file, {0}, 0, 0};
+			size_t len;
+			log_read_result_e result;
+			while ((result = log_read_block(log_source_read, &source, replay_block, sizeof(replay_block), len)) == LOG_READ_RECORD)
+			{
+				if (!log_replay_block(replay_block, len, sent, max_records))
+				{
+					// Stay on this block, records that were sent are skipped next time.
+					// Stopped by the batch limit or by a failed indication
+					confirmed = sent == max_records;
+					at_end = false;
+					break;
+				}
+				replay_offset += len;
+			}
+			if (at_end && (result != LOG_READ_RECORD) && (result != LOG_READ_END))
+			{
+				MYLOG("LOG", "Damaged block at %ld in %s, rest of the file skipped", replay_offset, replay_paths[replay_file]);
+				// The log file is only cut off at the next start, stop until the next connection
+				confirmed = replay_file == 0;
+			}
+			file.close();
+		}
+		if (at_end && confirmed && (replay_file == 1) && (block_writer.count() != 0))
+		{
+			// The open block, it is appended to the log file later and its sent records are skipped there
+			size_t len = block_writer.finish();
+			confirmed = log_replay_block(block_buffer, len, sent, max_records) || (sent == max_records);
+		}
+		if (!at_end || (replay_file == 1))
+		{
+			// Either more records in this block or all records are sent and the log file grows from here
+			break;
+		}
+		replay_file++;
+		replay_offset = 0;
+	}
+
+	if (sent != 0)
+	{
+		log_save_sent();
+	}
+	// Stop on errors, the next connection starts over with the first record not confirmed
+	log_replay_active = confirmed && ((log_next_seq - 1) > log_sent_seq);
+	conn_activity(CONN_ACT_REPLAY, log_replay_active);
+	MYLOG("LOG", "Sent %d records, %s", sent, log_replay_active ? "more waiting" : "done");
+	return log_replay_active;
+}
@@ -0,0 +1,65 @@
+/**
+ * @file measure_policy.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Stop policy of the temperature measurement
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * Only depends on AvgStd, so the policy can be tuned on the host
+ * with the sensor simulation, see test/test_convergence.
+ */
+#ifndef MEASURE_POLICY_H
+#define MEASURE_POLICY_H
+
+#include <math.h>
+#include <time.h>
+#include "avg.h"
+
+/** Stop policy of measure_loop() */
+struct measure_settings_s
+{
+	/** Minimum measurement time in ms */
+	time_t min_time;
+	/** Maximum measurement time in ms */
+	time_t max_time;
+	/** Minimum number of samples before the result can be accepted */
+	unsigned int min_samples;
+	/** z value of the confidence level, e.g. 1.96 for 95% */
+	float confidence_z;
+	/** Accepted half width of the confidence interval of the mean in degree */
+	float tolerance;
+	/** Accepted absolute slope of the readings in degree per second */
+	float max_slope;
+};
+
+/** Default policy: 2 to 10 seconds, 95% confidence interval within +-0.05 degree */
+#define MEASURE_SETTINGS_DEFAULT {2000, 10000, 5, 1.96f, 0.05f, 0.02f}
+
+/**
+ * @brief Check if the measurement has converged
+ * The mean is accepted when the confidence interval of the mean
+ * is small enough and the readings are not drifting anymore
+ *
+ * @param samples statistics of the measurement
+ * @param settings stop policy
+ * @param elapsed time since start of the measurement in ms
+ * @return true if the result is stable
+ */
+inline bool measure_converged(AvgStd &samples, const measure_settings_s &settings, time_t elapsed)
+{
+	unsigned int num_samples = samples.getN();
+	if ((elapsed < settings.min_time) || (num_samples < settings.min_samples))
+	{
+		return false;
+	}
+	float std_error = samples.getStd() / sqrtf((float)num_samples);
+	if (settings.confidence_z * std_error > settings.tolerance)
+	{
+		return false;
+	}
+	return fabsf(samples.getSlope()) <= settings.max_slope;
+}
+
+#endif // MEASURE_POLICY_H
@@ -0,0 +1,190 @@
+/**
+ * @file power.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Power states with radio settings and an energy ledger
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+/** Settings and current model of the power states, index is power_state_e */
+power_state_config_s g_power_config[POWER_NUM_STATES] = {
+	// tx_power, adv_fast, adv_slow, leds, current_ua
+	{0, 244, 1636, false, 30},	 // POWER_ADVERTISING, 152.5 ms / 1022.5 ms
+	{0, 244, 1636, false, 80},	 // POWER_CONNECTED
+	{0, 244, 1636, true, 1500},	 // POWER_MEASURING
+	{4, 32, 244, true, 9000}	 // POWER_DISPLAY, 20 ms / 152.5 ms while the user looks at the device
+};
+
+/** Requested states and time and charge per state */
+static PowerLedger power_ledger(g_power_config);
+/** State the radio is configured for */
+static power_state_e power_radio_state = POWER_NUM_STATES;
+/** Flag if the radio is started and can be configured */
+static bool power_radio_ready = false;
+
+/** Timer to update the energy ledger characteristic */
+SoftwareTimer power_timer;
+#define POWER_UPDATE_INTERVAL 60000
+
+/* Energy Ledger Char: 5A4E0004-7B3F-4C61-9D2A-3E5F6B8A1C20 in the vendor service */
+static const uint8_t power_ledger_uuid[16] = {0x20, 0x1C, 0x8A, 0x6B, 0x5F, 0x3E, 0x2A, 0x9D,
+											  0x61, 0x4C, 0x3F, 0x7B, 0x04, 0x00, 0x4E, 0x5A};
+BLECharacteristic powerc = BLECharacteristic(power_ledger_uuid);
+
+/**
+ * @brief Timer callback, the loop task updates the energy ledger characteristic
+ *
+ * @param unused
+ */
+static void power_timer_callback(TimerHandle_t unused)
+{
+	(void)unused;
+	events_post(POWER_UPDATE);
+}
+
+/**
+ * @brief Start the energy ledger
+ *
+ */
+void init_power(void)
+{
+	taskENTER_CRITICAL();
+	power_ledger.begin(millis());
+	taskEXIT_CRITICAL();
+	power_timer.begin(POWER_UPDATE_INTERVAL, power_timer_callback);
+	power_timer.start();
+}
+
+/**
+ * @brief Request or release a power state
+ * The highest requested state is active, without requests the
+ * device is in POWER_ADVERTISING. Can be called from any task.
+ *
+ * @param state state to request or release
+ * @param active true to request, false to release
+ */
+void power_request(power_state_e state, bool active)
+{
+	taskENTER_CRITICAL();
+	bool changed = power_ledger.request(state, active, millis());
+	taskEXIT_CRITICAL();
+
+	if (changed)
+	{
+		// The radio is configured by the loop task
+		events_post(POWER_CHANGE);
+	}
+}
+
+/**
+ * @brief Get the active power state
+ *
+ * @return power_state_e active state
+ */
+power_state_e power_get_state(void)
+{
+	return power_ledger.state();
+}
+
+/**
+ * @brief Check if the LEDs may be used in the active state
+ *
+ * @return true if the LEDs are allowed
+ */
+bool power_leds_enabled(void)
+{
+	return g_power_config[power_ledger.state()].leds;
+}
+
+/**
+ * @brief Get the energy ledger
+ *
+ * @param ledger receives POWER_NUM_STATES entries, including the running state
+ */
+void power_get_ledger(power_ledger_s *ledger)
+{
+	taskENTER_CRITICAL();
+	power_ledger.get(millis(), ledger);
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief Configure TX power and advertising interval for the active state
+ * and switch the LEDs off if the state does not allow them.
+ * Called by the loop task on POWER_CHANGE
+ *
+ */
+void power_apply(void)
+{
+	power_state_e state = power_ledger.state();
+	if (!g_power_config[state].leds)
+	{
+		// The event handlers only switch the LEDs on in states that allow them
+		digitalWrite(LED_BUILTIN, LOW);
+		digitalWrite(LED_CONN, LOW);
+	}
+	if (!power_radio_ready || (state == power_radio_state))
+	{
+		return;
+	}
+	power_state_config_s &config = g_power_config[state];
+	MYLOG("PWR", "State %d, TX %d dBm", state, config.tx_power);
+
+	Bluefruit.setTxPower(config.tx_power);
+	Bluefruit.Advertising.setInterval(config.adv_fast, config.adv_slow);
+	if (Bluefruit.Advertising.isRunning())
+	{
+		// Restart to use the new interval
+		Bluefruit.Advertising.stop();
+		Bluefruit.Advertising.start(0);
+	}
+	power_radio_state = state;
+	power_update_ble();
+}
+
+/**
+ * @brief Add the energy ledger characteristic to the vendor service
+ * and configure the radio for the active state
+ *
+ */
+void setup_power_ble(void)
+{
+	// Configure the Energy Ledger characteristic
+	// Properties = Read, Notify
+	// Fixed Len  = 33
+	//    B0      = UINT8  - Active power state
+	//    followed by 4 times, one per power state
+	//    UINT32  - Time in the state in seconds
+	//    UINT32  - Charge used in the state in uAh, from the current model
+	powerc.setProperties(CHR_PROPS_READ | CHR_PROPS_NOTIFY);
+	powerc.setPermission(SECMODE_OPEN, SECMODE_NO_ACCESS);
+	powerc.setFixedLen(POWER_LEDGER_LEN);
+	powerc.begin();
+
+	power_radio_ready = true;
+}
+
+/**
+ * @brief Update the energy ledger characteristic and notify it,
+ * handler of the POWER_UPDATE event and called by power_apply()
+ *
+ */
+void power_update_ble(void)
+{
+	if (!power_radio_ready)
+	{
+		return;
+	}
+	power_ledger_s ledger[POWER_NUM_STATES];
+	power_get_ledger(ledger);
+
+	uint8_t data[POWER_LEDGER_LEN];
+	PowerLedger::encode(power_ledger.state(), ledger, data);
+	powerc.write(data, sizeof(data));
+	ble_notify_all(powerc, data, sizeof(data));
+}
@@ -0,0 +1,166 @@
+/**
+ * @file power_ledger.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Power states and energy ledger
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * The time base is passed in, so the ledger can be checked on the host,
+ * see test/test_power. power.cpp adds the locking and the radio settings.
+ */
+#ifndef POWER_LEDGER_H
+#define POWER_LEDGER_H
+
+#include <stdint.h>
+#include <string.h>
+
+/** Power states, a higher state has priority over a lower one */
+enum power_state_e
+{
+	POWER_ADVERTISING = 0,
+	POWER_CONNECTED,
+	POWER_MEASURING,
+	POWER_DISPLAY,
+	POWER_NUM_STATES
+};
+
+/** Radio settings and current model of a power state */
+struct power_state_config_s
+{
+	/** TX power in dBm */
+	int8_t tx_power;
+	/** Fast and slow advertising interval in units of 0.625 ms */
+	uint16_t adv_fast;
+	uint16_t adv_slow;
+	/** Flag if the status LEDs may be used */
+	bool leds;
+	/** Average current in the state in uA, for the energy ledger */
+	uint32_t current_ua;
+};
+
+/** Time and charge spent in a power state */
+struct power_ledger_s
+{
+	uint64_t time_ms;
+	uint64_t charge_uas;
+};
+
+/** Length of the Energy Ledger characteristic */
+#define POWER_LEDGER_LEN (1 + POWER_NUM_STATES * 8)
+
+/**
+ * @brief Requested power states and the time and charge per state
+ * Not thread safe, the caller locks
+ */
+class PowerLedger
+{
+public:
+	/**
+	 * @param config current model, POWER_NUM_STATES entries
+	 */
+	PowerLedger(const power_state_config_s *config) : _config(config)
+	{
+		begin(0);
+	}
+
+	/**
+	 * @brief Clear the ledger and the requests
+	 *
+	 * @param now current time in ms
+	 */
+	void begin(uint32_t now)
+	{
+		memset(_ledger, 0, sizeof(_ledger));
+		_requests = 0;
+		_state = POWER_ADVERTISING;
+		_state_start = now;
+	}
+
+	/**
+	 * @brief Request or release a state, the highest requested state is active
+	 *
+	 * @param state state to request or release
+	 * @param active true to request, false to release
+	 * @param now current time in ms
+	 * @return true if the active state changed
+	 */
+	bool request(power_state_e state, bool active, uint32_t now)
+	{
+		if (active)
+		{
+			_requests |= 1 << state;
+		}
+		else
+		{
+			_requests &= ~(1 << state);
+		}
+		power_state_e new_state = _requests == 0 ? POWER_ADVERTISING : (power_state_e)(31 - __builtin_clz(_requests));
+		if (new_state == _state)
+		{
+			return false;
+		}
+		book(now);
+		_state = new_state;
+		return true;
+	}
+
+	/** Active state */
+	power_state_e state(void) const { return _state; }
+
+	/**
+	 * @brief Get the ledger, including the time in the active state until now
+	 *
+	 * @param now current time in ms
+	 * @param ledger receives POWER_NUM_STATES entries
+	 */
+	void get(uint32_t now, power_ledger_s *ledger)
+	{
+		book(now);
+		memcpy(ledger, _ledger, sizeof(_ledger));
+	}
+
+	/**
+	 * @brief Encode the Energy Ledger characteristic
+	 * B0 is the active state, then per state the time in seconds
+	 * and the charge in uAh as UINT32
+	 *
+	 * @param state active state
+	 * @param ledger POWER_NUM_STATES entries
+	 * @param data receives POWER_LEDGER_LEN bytes
+	 */
+	static void encode(power_state_e state, const power_ledger_s *ledger, uint8_t *data)
+	{
+		data[0] = state;
+		for (int idx = 0; idx < POWER_NUM_STATES; idx++)
+		{
+			uint32_t time_s = ledger[idx].time_ms / 1000;
+			uint32_t charge_uah = ledger[idx].charge_uas / 3600;
+			memcpy(&data[1 + idx * 8], &time_s, 4);
+			memcpy(&data[5 + idx * 8], &charge_uah, 4);
+		}
+	}
+
+private:
+	/**
+	 * @brief Add the time since the state was entered to the ledger
+	 * The time is unsigned, so it is correct over a wrap of millis()
+	 */
+	void book(uint32_t now)
+	{
+		uint32_t elapsed = now - _state_start;
+		power_ledger_s &ledger = _ledger[_state];
+		ledger.time_ms += elapsed;
+		ledger.charge_uas += (uint64_t)elapsed * _config[_state].current_ua / 1000;
+		_state_start = now;
+	}
+
+	const power_state_config_s *_config;
+	power_ledger_s _ledger[POWER_NUM_STATES];
+	uint8_t _requests;
+	power_state_e _state;
+	uint32_t _state_start;
+};
+
+#endif // POWER_LEDGER_H
@@ -0,0 +1,126 @@
+/**
+ * @file q16.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Q16.16 fixed point number type
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef Q16_H
+#define Q16_H
+
+#include <stdint.h>
+
+/**
+ * @brief Signed fixed point number with 16 integer and 16 fractional bits.
+ * Range is -32768 .. 32767.99998 with a resolution of 1/65536.
+ * Used as accumulator type for AvgStdT on MCUs without FPU.
+ */
+class Q16_16
+{
+public:
+	constexpr Q16_16() : raw(0) {}
+	constexpr Q16_16(int value) : raw((int32_t)value * 65536) {}
+	constexpr Q16_16(float value) : raw((int32_t)(value * 65536.0f + (value < 0 ? -0.5f : 0.5f))) {}
+
+	/** Create a value from its raw 32 bit representation */
+	static constexpr Q16_16 fromRaw(int32_t value)
+	{
+		Q16_16 result;
+		result.raw = value;
+		return result;
+	}
+
+	constexpr int32_t getRaw() const { return raw; }
+	explicit constexpr operator float() const { return (float)raw / 65536.0f; }
+	explicit constexpr operator double() const { return (double)raw / 65536.0; }
+
+	constexpr Q16_16 operator+(Q16_16 other) const { return fromRaw(raw + other.raw); }
+	constexpr Q16_16 operator-(Q16_16 other) const { return fromRaw(raw - other.raw); }
+	constexpr Q16_16 operator-() const { return fromRaw(-raw); }
+	constexpr Q16_16 operator*(Q16_16 other) const { return fromRaw((int32_t)(((int64_t)raw * other.raw) >> 16)); }
+	constexpr Q16_16 operator/(Q16_16 other) const { return fromRaw((int32_t)(((int64_t)raw << 16) / other.raw)); }
+	/** Division by an integer is a plain integer division of the raw value, rounded to nearest */
+	constexpr Q16_16 operator/(unsigned int divisor) const
+	{
+		return fromRaw((raw + (raw < 0 ? -(int32_t)(divisor / 2) : (int32_t)(divisor / 2))) / (int32_t)divisor);
+	}
+
+	Q16_16 &operator+=(Q16_16 other)
+	{
+		raw += other.raw;
+		return *this;
+	}
+	Q16_16 &operator-=(Q16_16 other)
+	{
+		raw -= other.raw;
+		return *this;
+	}
+
+	constexpr bool operator<(Q16_16 other) const { return raw < other.raw; }
+	constexpr bool operator>(Q16_16 other) const { return raw > other.raw; }
+	constexpr bool operator<=(Q16_16 other) const { return raw <= other.raw; }
+	constexpr bool operator>=(Q16_16 other) const { return raw >= other.raw; }
+	constexpr bool operator==(Q16_16 other) const { return raw == other.raw; }
+
+private:
+	int32_t raw;
+};
+
+/**
+ * @brief Signed fixed point number with 48 integer and 16 fractional bits.
+ * Accumulator for sums of squares and products of Q16_16 values,
+ * which leave the Q16_16 range after a few thousand readings.
+ */
+class Q48_16
+{
+public:
+	constexpr Q48_16() : raw(0) {}
+	constexpr Q48_16(Q16_16 value) : raw(value.getRaw()) {}
+
+	/** Create a value from its raw 64 bit representation */
+	static constexpr Q48_16 fromRaw(int64_t value)
+	{
+		Q48_16 result;
+		result.raw = value;
+		return result;
+	}
+
+	/** Full product of two Q16_16 values */
+	static constexpr Q48_16 mul(Q16_16 a, Q16_16 b) { return fromRaw(((int64_t)a.getRaw() * b.getRaw()) >> 16); }
+
+	constexpr int64_t getRaw() const { return raw; }
+	explicit constexpr operator float() const { return (float)raw / 65536.0f; }
+	explicit constexpr operator double() const { return (double)raw / 65536.0; }
+	/** Narrow to Q16_16, saturated to its range */
+	explicit constexpr operator Q16_16() const
+	{
+		return Q16_16::fromRaw(raw > INT32_MAX ? INT32_MAX : (raw < INT32_MIN ? INT32_MIN : (int32_t)raw));
+	}
+
+	constexpr Q48_16 operator+(Q48_16 other) const { return fromRaw(raw + other.raw); }
+	constexpr Q48_16 operator-(Q48_16 other) const { return fromRaw(raw - other.raw); }
+	/** Division by an integer, rounded to nearest */
+	constexpr Q48_16 operator/(unsigned int divisor) const
+	{
+		return fromRaw((raw + (raw < 0 ? -(int64_t)(divisor / 2) : (int64_t)(divisor / 2))) / (int64_t)divisor);
+	}
+
+	Q48_16 &operator+=(Q48_16 other)
+	{
+		raw += other.raw;
+		return *this;
+	}
+	Q48_16 &operator-=(Q48_16 other)
+	{
+		raw -= other.raw;
+		return *this;
+	}
+
+private:
+	int64_t raw;
+};
+
+#endif // Q16_H
@@ -0,0 +1,81 @@
+/**
+ * @file spsc_queue.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Lock-free single producer / single consumer queue
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+
+/**
+ * @brief Fixed size ring buffer for exactly one producer and one consumer task.
+ * push() is only called by the producer and pop() only by the consumer,
+ * so neither side needs a lock or a critical section.
+ *
+ * @tparam T type of the entries
+ * @tparam SIZE number of entries, must be a power of 2
+ */
+template <typename T, size_t SIZE>
+class SpscQueue
+{
+	static_assert((SIZE & (SIZE - 1)) == 0, "SIZE must be a power of 2");
+
+public:
+	/**
+	 * @brief Add an entry, called only by the producer
+	 *
+	 * @param entry entry to add
+	 * @return true if added, false if the queue is full
+	 */
+	bool push(const T &entry)
+	{
+		size_t head = _head.load(std::memory_order_relaxed);
+		if (head - _tail.load(std::memory_order_acquire) >= SIZE)
+		{
+			return false;
+		}
+		_entries[head & (SIZE - 1)] = entry;
+		_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * @brief Remove the oldest entry, called only by the consumer
+	 *
+	 * @param entry receives the entry
+	 * @return true if an entry was removed, false if the queue is empty
+	 */
+	bool pop(T &entry)
+	{
+		size_t tail = _tail.load(std::memory_order_relaxed);
+		if (tail == _head.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+		entry = _entries[tail & (SIZE - 1)];
+		_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * @brief Number of entries in the queue
+	 */
+	size_t size(void) const
+	{
+		return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+	}
+
+private:
+	T _entries[SIZE];
+	std::atomic<size_t> _head{0};
+	std::atomic<size_t> _tail{0};
+};
+
+#endif // SPSC_QUEUE_H
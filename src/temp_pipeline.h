@@ -0,0 +1,273 @@
+/**
+ * @file temp_pipeline.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Processing of the IR sensor samples into a body temperature
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * The pipeline is composed at compile time from a list of stages.
+ * Each stage is a plain class with
+ *   void reset(void)                    start of a new measurement
+ *   bool process(temp_sample_s &sample) modify the sample, false drops it
+ * The stages are called in order without virtual functions or heap.
+ * Nothing here depends on the hardware, so the stages can be used
+ * on the host as well.
+ */
+#ifndef TEMP_PIPELINE_H
+#define TEMP_PIPELINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <tuple>
+
+/** One sample of the IR sensor */
+struct temp_sample_s
+{
+	/** Object temperature in Celsius, changed by the stages */
+	float object;
+	/** Sensor (ambient) temperature in Celsius */
+	float ambient;
+	/** Time of the sample in ms */
+	uint32_t time;
+};
+
+/**
+ * @brief Drops single spikes with a Hampel filter: a sample is an outlier
+ * if it is more than k times the median absolute deviation away from the
+ * median of the last SIZE samples. All samples go into the window, so a
+ * real step of the temperature is accepted after SIZE / 2 samples.
+ * Until the window is full, a sample is checked against the samples
+ * that are in the window. A spike in the first samples cannot be
+ * detected, so the first min_count - 1 samples only fill the window.
+ *
+ * @tparam SIZE window size, odd
+ */
+template <size_t SIZE>
+class OutlierStage
+{
+	static_assert((SIZE & 1) == 1, "SIZE must be odd");
+
+public:
+	/** Accepted deviation in scaled MADs */
+	float k = 3.0f;
+	/** Deviation that is always accepted in degree, covers the sensor noise */
+	float min_dev = 0.2f;
+	/** Samples in the window before the first one is accepted, 1 .. SIZE,
+	 * 1 accepts the first sample without a check */
+	size_t min_count = 3;
+
+	void reset(void)
+	{
+		_count = 0;
+		_next = 0;
+	}
+
+	bool process(temp_sample_s &sample)
+	{
+		_window[_next] = sample.object;
+		_next = (_next + 1) % SIZE;
+		if (_count < SIZE)
+		{
+			_count++;
+		}
+		if (_count < min_count)
+		{
+			return false;
+		}
+
+		// The window is filled from index 0, so the first _count values are valid
+		float sorted[SIZE];
+		for (size_t idx = 0; idx < _count; idx++)
+		{
+			sorted[idx] = _window[idx];
+		}
+		float median = median_of(sorted, _count);
+		for (size_t idx = 0; idx < _count; idx++)
+		{
+			sorted[idx] = fabsf(_window[idx] - median);
+		}
+		// 1.4826 * MAD estimates the standard deviation of normal noise
+		float limit = k * 1.4826f * median_of(sorted, _count);
+		if (limit < min_dev)
+		{
+			limit = min_dev;
+		}
+		return fabsf(sample.object - median) <= limit;
+	}
+
+private:
+	/** Median by insertion sort, fast for the few values of the window */
+	static float median_of(float (&values)[SIZE], size_t count)
+	{
+		for (size_t idx = 1; idx < count; idx++)
+		{
+			float value = values[idx];
+			size_t pos = idx;
+			for (; (pos > 0) && (values[pos - 1] > value); pos--)
+			{
+				values[pos] = values[pos - 1];
+			}
+			values[pos] = value;
+		}
+		if ((count & 1) == 0)
+		{
+			return (values[count / 2 - 1] + values[count / 2]) / 2.0f;
+		}
+		return values[count / 2];
+	}
+
+	float _window[SIZE];
+	size_t _count = 0;
+	size_t _next = 0;
+};
+
+/**
+ * @brief Corrects the object temperature for the emissivity of the target.
+ * The sensor calculates with emissivity 1.0. A target with lower emissivity
+ * emits less and reflects the surrounding, which is assumed to be at the
+ * sensor temperature:
+ *   T_obj^4 = (T_meas^4 - (1 - e) * T_amb^4) / e   (in Kelvin)
+ */
+class EmissivityStage
+{
+public:
+	/** Emissivity of the target, 1.0 = no correction, human skin is about 0.98 */
+	float emissivity = 1.0f;
+
+	void reset(void) {}
+
+	bool process(temp_sample_s &sample)
+	{
+		if (emissivity == 1.0f)
+		{
+			return true;
+		}
+		float measured = sample.object + 273.15f;
+		float ambient = sample.ambient + 273.15f;
+		float measured_4 = measured * measured * measured * measured;
+		float ambient_4 = ambient * ambient * ambient * ambient;
+		float object_4 = (measured_4 - (1.0f - emissivity) * ambient_4) / emissivity;
+		if (object_4 <= 0.0f)
+		{
+			return false;
+		}
+		sample.object = sqrtf(sqrtf(object_4)) - 273.15f;
+		return true;
+	}
+};
+
+/**
+ * @brief Compensates the error of the object temperature while the sensor
+ * itself warms up or cools down (e.g. held in the hand or taken out of a pocket).
+ * The thermal gradient inside the sensor shifts the reading proportional to
+ * the rate of change of the sensor temperature.
+ */
+class AmbientStage
+{
+public:
+	/** Correction in degree per degree/s change of the sensor temperature, 0 = no correction */
+	float gain = 0.0f;
+	/** Smoothing of the rate, 0 .. 1, 1 = no smoothing */
+	float alpha = 0.3f;
+
+	void reset(void)
+	{
+		_started = false;
+		_rate = 0.0f;
+	}
+
+	bool process(temp_sample_s &sample)
+	{
+		if (_started && (sample.time != _last_time))
+		{
+			float rate = (sample.ambient - _last_ambient) * 1000.0f / (float)(uint32_t)(sample.time - _last_time);
+			_rate += alpha * (rate - _rate);
+		}
+		_started = true;
+		_last_ambient = sample.ambient;
+		_last_time = sample.time;
+		sample.object -= gain * _rate;
+		return true;
+	}
+
+private:
+	bool _started = false;
+	float _rate = 0.0f;
+	float _last_ambient = 0.0f;
+	uint32_t _last_time = 0;
+};
+
+/**
+ * @brief Estimates the core temperature from the skin temperature.
+ * Heat flows from the core through the tissue to the skin and from the
+ * skin to the surrounding, so the core is warmer than the skin by a part
+ * of the skin to ambient difference:
+ *   T_core = T_skin + ratio * (T_skin - T_amb)
+ * The ratio depends on the measuring site, calibrate it against a
+ * reference thermometer.
+ */
+class SkinToCoreStage
+{
+public:
+	/** Ratio of the tissue to the skin-ambient heat transfer, 0 = no correction,
+	 * about 0.1 .. 0.2 for the forehead */
+	float ratio = 0.0f;
+
+	void reset(void) {}
+
+	bool process(temp_sample_s &sample)
+	{
+		sample.object += ratio * (sample.object - sample.ambient);
+		return true;
+	}
+};
+
+/**
+ * @brief Processing pipeline composed of the stages in Stages.
+ * The stages are members, a sample is passed through them in order
+ * until a stage drops it.
+ *
+ * @tparam Stages stage classes, see the top of this file
+ */
+template <typename... Stages>
+class TempPipeline
+{
+public:
+	/**
+	 * @brief Reset all stages for a new measurement
+	 */
+	void reset(void)
+	{
+		std::apply([](Stages &...stages) { (stages.reset(), ...); }, _stages);
+	}
+
+	/**
+	 * @brief Pass a sample through all stages
+	 *
+	 * @param sample sample of the sensor, receives the result
+	 * @return true if the sample passed, false if a stage dropped it
+	 */
+	bool process(temp_sample_s &sample)
+	{
+		return std::apply([&sample](Stages &...stages) { return (stages.process(sample) && ...); }, _stages);
+	}
+
+	/**
+	 * @brief Access a stage to change its settings
+	 *
+	 * @tparam IDX position of the stage in Stages
+	 */
+	template <size_t IDX>
+	auto &stage(void)
+	{
+		return std::get<IDX>(_stages);
+	}
+
+private:
+	std::tuple<Stages...> _stages;
+};
+
+#endif // TEMP_PIPELINE_H
@@ -0,0 +1,392 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Accuracy and speed of the AvgStd variants on sensor traces
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <chrono>
+#include "avg.h"
+#include "hal.h"
+#include "ir-trace.h"
+
+/**
+ * @brief The statistics AvgStd was replaced with, kept as reference
+ * Mean and variance are scaled by (M-1)/M and M/(M+1) per reading
+ */
+class AvgStdLegacy
+{
+public:
+	void addReading(float val)
+	{
+		if (N == 0)
+		{
+			avg = val;
+		}
+		else if (N == 1)
+		{
+			float thisavg = (avg + val) / 2;
+			var = (avg - thisavg) * (avg - thisavg) + (val - thisavg) * (val - thisavg);
+			avg = thisavg;
+		}
+		else
+		{
+			float M = (float)N;
+			var = var * ((M - 1) / M) + ((val - avg) * (val - avg) / (M + 1));
+			avg = avg * (M / (M + 1)) + val / (M + 1);
+		}
+		N++;
+	}
+	float getMean() { return avg; }
+	float getStd() { return sqrtf(var); }
+
+private:
+	float avg = 0;
+	float var = 0;
+	unsigned int N = 0;
+};
+
+/** Readings of the simulated sensor, the trace with noise, looped */
+static std::vector<float> session;
+
+/**
+ * @brief Record a session from the sensor simulation
+ *
+ * @param samples number of samples, one every 500 ms
+ */
+static void record_session(size_t samples)
+{
+	hal_native_set_millis(0);
+	g_ir_sim_settings.noise_std = 0.03;
+	g_ir_sim_settings.drift_per_min = 0.0;
+	g_ir_sim_settings.outlier_rate = 0.0;
+	g_ir_sim_settings.seed = 4711;
+	hal_ir_begin();
+	session.clear();
+	for (size_t idx = 0; idx < samples; idx++)
+	{
+		session.push_back(hal_ir_object_temp());
+	}
+}
+
+/**
+ * @brief Two pass mean and sample standard deviation in double
+ */
+static void reference_stats(const float *values, size_t count, double &mean, double &std)
+{
+	double sum = 0;
+	for (size_t idx = 0; idx < count; idx++)
+	{
+		sum += values[idx];
+	}
+	mean = sum / count;
+	double sum_sq = 0;
+	for (size_t idx = 0; idx < count; idx++)
+	{
+		sum_sq += (values[idx] - mean) * (values[idx] - mean);
+	}
+	std = sqrt(sum_sq / (count - 1));
+}
+
+/**
+ * @brief Errors of mean and std of a statistics class against the reference
+ */
+template <typename S>
+static void stats_error(const float *values, size_t count, double &mean_error, double &std_error)
+{
+	S stats;
+	for (size_t idx = 0; idx < count; idx++)
+	{
+		stats.addReading(values[idx]);
+	}
+	double mean, std;
+	reference_stats(values, count, mean, std);
+	mean_error = fabs(stats.getMean() - mean);
+	std_error = fabs(stats.getStd() - std);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/** Single measurement over the recorded trace, plateau on the forehead */
+void test_trace_plateau(void)
+{
+	float plateau[40];
+	for (int idx = 0; idx < 40; idx++)
+	{
+		plateau[idx] = ir_trace_object[17 + idx] / 100.0f;
+	}
+	double mean_error, std_error;
+	stats_error<AvgStdT<float>>(plateau, 40, mean_error, std_error);
+	TEST_ASSERT_TRUE(mean_error < 1e-4 && std_error < 1e-4);
+	// The getters return float, so the double variant is limited to float resolution
+	stats_error<AvgStdT<double>>(plateau, 40, mean_error, std_error);
+	TEST_ASSERT_TRUE(mean_error < 1e-5 && std_error < 1e-5);
+	// Resolution of Q16.16 is 1.5e-5, the variance of 0.03 degree noise is 0.0009
+	stats_error<AvgStdT<Q16_16>>(plateau, 40, mean_error, std_error);
+	TEST_ASSERT_TRUE(mean_error < 1e-3 && std_error < 2e-3);
+}
+
+/** Long streaming session, the legacy update drifts, Welford does not */
+void test_long_session(void)
+{
+	record_session(172800); // 24 hours at 2Hz
+	double legacy_mean, legacy_std, float_mean, float_std, double_mean, double_std, q16_mean, q16_std;
+	stats_error<AvgStdLegacy>(session.data(), session.size(), legacy_mean, legacy_std);
+	stats_error<AvgStdT<float>>(session.data(), session.size(), float_mean, float_std);
+	stats_error<AvgStdT<double>>(session.data(), session.size(), double_mean, double_std);
+	stats_error<AvgStdT<Q16_16>>(session.data(), session.size(), q16_mean, q16_std);
+
+	char message[200];
+	snprintf(message, sizeof(message), "24h session, error of mean / std: legacy %.2e / %.2e, float %.2e / %.2e, double %.2e / %.2e, Q16 %.2e / %.2e",
+			 legacy_mean, legacy_std, float_mean, float_std, double_mean, double_std, q16_mean, q16_std);
+	TEST_MESSAGE(message);
+
+	TEST_ASSERT_TRUE(float_mean <= legacy_mean && float_std <= legacy_std);
+	TEST_ASSERT_TRUE(double_mean < 1e-5 && double_std < 1e-5);
+	TEST_ASSERT_TRUE(float_mean < 0.01 && float_std < 0.01);
+	TEST_ASSERT_TRUE(q16_mean < 0.05 && q16_std < 0.001);
+}
+
+/** Merging two large sets, (Q16_16)(int)N overflowed for N >= 32768 */
+void test_merge_large(void)
+{
+	record_session(100000);
+	AvgStdT<Q16_16> first, second;
+	AvgStdT<float> first_float, second_float;
+	for (size_t idx = 0; idx < session.size(); idx++)
+	{
+		(idx < 40000 ? first : second).addReading(session[idx]);
+		(idx < 40000 ? first_float : second_float).addReading(session[idx]);
+	}
+	first.merge(second);
+	first_float.merge(second_float);
+	double mean, std;
+	reference_stats(session.data(), session.size(), mean, std);
+	TEST_ASSERT_EQUAL_UINT32(100000, first.getN());
+	TEST_ASSERT_FLOAT_WITHIN(0.01, mean, first.getMean());
+	TEST_ASSERT_FLOAT_WITHIN(0.001, std, first.getStd());
+	TEST_ASSERT_FLOAT_WITHIN(0.001, mean, first_float.getMean());
+	TEST_ASSERT_FLOAT_WITHIN(0.001, std, first_float.getStd());
+}
+
+/** Sliding window and slope of the fixed point variant follow the float variant */
+void test_window_q16(void)
+{
+	AvgStdT<float> stats_float;
+	AvgStdT<Q16_16> stats_q16;
+	stats_float.setWindowSize(20);
+	stats_q16.setWindowSize(20);
+	stats_float.setSamplingInterval(500);
+	stats_q16.setSamplingInterval(500);
+	size_t count = sizeof(ir_trace_object) / sizeof(ir_trace_object[0]);
+	for (size_t idx = 0; idx < count; idx++)
+	{
+		stats_float.addReading(ir_trace_object[idx] / 100.0f);
+		stats_q16.addReading(ir_trace_object[idx] / 100.0f);
+		TEST_ASSERT_FLOAT_WITHIN(0.001, stats_float.getWindowMean(), stats_q16.getWindowMean());
+		TEST_ASSERT_FLOAT_WITHIN(0.01, stats_float.getWindowStd(), stats_q16.getWindowStd());
+		TEST_ASSERT_FLOAT_WITHIN(0.01, stats_float.getSlope(), stats_q16.getSlope());
+	}
+}
+
+/**
+ * @brief Feed a ramp of +0.01 degree per sample every 500 ms, that is 0.02 degree
+ * per second or a trend of 120 (1.2 degree) over 60 seconds, before and after
+ * the window of 20 readings wraps and is recalculated
+ */
+template <typename T>
+static void check_ramp(float slope_tolerance, int trend_tolerance)
+{
+	AvgStdT<T> stats;
+	stats.setWindowSize(20);
+	stats.setSamplingInterval(500);
+	stats.setTrendInterval(60000);
+	TEST_ASSERT_TRUE(stats.getSlope() == 0.0f);
+	for (int idx = 0; idx < 100; idx++)
+	{
+		stats.addReading(36.0f + idx * 0.01f);
+		if (idx == 0)
+		{
+			TEST_ASSERT_TRUE(stats.getSlope() == 0.0f);
+			TEST_ASSERT_EQUAL_INT(0, stats.getTrend());
+			continue;
+		}
+		TEST_ASSERT_FLOAT_WITHIN(slope_tolerance, 0.02f, stats.getSlope());
+		TEST_ASSERT_TRUE(abs(stats.getTrend() - 120) <= trend_tolerance);
+	}
+	TEST_ASSERT_EQUAL_UINT32(20, stats.getWindowN());
+
+	// Falling ramp, the window forgets the rising one
+	for (int idx = 0; idx < 20; idx++)
+	{
+		stats.addReading(37.0f - idx * 0.01f);
+	}
+	TEST_ASSERT_FLOAT_WITHIN(slope_tolerance, -0.02f, stats.getSlope());
+	TEST_ASSERT_TRUE(abs(stats.getTrend() + 120) <= trend_tolerance);
+}
+
+/** Slope per second and trend of a known ramp, Q16.16 resolves 0.01 degree to 1.5e-5 */
+void test_slope_trend(void)
+{
+	check_ramp<float>(1e-5f, 0);
+	check_ramp<double>(1e-5f, 0);
+	check_ramp<Q16_16>(2e-4f, 1);
+}
+
+/** Rejection of readings outside r_sigma standard deviations */
+void test_rejection(void)
+{
+	AvgStdT<float> stats_float;
+	AvgStdT<Q16_16> stats_q16;
+	stats_float.setRejectionSigma(3.0);
+	stats_q16.setRejectionSigma(3.0);
+	for (int idx = 0; idx < 20; idx++)
+	{
+		float value = 36.5f + ((idx & 1) ? 0.05f : -0.05f);
+		stats_float.checkAndAddReading(value);
+		stats_q16.checkAndAddReading(value);
+	}
+	stats_float.checkAndAddReading(40.0f);
+	stats_q16.checkAndAddReading(40.0f);
+	stats_q16.checkAndAddReading(300.0f);
+	TEST_ASSERT_EQUAL_UINT32(20, stats_float.getN());
+	TEST_ASSERT_EQUAL_UINT32(20, stats_q16.getN());
+	stats_float.checkAndAddReading(36.55f);
+	stats_q16.checkAndAddReading(36.55f);
+	TEST_ASSERT_EQUAL_UINT32(21, stats_float.getN());
+	TEST_ASSERT_EQUAL_UINT32(21, stats_q16.getN());
+}
+
+/**
+ * @brief Welford update of AvgStdT without min, max and the sliding window,
+ * to compare the update alone with the legacy one
+ */
+template <typename T>
+class WelfordOnly
+{
+public:
+	void addReading(float val)
+	{
+		T value = (T)val;
+		N++;
+		T delta = value - avg;
+		avg += delta / (T)N;
+		m2 += delta * (value - avg);
+	}
+	float getMean() { return (float)avg; }
+
+private:
+	T avg = T();
+	T m2 = T();
+	unsigned int N = 0;
+};
+
+/** Q16_16 divides by the count as integer and sums the squares in Q48_16 */
+template <>
+class WelfordOnly<Q16_16>
+{
+public:
+	void addReading(float val)
+	{
+		Q16_16 value = (Q16_16)val;
+		N++;
+		Q16_16 delta = value - avg;
+		avg += delta / N;
+		m2 += Q48_16::mul(delta, value - avg);
+	}
+	float getMean() { return (float)avg; }
+
+private:
+	Q16_16 avg;
+	Q48_16 m2;
+	unsigned int N = 0;
+};
+
+/**
+ * @brief Readings of the recorded trace, looped
+ *
+ * @param samples number of samples
+ */
+static void trace_session(size_t samples)
+{
+	size_t count = sizeof(ir_trace_object) / sizeof(ir_trace_object[0]);
+	session.clear();
+	for (size_t idx = 0; idx < samples; idx++)
+	{
+		session.push_back(ir_trace_object[idx % count] / 100.0f);
+	}
+}
+
+/**
+ * @brief Time per reading of a statistics class over the session
+ */
+template <typename S>
+static double time_per_reading(void)
+{
+	const int rounds = 20;
+	volatile float sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++)
+	{
+		S stats;
+		for (float value : session)
+		{
+			stats.addReading(value);
+		}
+		sink += stats.getMean();
+	}
+	auto end = std::chrono::steady_clock::now();
+	(void)sink;
+	return std::chrono::duration<double, std::nano>(end - start).count() / (rounds * session.size());
+}
+
+/**
+ * The mean and variance update alone against the legacy update, then
+ * addReading with min, max and the sliding window, over the recorded trace
+ */
+void bench_add_reading(void)
+{
+	trace_session(20000);
+	char message[200];
+	double welford[3] = {time_per_reading<WelfordOnly<float>>(), time_per_reading<WelfordOnly<double>>(), time_per_reading<WelfordOnly<Q16_16>>()};
+	double full[3] = {time_per_reading<AvgStdT<float>>(), time_per_reading<AvgStdT<double>>(), time_per_reading<AvgStdT<Q16_16>>()};
+	snprintf(message, sizeof(message), "mean and variance update: legacy %.1f ns, Welford float %.1f ns, double %.1f ns, Q16 %.1f ns per reading",
+			 time_per_reading<AvgStdLegacy>(), welford[0], welford[1], welford[2]);
+	TEST_MESSAGE(message);
+	snprintf(message, sizeof(message), "addReading with window: float %.1f ns, double %.1f ns, Q16 %.1f ns per reading",
+			 full[0], full[1], full[2]);
+	TEST_MESSAGE(message);
+	snprintf(message, sizeof(message), "window upkeep: float %.1f ns, double %.1f ns, Q16 %.1f ns per reading",
+			 full[0] - welford[0], full[1] - welford[1], full[2] - welford[2]);
+	TEST_MESSAGE(message);
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	UNITY_BEGIN();
+	RUN_TEST(test_trace_plateau);
+	RUN_TEST(test_long_session);
+	RUN_TEST(test_merge_large);
+	RUN_TEST(test_window_q16);
+	RUN_TEST(test_slope_trend);
+	RUN_TEST(test_rejection);
+	RUN_TEST(bench_add_reading);
+	return UNITY_END();
+}
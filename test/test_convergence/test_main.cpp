@@ -0,0 +1,198 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Time to result and accuracy of the measurement stop policy
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * Replays the recorded trace through the sensor simulation and stops
+ * like measure_loop() does. The measurements start while the sensor
+ * is moved to the forehead, the reference is the mean of the trace
+ * while it is held there.
+ */
+
+#include <unity.h>
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "measure_policy.h"
+#include "hal.h"
+#include "ir-trace.h"
+
+/** First and last trace sample on the forehead */
+#define PLATEAU_FIRST 17
+#define PLATEAU_LAST 56
+
+/** Result of one simulated measurement */
+struct run_result_s
+{
+	/** Time to result in ms */
+	uint32_t time;
+	/** Deviation from the reference in degree */
+	float error;
+};
+
+/** Summary of many measurements */
+struct policy_result_s
+{
+	/** Median time to result in ms */
+	uint32_t median_time;
+	/** Mean and largest absolute error in degree */
+	float mean_error;
+	float max_error;
+};
+
+/** Mean of the trace on the forehead */
+static float reference;
+
+/**
+ * @brief One measurement like measure_loop()
+ *
+ * @param settings stop policy
+ * @param start start of the measurement after the start of the trace in ms
+ * @param seed seed of the simulated noise
+ */
+static run_result_s run_measurement(const measure_settings_s &settings, uint32_t start, uint32_t seed)
+{
+	g_ir_sim_settings.seed = seed;
+	hal_native_set_millis(0);
+	hal_ir_begin();
+	hal_delay(start);
+
+	AvgStd samples;
+	samples.reset();
+	samples.clearHistory();
+	samples.setSamplingInterval(IR_TRACE_PERIOD);
+	uint32_t measure_start = hal_millis();
+	while (true)
+	{
+		samples.checkAndAddReading(hal_ir_object_temp());
+		time_t elapsed = hal_millis() - measure_start;
+		if ((elapsed > settings.max_time) || measure_converged(samples, settings, elapsed))
+		{
+			break;
+		}
+	}
+	run_result_s result;
+	result.time = hal_millis() - measure_start;
+	result.error = samples.getMean() - reference;
+	return result;
+}
+
+/**
+ * @brief Measurements started every 250 ms while the sensor reaches
+ * the forehead, each with 20 different noise seeds
+ */
+static policy_result_s run_policy(const measure_settings_s &settings)
+{
+	std::vector<uint32_t> times;
+	float sum_error = 0;
+	float max_error = 0;
+	for (uint32_t start = 7500; start <= 9500; start += 250)
+	{
+		for (uint32_t seed = 1; seed <= 20; seed++)
+		{
+			run_result_s run = run_measurement(settings, start, seed * 7919);
+			times.push_back(run.time);
+			sum_error += fabsf(run.error);
+			max_error = std::max(max_error, fabsf(run.error));
+		}
+	}
+	std::sort(times.begin(), times.end());
+	policy_result_s result;
+	result.median_time = times[times.size() / 2];
+	result.mean_error = sum_error / times.size();
+	result.max_error = max_error;
+	return result;
+}
+
+/**
+ * @brief Print the result of a policy
+ */
+static void report(const char *name, const policy_result_s &result)
+{
+	char message[160];
+	snprintf(message, sizeof(message), "%-28s median %5u ms, mean error %.3f, max error %.3f degree",
+			 name, (unsigned int)result.median_time, result.mean_error, result.max_error);
+	TEST_MESSAGE(message);
+}
+
+void setUp(void)
+{
+	float sum = 0;
+	for (int idx = PLATEAU_FIRST; idx <= PLATEAU_LAST; idx++)
+	{
+		sum += ir_trace_object[idx] / 100.0f;
+	}
+	reference = sum / (PLATEAU_LAST - PLATEAU_FIRST + 1);
+	g_ir_sim_settings.noise_std = 0.03;
+	g_ir_sim_settings.drift_per_min = 0.0;
+	g_ir_sim_settings.outlier_rate = 0.0;
+}
+
+void tearDown(void)
+{
+}
+
+/** The default policy stops early without losing accuracy */
+void test_default_policy(void)
+{
+	measure_settings_s fixed = MEASURE_SETTINGS_DEFAULT;
+	// Never converges, runs max_time like the old measure_loop()
+	fixed.min_time = fixed.max_time + 1;
+	measure_settings_s policy = MEASURE_SETTINGS_DEFAULT;
+
+	policy_result_s fixed_result = run_policy(fixed);
+	policy_result_s policy_result = run_policy(policy);
+	report("fixed 10 s", fixed_result);
+	report("default policy", policy_result);
+
+	TEST_ASSERT_TRUE(policy_result.median_time < fixed_result.median_time / 2);
+	TEST_ASSERT_TRUE(policy_result.mean_error < 0.1f);
+	TEST_ASSERT_TRUE(policy_result.max_error < 0.3f);
+}
+
+/** The readings of the step stay in the mean, a measurement started on it must not converge */
+void test_rising_edge(void)
+{
+	measure_settings_s policy = MEASURE_SETTINGS_DEFAULT;
+	for (uint32_t seed = 1; seed <= 20; seed++)
+	{
+		// Sample 13 is the middle of the step from the wall to the forehead
+		run_result_s run = run_measurement(policy, 13 * IR_TRACE_PERIOD, seed);
+		TEST_ASSERT_TRUE(run.time > (uint32_t)policy.max_time);
+	}
+}
+
+/** Time and accuracy for other tolerances and noise levels */
+void bench_policy_tradeoff(void)
+{
+	const float tolerances[] = {0.02f, 0.05f, 0.1f, 0.2f};
+	const float noises[] = {0.03f, 0.1f};
+	for (float noise : noises)
+	{
+		g_ir_sim_settings.noise_std = noise;
+		for (float tolerance : tolerances)
+		{
+			measure_settings_s policy = MEASURE_SETTINGS_DEFAULT;
+			policy.tolerance = tolerance;
+			char name[40];
+			snprintf(name, sizeof(name), "noise %.2f, tolerance %.2f", noise, tolerance);
+			report(name, run_policy(policy));
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	UNITY_BEGIN();
+	RUN_TEST(test_default_policy);
+	RUN_TEST(test_rising_edge);
+	RUN_TEST(bench_policy_tradeoff);
+	return UNITY_END();
+}
@@ -0,0 +1,210 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Stress test of the event flags, no event may get lost
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * A loop thread waits and dispatches like loop() does, producer threads
+ * post the events like the ISR, the BLE callbacks and the measurement
+ * task. An event may be handled once for several posts, but every post
+ * must be followed by a call of its handler.
+ */
+
+#include <unity.h>
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include "events.h"
+
+/** Number of producers, one event bit each */
+#define NUM_PRODUCERS 8
+
+/** Posts of each producer, incremented before the event is posted */
+static std::atomic<uint32_t> posted[NUM_PRODUCERS];
+/** Value of posted[] seen by the last call of the handler */
+static std::atomic<uint32_t> seen[NUM_PRODUCERS];
+/** Number of handler calls */
+static std::atomic<uint32_t> handled[NUM_PRODUCERS];
+/** Loop thread runs while set */
+static std::atomic<bool> loop_running;
+
+/**
+ * @brief Handler of the event with bit BIT
+ */
+template <int BIT>
+static void handler(void)
+{
+	seen[BIT].store(posted[BIT].load());
+	handled[BIT]++;
+}
+
+static const event_handler_t handlers[NUM_PRODUCERS] = {
+	handler<0>, handler<1>, handler<2>, handler<3>, handler<4>, handler<5>, handler<6>, handler<7>};
+
+/**
+ * @brief Loop thread, same as loop() without the LEDs
+ */
+static void loop_thread(void)
+{
+	init_events();
+	while (loop_running)
+	{
+		if (events_wait(10))
+		{
+			events_dispatch();
+		}
+	}
+	events_dispatch();
+}
+
+/**
+ * @brief Start the loop thread with fresh counters
+ */
+static std::thread start_loop(void)
+{
+	for (int idx = 0; idx < NUM_PRODUCERS; idx++)
+	{
+		posted[idx] = 0;
+		seen[idx] = 0;
+		handled[idx] = 0;
+		events_register(1 << idx, handlers[idx]);
+	}
+	loop_running = true;
+	return std::thread(loop_thread);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/** Only single bits can be registered */
+void test_register(void)
+{
+	TEST_ASSERT_FALSE(events_register(NO_EVENT, handler<0>));
+	TEST_ASSERT_FALSE(events_register(BLE_DATA | BUTTON, handler<0>));
+	TEST_ASSERT_TRUE(events_register(BUTTON, handler<0>));
+}
+
+/**
+ * Each producer posts and waits until its handler has seen the post.
+ * A lost event would stop the producer, it would run into the timeout.
+ */
+void test_ping_pong(void)
+{
+	const uint32_t rounds = 20000;
+	std::thread loop = start_loop();
+	std::atomic<uint32_t> timeouts{0};
+	std::vector<std::thread> producers;
+	for (int idx = 0; idx < NUM_PRODUCERS; idx++)
+	{
+		producers.emplace_back([idx, &timeouts]() {
+			for (uint32_t round = 1; round <= rounds; round++)
+			{
+				posted[idx] = round;
+				if (idx & 1)
+				{
+					events_post_from_isr(1 << idx);
+				}
+				else
+				{
+					events_post(1 << idx);
+				}
+				auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+				while (seen[idx].load() != round)
+				{
+					if (std::chrono::steady_clock::now() > deadline)
+					{
+						timeouts++;
+						return;
+					}
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+	for (auto &producer : producers)
+	{
+		producer.join();
+	}
+	loop_running = false;
+	loop.join();
+
+	TEST_ASSERT_EQUAL_UINT32(0, timeouts.load());
+	for (int idx = 0; idx < NUM_PRODUCERS; idx++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(rounds, handled[idx].load());
+	}
+}
+
+/**
+ * Producers post as fast as they can, posts of the same event are
+ * merged, but the last post of every event must be handled
+ */
+void test_burst(void)
+{
+	const uint32_t rounds = 200000;
+	std::thread loop = start_loop();
+	std::vector<std::thread> producers;
+	auto start = std::chrono::steady_clock::now();
+	for (int idx = 0; idx < NUM_PRODUCERS; idx++)
+	{
+		producers.emplace_back([idx]() {
+			for (uint32_t round = 1; round <= rounds; round++)
+			{
+				posted[idx] = round;
+				events_post(1 << idx);
+			}
+		});
+	}
+	for (auto &producer : producers)
+	{
+		producer.join();
+	}
+	// Give the loop thread time to handle the last posts
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	bool all_seen = false;
+	while (!all_seen && (std::chrono::steady_clock::now() < deadline))
+	{
+		all_seen = true;
+		for (int idx = 0; idx < NUM_PRODUCERS; idx++)
+		{
+			all_seen = all_seen && (seen[idx].load() == rounds);
+		}
+		std::this_thread::yield();
+	}
+	auto end = std::chrono::steady_clock::now();
+	loop_running = false;
+	loop.join();
+
+	uint32_t calls = 0;
+	for (int idx = 0; idx < NUM_PRODUCERS; idx++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(rounds, seen[idx].load());
+		calls += handled[idx].load();
+	}
+	char message[128];
+	snprintf(message, sizeof(message), "%u posts handled with %u handler calls in %.1f ms",
+			 (unsigned int)(rounds * NUM_PRODUCERS), (unsigned int)calls,
+			 std::chrono::duration<double, std::milli>(end - start).count());
+	TEST_MESSAGE(message);
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	UNITY_BEGIN();
+	RUN_TEST(test_register);
+	RUN_TEST(test_ping_pong);
+	RUN_TEST(test_burst);
+	return UNITY_END();
+}
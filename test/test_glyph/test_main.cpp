@@ -0,0 +1,343 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Glyph cache against the string drawing of the display library
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * The fonts of the display library are not available on the host, the
+ * test generates fonts in the same format with random bitmaps. The
+ * reference renderer follows drawString() of the library: a pass for
+ * the string width, then every font byte is shifted into the buffer.
+ */
+
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "glyph.h"
+#include "format.h"
+
+/** Display size */
+#define DISPLAY_WIDTH 128
+#define DISPLAY_PAGES 8
+
+/** Characters in the glyph cache of display.cpp */
+static const char cached_chars[] = " -.0123456789CV\xBA";
+
+/** Generated fonts, 24 and 10 pixel high like ArialMT_Plain_24 and ArialMT_Plain_10 */
+static std::vector<uint8_t> font_24;
+static std::vector<uint8_t> font_10;
+
+/**
+ * @brief Generate a font in the format of the display library
+ * Header: max width, height, first char, number of chars,
+ * then per char a jump table entry: offset MSB, offset LSB, bytes, width
+ *
+ * @param font receives the font
+ * @param height height in pixels
+ * @param seed seed of the random bitmaps
+ */
+static void make_font(std::vector<uint8_t> &font, uint8_t height, uint32_t seed)
+{
+	const uint8_t first_char = 32;
+	const uint8_t num_chars = 224;
+	uint8_t raster_height = 1 + ((height - 1) / 8);
+	std::vector<uint8_t> data;
+	font.assign(4 + num_chars * 4, 0);
+	font[1] = height;
+	font[2] = first_char;
+	font[3] = num_chars;
+	for (int idx = 0; idx < num_chars; idx++)
+	{
+		seed = seed * 1103515245 + 12345;
+		uint8_t width = height / 2 + (seed >> 16) % (height / 2);
+		uint8_t *jump = &font[4 + idx * 4];
+		if (idx + first_char == ' ')
+		{
+			jump[0] = 0xFF;
+			jump[1] = 0xFF;
+			jump[2] = 0;
+			jump[3] = width;
+			continue;
+		}
+		// The last column is empty, like the spacing of the real fonts
+		uint8_t bytes = (width - 1) * raster_height;
+		jump[0] = data.size() >> 8;
+		jump[1] = data.size() & 0xFF;
+		jump[2] = bytes;
+		jump[3] = width;
+		for (int byte_idx = 0; byte_idx < bytes; byte_idx++)
+		{
+			seed = seed * 1103515245 + 12345;
+			data.push_back(seed >> 16);
+		}
+		font[0] = width > font[0] ? width : font[0];
+	}
+	font.insert(font.end(), data.begin(), data.end());
+}
+
+/**
+ * @brief Draw a font character like drawInternal() of the display library
+ */
+static void reference_draw_char(uint8_t *buffer, int16_t x_move, int16_t y_move, int16_t width, int16_t height,
+								const uint8_t *data, uint16_t offset, uint16_t bytes)
+{
+	if ((width < 0) || (height < 0) || (y_move + height < 0) || (y_move > DISPLAY_PAGES * 8) ||
+		(x_move + width < 0) || (x_move > DISPLAY_WIDTH))
+	{
+		return;
+	}
+	uint8_t raster_height = 1 + ((height - 1) >> 3);
+	int8_t y_offset = y_move & 7;
+	const int16_t buffer_size = DISPLAY_WIDTH * DISPLAY_PAGES;
+	for (uint16_t idx = 0; idx < bytes; idx++)
+	{
+		uint8_t current = data[offset + idx];
+		int16_t x_pos = x_move + (idx / raster_height);
+		int16_t y_pos = ((y_move >> 3) + (idx % raster_height)) * DISPLAY_WIDTH;
+		int16_t data_pos = x_pos + y_pos;
+		if ((data_pos >= 0) && (data_pos < buffer_size) && (x_pos >= 0) && (x_pos < DISPLAY_WIDTH))
+		{
+			buffer[data_pos] |= current << y_offset;
+			if ((data_pos < buffer_size - DISPLAY_WIDTH) && (y_offset != 0))
+			{
+				buffer[data_pos + DISPLAY_WIDTH] |= current >> (8 - y_offset);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Width of a text like getStringWidth() of the display library
+ */
+static uint16_t reference_string_width(const uint8_t *font, const char *text, uint16_t len)
+{
+	uint16_t width = 0;
+	for (uint16_t idx = 0; idx < len; idx++)
+	{
+		uint8_t code = (uint8_t)text[idx];
+		if (code >= font[2])
+		{
+			width += font[4 + (code - font[2]) * 4 + 3];
+		}
+	}
+	return width;
+}
+
+/**
+ * @brief Draw a centered text like drawString() of the display library
+ * The UTF-8 text is converted into Latin-1 first
+ */
+static void reference_draw_string(uint8_t *buffer, const uint8_t *font, int16_t x, int16_t y, const char *text)
+{
+	char latin[32];
+	uint16_t len = 0;
+	for (const char *next = text; (*next != 0) && (len < sizeof(latin) - 1); next++)
+	{
+		if ((uint8_t)*next != 0xC2)
+		{
+			latin[len++] = *next;
+		}
+	}
+	latin[len] = 0;
+
+	uint8_t height = font[1];
+	uint8_t first_char = font[2];
+	uint8_t num_chars = font[3];
+	uint16_t data_start = 4 + num_chars * 4;
+	int16_t cursor_x = x - reference_string_width(font, latin, len) / 2;
+	for (uint16_t idx = 0; idx < len; idx++)
+	{
+		uint8_t code = (uint8_t)latin[idx];
+		if (code < first_char)
+		{
+			continue;
+		}
+		const uint8_t *jump = &font[4 + (code - first_char) * 4];
+		if (!((jump[0] == 0xFF) && (jump[1] == 0xFF)))
+		{
+			reference_draw_char(buffer, cursor_x, y, jump[3], height, font, data_start + ((jump[0] << 8) | jump[1]), jump[2]);
+		}
+		cursor_x += jump[3];
+	}
+}
+
+/** Glyph cache of one font, like display.cpp */
+static glyph_s glyph_cache[sizeof(cached_chars) - 1];
+
+/**
+ * @brief Fill the glyph cache from a font
+ */
+static void init_cache(const uint8_t *font)
+{
+	for (uint8_t char_idx = 0; char_idx < sizeof(cached_chars) - 1; char_idx++)
+	{
+		glyph_render(font, (uint8_t)cached_chars[char_idx], glyph_cache[char_idx]);
+	}
+}
+
+/**
+ * @brief Draw a centered text from the glyph cache, like display_draw_text()
+ */
+static void cached_draw_string(uint8_t *buffer, int16_t x, int16_t y, const char *text)
+{
+	const glyph_s *glyphs[32];
+	uint8_t num_glyphs = 0;
+	uint16_t width = 0;
+	for (const char *next = text; *next != 0; next++)
+	{
+		if ((uint8_t)*next == 0xC2)
+		{
+			continue;
+		}
+		const char *found = (const char *)memchr(cached_chars, *next, sizeof(cached_chars) - 1);
+		glyphs[num_glyphs] = &glyph_cache[found - cached_chars];
+		width += glyphs[num_glyphs++]->advance;
+	}
+	x -= width / 2;
+	for (uint8_t glyph_idx = 0; glyph_idx < num_glyphs; glyph_idx++)
+	{
+		glyph_blit(buffer, DISPLAY_WIDTH, DISPLAY_PAGES, x, y, *glyphs[glyph_idx]);
+		x += glyphs[glyph_idx]->advance;
+	}
+}
+
+void setUp(void)
+{
+	if (font_24.empty())
+	{
+		make_font(font_24, 24, 1);
+		make_font(font_10, 10, 2);
+	}
+}
+
+void tearDown(void)
+{
+}
+
+/** Every cached character is rendered, space has no columns */
+void test_render(void)
+{
+	glyph_s glyph;
+	TEST_ASSERT_TRUE(glyph_render(font_24.data(), '5', glyph));
+	TEST_ASSERT_EQUAL_UINT32(font_24[4 + ('5' - 32) * 4 + 3], glyph.advance);
+	TEST_ASSERT_TRUE(glyph_render(font_24.data(), ' ', glyph));
+	TEST_ASSERT_EQUAL_UINT32(0, glyph.columns);
+	TEST_ASSERT_FALSE(glyph_render(font_24.data(), 10, glyph));
+}
+
+/** Cached drawing gives the same pixels as the library for all rows inside a page */
+void test_same_pixels(void)
+{
+	const std::vector<uint8_t> *fonts[] = {&font_24, &font_10};
+	const char *texts[] = {"36.52 \xC2\xBA""C", "-0.05 \xC2\xBA""C", "3.912V", "4.200V", "100.00 \xC2\xBA""C"};
+	for (const std::vector<uint8_t> *font : fonts)
+	{
+		init_cache(font->data());
+		for (const char *text : texts)
+		{
+			for (int16_t y = 0; y <= DISPLAY_PAGES * 8 - (*font)[1]; y++)
+			{
+				uint8_t expected[DISPLAY_WIDTH * DISPLAY_PAGES] = {0};
+				uint8_t result[DISPLAY_WIDTH * DISPLAY_PAGES] = {0};
+				reference_draw_string(expected, font->data(), 64, y, text);
+				cached_draw_string(result, 64, y, text);
+				TEST_ASSERT_EQUAL_MEMORY(expected, result, sizeof(expected));
+			}
+		}
+	}
+}
+
+/**
+ * @brief Time of one reading update in ns
+ *
+ * @param cached true for format_temp() and the glyph cache,
+ * false for snprintf() and the library drawing
+ */
+static double time_update(bool cached)
+{
+	const int rounds = 20;
+	uint8_t buffer[DISPLAY_WIDTH * DISPLAY_PAGES];
+	volatile uint8_t sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++)
+	{
+		for (int centi = 3000; centi < 4500; centi++)
+		{
+			char text[32];
+			memset(buffer, 0, sizeof(buffer));
+			if (cached)
+			{
+				format_temp(text, centi);
+				cached_draw_string(buffer, 64, 28, text);
+			}
+			else
+			{
+				snprintf(text, sizeof(text), "%.2f \xC2\xBA""C", (float)centi / 100.0f);
+				reference_draw_string(buffer, font_24.data(), 64, 28, text);
+			}
+			sink += buffer[3 * DISPLAY_WIDTH + 64];
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+	(void)sink;
+	return std::chrono::duration<double, std::nano>(end - start).count() / (rounds * 1500);
+}
+
+/**
+ * @brief Time of formatting a temperature in ns
+ */
+static double time_format(bool integer)
+{
+	const int rounds = 200;
+	volatile char sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++)
+	{
+		for (int centi = 3000; centi < 4500; centi++)
+		{
+			char text[32];
+			if (integer)
+			{
+				format_temp(text, centi);
+			}
+			else
+			{
+				snprintf(text, sizeof(text), "%.2f \xC2\xBA""C", (float)centi / 100.0f);
+			}
+			sink += text[1];
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+	(void)sink;
+	return std::chrono::duration<double, std::nano>(end - start).count() / (rounds * 1500);
+}
+
+void bench_update(void)
+{
+	init_cache(font_24.data());
+	char message[160];
+	snprintf(message, sizeof(message), "format: snprintf %.1f ns, format_temp %.1f ns",
+			 time_format(false), time_format(true));
+	TEST_MESSAGE(message);
+	double library_ns = time_update(false);
+	double cached_ns = time_update(true);
+	snprintf(message, sizeof(message), "reading update (clear, format, draw): library %.1f ns, glyph cache %.1f ns (%.1fx)",
+			 library_ns, cached_ns, library_ns / cached_ns);
+	TEST_MESSAGE(message);
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	UNITY_BEGIN();
+	RUN_TEST(test_render);
+	RUN_TEST(test_same_pixels);
+	RUN_TEST(bench_update);
+	return UNITY_END();
+}
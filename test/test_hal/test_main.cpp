@@ -0,0 +1,108 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Native tests of the host HAL backend and the sensor simulation
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <unity.h>
+#include "hal.h"
+#include "ir-trace.h"
+
+/** EEPROM cell with the refresh rate, see ir-sensor.cpp */
+#define EE_MEAS_1 0x24E1
+
+void setUp(void)
+{
+	hal_native_set_millis(0);
+	g_ir_sim_settings.noise_std = 0.0;
+	g_ir_sim_settings.drift_per_min = 0.0;
+	g_ir_sim_settings.outlier_rate = 0.0;
+	g_ir_sim_settings.seed = 12345;
+	hal_ir_write_eeprom(EE_MEAS_1, 0x820D);
+	hal_ir_begin();
+}
+
+void tearDown(void)
+{
+}
+
+/** The simulated clock only moves in hal_delay() */
+void test_clock(void)
+{
+	hal_native_set_millis(1000);
+	TEST_ASSERT_EQUAL_UINT32(1000, hal_millis());
+	hal_delay(250);
+	TEST_ASSERT_EQUAL_UINT32(1250, hal_millis());
+	TEST_ASSERT_EQUAL_UINT32(1250, hal_millis());
+}
+
+/** Samples are delivered at the refresh rate of the EEPROM setting */
+void test_sensor_pacing(void)
+{
+	hal_ir_continuous();
+	hal_ir_object_temp();
+	uint32_t last = hal_millis();
+	for (int idx = 0; idx < 10; idx++)
+	{
+		hal_ir_object_temp();
+		TEST_ASSERT_EQUAL_UINT32(500, hal_millis() - last);
+		last = hal_millis();
+	}
+
+	// Refresh rate 4 = 8Hz
+	uint16_t meas = 0;
+	TEST_ASSERT_TRUE(hal_ir_read_register(EE_MEAS_1, meas));
+	TEST_ASSERT_TRUE(hal_ir_write_eeprom(EE_MEAS_1, (meas & ~0x0700) | (4 << 8)));
+	hal_ir_object_temp();
+	last = hal_millis();
+	hal_ir_object_temp();
+	TEST_ASSERT_EQUAL_UINT32(125, hal_millis() - last);
+}
+
+/** Without errors the simulation replays the trace */
+void test_sensor_trace(void)
+{
+	float value = hal_ir_object_temp();
+	TEST_ASSERT_FLOAT_WITHIN(0.01, ir_trace_object[1] / 100.0, value);
+	hal_delay(IR_TRACE_PERIOD * 20 - 5);
+	value = hal_ir_object_temp();
+	TEST_ASSERT_FLOAT_WITHIN(0.01, ir_trace_object[21] / 100.0, value);
+}
+
+/** The sensor temperature belongs to the last sample, it does not start a new one */
+void test_sensor_temp(void)
+{
+	hal_ir_object_temp();
+	float sensor_temp = hal_ir_sensor_temp();
+	TEST_ASSERT_FLOAT_WITHIN(0.01, ir_trace_ambient[1] / 100.0, sensor_temp);
+	uint32_t now = hal_millis();
+	hal_delay(IR_TRACE_PERIOD * 10);
+	TEST_ASSERT_FLOAT_WITHIN(0.0001, sensor_temp, hal_ir_sensor_temp());
+	TEST_ASSERT_EQUAL_UINT32(now + IR_TRACE_PERIOD * 10, hal_millis());
+}
+
+/** Only the two EEPROM cells with the refresh rate exist */
+void test_sensor_registers(void)
+{
+	uint16_t value = 0;
+	TEST_ASSERT_FALSE(hal_ir_read_register(0x1234, value));
+	TEST_ASSERT_FALSE(hal_ir_write_eeprom(0x1234, value));
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	UNITY_BEGIN();
+	RUN_TEST(test_clock);
+	RUN_TEST(test_sensor_pacing);
+	RUN_TEST(test_sensor_trace);
+	RUN_TEST(test_sensor_temp);
+	RUN_TEST(test_sensor_registers);
+	return UNITY_END();
+}
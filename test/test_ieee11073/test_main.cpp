@@ -0,0 +1,419 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief IEEE-11073 FLOAT and SFLOAT encoders, decoders and packing, benchmark of the FLOAT encoder
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include "IEEE11073float.h"
+
+/** abs() of the Arduino core is a macro and works with doubles */
+#define ARDUINO_ABS(x) ((x) > 0 ? (x) : -(x))
+
+/**
+ * @brief The loop based encoder float2IEEE11073() was replaced with,
+ * kept unchanged as reference
+ */
+static uint32_t float2IEEE11073_loop(double data, uint8_t output[4])
+{
+	uint32_t result = MDER_NaN;
+
+	if (isnan(data))
+	{
+		goto finally;
+	}
+
+	double sgn;
+	sgn = data > 0 ? +1 : -1;
+	double mantissa;
+	mantissa = fabs(data);
+	int32_t exponent;
+	exponent = 0; // Note: 10**x exponent, not 2**x
+
+	// scale up if number is too big
+	while (mantissa > MDER_FLOAT_MANTISSA_MAX)
+	{
+		mantissa /= 10.0;
+		++exponent;
+		if (exponent > MDER_FLOAT_EXPONENT_MAX)
+		{
+			// argh, should not happen
+			if (sgn > 0)
+			{
+				result = MDER_POSITIVE_INFINITY;
+			}
+			else
+			{
+				result = MDER_NEGATIVE_INFINITY;
+			}
+			goto finally;
+		}
+	}
+
+	// scale down if number is too small
+	while (mantissa < 1)
+	{
+		mantissa *= 10;
+		--exponent;
+		if (exponent < MDER_FLOAT_EXPONENT_MIN)
+		{
+			// argh, should not happen
+			result = 0;
+			goto finally;
+		}
+	}
+
+	// scale down if number needs more precision
+	double smantissa;
+	smantissa = round(mantissa * MDER_FLOAT_PRECISION);
+	double rmantissa;
+	rmantissa = round(mantissa) * MDER_FLOAT_PRECISION;
+	double mdiff;
+	mdiff = ARDUINO_ABS(smantissa - rmantissa);
+	while (mdiff > 0.5 && exponent > MDER_FLOAT_EXPONENT_MIN &&
+		   (mantissa * 10) <= MDER_FLOAT_MANTISSA_MAX)
+	{
+		mantissa *= 10;
+		--exponent;
+		smantissa = round(mantissa * MDER_FLOAT_PRECISION);
+		rmantissa = round(mantissa) * MDER_FLOAT_PRECISION;
+		mdiff = ARDUINO_ABS(smantissa - rmantissa);
+	}
+
+	uint32_t int_mantissa;
+	int_mantissa = (int)round(sgn * mantissa);
+	result = (exponent << 24) | (int_mantissa & 0xFFFFFF);
+
+finally:
+	if (output)
+		memcpy(output, &result, 4);
+	return result;
+}
+
+/**
+ * @brief Compare both encoders for all floats between two bit patterns
+ *
+ * @param first_bits first float bit pattern
+ * @param last_bits last float bit pattern, inclusive
+ * @return uint32_t number of values that differ
+ */
+static uint32_t compare_range(uint32_t first_bits, uint32_t last_bits)
+{
+	uint32_t errors = 0;
+	for (uint32_t bits = first_bits;; bits++)
+	{
+		float value;
+		memcpy(&value, &bits, sizeof(value));
+		uint32_t expected = float2IEEE11073_loop(value, NULL);
+		uint32_t result = float2IEEE11073(value, NULL);
+		if (expected != result)
+		{
+			if (errors < 10)
+			{
+				printf("%.9g: expected 0x%08X, got 0x%08X\n", value, expected, result);
+			}
+			errors++;
+		}
+		if (bits == last_bits)
+		{
+			break;
+		}
+	}
+	return errors;
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * Every float with 2^-8 <= |value| < 1024, that is every value the
+ * MLX90632 can deliver and the edges of the fast path
+ */
+void test_exhaustive_sensor_range(void)
+{
+	// 0x3B800000 = 2^-8, 0x447FFFFF = largest float below 1024
+	TEST_ASSERT_EQUAL_UINT32(0, compare_range(0x3B800000, 0x447FFFFF));
+	TEST_ASSERT_EQUAL_UINT32(0, compare_range(0xBB800000, 0xC47FFFFF));
+}
+
+/** Fast path limits: mantissa max, 2^23 and values near the precision limit */
+void test_fast_path_edges(void)
+{
+	const double values[] = {1.0, -1.0, 8388605.0, 8388606.0, 8388607.0, 8388608.0, 9999999.0,
+							 0.999999940395, 1.00000011921, 36.55, -36.55, 123456.789, 0.1, 1e-9, 1e30};
+	for (double value : values)
+	{
+		TEST_ASSERT_EQUAL_HEX32(float2IEEE11073_loop(value, NULL), float2IEEE11073(value, NULL));
+		TEST_ASSERT_EQUAL_HEX32(float2IEEE11073_loop((float)value, NULL), float2IEEE11073((float)value, NULL));
+	}
+}
+
+/** Doubles that are not floats take the generic path */
+void test_random_doubles(void)
+{
+	uint64_t state = 88172645463325252ULL;
+	uint32_t errors = 0;
+	for (int idx = 0; idx < 2000000; idx++)
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		// Uniform in +-1000 with all 52 mantissa bits used
+		double value = ((double)(state >> 11) / 9007199254740992.0 - 0.5) * 2000.0;
+		if (float2IEEE11073_loop(value, NULL) != float2IEEE11073(value, NULL))
+		{
+			errors++;
+		}
+	}
+	TEST_ASSERT_EQUAL_UINT32(0, errors);
+}
+
+/** Special values */
+void test_special_values(void)
+{
+	TEST_ASSERT_EQUAL_HEX32(float2IEEE11073_loop(NAN, NULL), float2IEEE11073(NAN, NULL));
+	TEST_ASSERT_EQUAL_HEX32(float2IEEE11073_loop(0.0, NULL), float2IEEE11073(0.0, NULL));
+	TEST_ASSERT_EQUAL_HEX32(float2IEEE11073_loop(-0.0, NULL), float2IEEE11073(-0.0, NULL));
+	TEST_ASSERT_EQUAL_HEX32(float2IEEE11073_loop(1e200, NULL), float2IEEE11073(1e200, NULL));
+	TEST_ASSERT_EQUAL_HEX32(float2IEEE11073_loop(-1e200, NULL), float2IEEE11073(-1e200, NULL));
+
+	uint8_t expected[4];
+	uint8_t output[4];
+	float2IEEE11073_loop(36.55f, expected);
+	float2IEEE11073(36.55f, output);
+	TEST_ASSERT_EQUAL_MEMORY(expected, output, 4);
+}
+
+/**
+ * @brief Compare two decoded values, relative to their size
+ */
+static bool same_value(double expected, double value)
+{
+	return fabs(expected - value) <= fabs(expected) * 1e-12;
+}
+
+/**
+ * Every SFLOAT mantissa of +-2045 with every exponent -8 .. 7 decodes to
+ * mantissa * 10^exponent and encodes back to the same value
+ */
+void test_sfloat_round_trip(void)
+{
+	uint32_t errors = 0;
+	for (int32_t exponent = MDER_SFLOAT_EXPONENT_MIN; exponent <= MDER_SFLOAT_EXPONENT_MAX; exponent++)
+	{
+		for (int32_t mantissa = -MDER_SFLOAT_MANTISSA_MAX; mantissa <= MDER_SFLOAT_MANTISSA_MAX; mantissa++)
+		{
+			uint16_t raw = (uint16_t)(((uint32_t)exponent << 12) | ((uint32_t)mantissa & 0x0FFF));
+			double value = IEEE11073sfloat2double(raw);
+			double expected = mantissa * pow(10.0, exponent);
+			double round_trip = IEEE11073sfloat2double(float2IEEE11073sfloat(value));
+			if (!same_value(expected, value) || !same_value(expected, round_trip))
+			{
+				if (errors < 10)
+				{
+					printf("0x%04X: expected %.10g, decoded %.10g, round trip %.10g\n", raw, expected, value, round_trip);
+				}
+				errors++;
+			}
+		}
+	}
+	TEST_ASSERT_EQUAL_UINT32(0, errors);
+}
+
+/**
+ * FLOAT mantissas around the limits and body temperatures, exponents
+ * -10 .. 10. The encoder scales by 10 per step, above 10^13 the max
+ * mantissa picks up the rounding of the repeated division.
+ */
+void test_float_round_trip(void)
+{
+	const int32_t mantissas[] = {1, -1, 9, 3655, -3655, 99999, 8388605, -8388605, 8388604, -8388604};
+	uint32_t errors = 0;
+	for (int32_t exponent = -10; exponent <= 10; exponent++)
+	{
+		for (int32_t mantissa : mantissas)
+		{
+			uint32_t raw = ((uint32_t)exponent << 24) | ((uint32_t)mantissa & 0xFFFFFF);
+			double value = IEEE11073float2double(raw);
+			double expected = mantissa * pow(10.0, exponent);
+			double round_trip = IEEE11073float2double(float2IEEE11073(value, NULL));
+			if (!same_value(expected, value) || !same_value(expected, round_trip))
+			{
+				if (errors < 10)
+				{
+					printf("0x%08X: expected %.10g, decoded %.10g, round trip %.10g\n", raw, expected, value, round_trip);
+				}
+				errors++;
+			}
+		}
+	}
+	TEST_ASSERT_EQUAL_UINT32(0, errors);
+}
+
+/**
+ * Mantissas 2046 and 2047 are the reserved +INF and NaN codes, values
+ * above the max mantissa 2045 go to the next exponent and are rounded
+ * to half a unit of that exponent
+ */
+void test_sfloat_limits(void)
+{
+	TEST_ASSERT_EQUAL_HEX32(0x07FD, float2IEEE11073sfloat(2045.0));
+	TEST_ASSERT_EQUAL_HEX32(0x0803, float2IEEE11073sfloat(-2045.0));
+	TEST_ASSERT_EQUAL_HEX32(0xF7FD, float2IEEE11073sfloat(204.5));
+	const double values[] = {2045.4, 2045.5, 2046.0, 2047.0, 2047.5, 2049.9, 204.54, 204.56, 204.6, 20460.0, 20475.0};
+	const double signs[] = {1.0, -1.0};
+	for (double value : values)
+	{
+		for (double sign : signs)
+		{
+			uint16_t raw = float2IEEE11073sfloat(sign * value);
+			TEST_ASSERT_TRUE((raw < MDER_S_POSITIVE_INFINITY) || (raw > MDER_S_NEGATIVE_INFINITY));
+			int32_t mantissa = (int32_t)((uint32_t)raw << 20) >> 20;
+			int32_t exponent = (int16_t)raw >> 12;
+			TEST_ASSERT_TRUE(abs(mantissa) <= MDER_SFLOAT_MANTISSA_MAX);
+			TEST_ASSERT_TRUE(fabs(IEEE11073sfloat2double(raw) - sign * value) <= 0.5 * pow(10.0, exponent) + 1e-9);
+		}
+	}
+	TEST_ASSERT_EQUAL_HEX32(0x10CD, float2IEEE11073sfloat(2047.0));
+	TEST_ASSERT_TRUE(IEEE11073sfloat2double(float2IEEE11073sfloat(2047.0)) == 2050.0);
+	// Largest value and the first one above it
+	TEST_ASSERT_EQUAL_HEX32(0x77FD, float2IEEE11073sfloat(MDER_SFLOAT_MAX));
+	TEST_ASSERT_EQUAL_HEX32(MDER_S_POSITIVE_INFINITY, float2IEEE11073sfloat(MDER_SFLOAT_MAX * 1.01));
+	TEST_ASSERT_EQUAL_HEX32(MDER_S_NEGATIVE_INFINITY, float2IEEE11073sfloat(MDER_SFLOAT_MIN * 1.01));
+}
+
+/** NaN, +INF, -INF and NRes in both widths */
+void test_reserved_values(void)
+{
+	TEST_ASSERT_EQUAL_HEX32(MDER_S_NaN, float2IEEE11073sfloat(NAN));
+	TEST_ASSERT_EQUAL_HEX32(MDER_S_POSITIVE_INFINITY, float2IEEE11073sfloat(INFINITY));
+	TEST_ASSERT_EQUAL_HEX32(MDER_S_NEGATIVE_INFINITY, float2IEEE11073sfloat(-INFINITY));
+	TEST_ASSERT_NAN(IEEE11073sfloat2double(MDER_S_NaN));
+	TEST_ASSERT_NAN(IEEE11073sfloat2double(MDER_S_NRes));
+	TEST_ASSERT_NAN(IEEE11073sfloat2double(MDER_S_RESERVED_VALUE));
+	TEST_ASSERT_TRUE(IEEE11073sfloat2double(MDER_S_POSITIVE_INFINITY) == INFINITY);
+	TEST_ASSERT_TRUE(IEEE11073sfloat2double(MDER_S_NEGATIVE_INFINITY) == -INFINITY);
+
+	TEST_ASSERT_EQUAL_HEX32(MDER_NaN, float2IEEE11073(NAN, NULL));
+	TEST_ASSERT_EQUAL_HEX32(MDER_POSITIVE_INFINITY, float2IEEE11073(INFINITY, NULL));
+	TEST_ASSERT_EQUAL_HEX32(MDER_NEGATIVE_INFINITY, float2IEEE11073(-INFINITY, NULL));
+	TEST_ASSERT_NAN(IEEE11073float2double(MDER_NaN));
+	TEST_ASSERT_NAN(IEEE11073float2double(MDER_NRes));
+	TEST_ASSERT_NAN(IEEE11073float2double(MDER_RESERVED_VALUE));
+	TEST_ASSERT_TRUE(IEEE11073float2double(MDER_POSITIVE_INFINITY) == INFINITY);
+	TEST_ASSERT_TRUE(IEEE11073float2double(MDER_NEGATIVE_INFINITY) == -INFINITY);
+}
+
+/** A packed buffer decodes back value by value, in both widths */
+void test_pack(void)
+{
+	const float values[] = {36.55f, -12.3f, 0.0f, 204.5f, 1234.0f, NAN, INFINITY, -INFINITY, 0.05f};
+	const size_t count = sizeof(values) / sizeof(values[0]);
+	uint8_t buffer[count * 4];
+
+	TEST_ASSERT_EQUAL_UINT32(count * 2, IEEE11073pack(values, count, buffer, true));
+	for (size_t idx = 0; idx < count; idx++)
+	{
+		uint16_t raw = buffer[idx * 2] | (buffer[idx * 2 + 1] << 8);
+		TEST_ASSERT_EQUAL_HEX32(float2IEEE11073sfloat(values[idx]), raw);
+		double value = IEEE11073sfloat2double(raw);
+		if (isnan(values[idx]))
+		{
+			TEST_ASSERT_NAN(value);
+		}
+		else if (isinf(values[idx]))
+		{
+			TEST_ASSERT_TRUE(value == values[idx]);
+		}
+		else
+		{
+			TEST_ASSERT_FLOAT_WITHIN(0.05, values[idx], value);
+		}
+	}
+
+	TEST_ASSERT_EQUAL_UINT32(count * 4, IEEE11073pack(values, count, buffer, false));
+	for (size_t idx = 0; idx < count; idx++)
+	{
+		uint32_t raw = buffer[idx * 4] | (buffer[idx * 4 + 1] << 8) | (buffer[idx * 4 + 2] << 16) | ((uint32_t)buffer[idx * 4 + 3] << 24);
+		TEST_ASSERT_EQUAL_HEX32(float2IEEE11073(values[idx], NULL), raw);
+		double value = IEEE11073float2double(raw);
+		if (isnan(values[idx]))
+		{
+			TEST_ASSERT_NAN(value);
+		}
+		else if (isinf(values[idx]))
+		{
+			TEST_ASSERT_TRUE(value == values[idx]);
+		}
+		else
+		{
+			TEST_ASSERT_FLOAT_WITHIN(0.00001, values[idx], value);
+		}
+	}
+}
+
+/**
+ * @brief Time per call of an encoder for body temperatures 30.00 .. 44.99
+ *
+ * @param encoder encoder to measure
+ * @return double ns per call
+ */
+static double time_encoder(uint32_t (*encoder)(double, uint8_t *))
+{
+	const int rounds = 200;
+	volatile uint32_t sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++)
+	{
+		for (int centi = 3000; centi < 4500; centi++)
+		{
+			sink += encoder((float)centi / 100.0f, NULL);
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+	(void)sink;
+	return std::chrono::duration<double, std::nano>(end - start).count() / (rounds * 1500);
+}
+
+void bench_encoder(void)
+{
+	double loop_ns = time_encoder(float2IEEE11073_loop);
+	double table_ns = time_encoder(float2IEEE11073);
+	char message[128];
+	snprintf(message, sizeof(message), "float2IEEE11073: loop %.1f ns, table %.1f ns per value (%.1fx)",
+			 loop_ns, table_ns, loop_ns / table_ns);
+	TEST_MESSAGE(message);
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	UNITY_BEGIN();
+	RUN_TEST(test_fast_path_edges);
+	RUN_TEST(test_special_values);
+	RUN_TEST(test_random_doubles);
+	RUN_TEST(test_sfloat_round_trip);
+	RUN_TEST(test_float_round_trip);
+	RUN_TEST(test_sfloat_limits);
+	RUN_TEST(test_reserved_values);
+	RUN_TEST(test_pack);
+	RUN_TEST(test_exhaustive_sensor_range);
+	RUN_TEST(bench_encoder);
+	return UNITY_END();
+}
@@ -0,0 +1,207 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief End to end run of the sensor simulation on the host
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * Drives the same chain as the firmware: simulated MLX90632, outlier
+ * filter, AvgStd with the stop policy and the IEEE-11073 encoding of
+ * the result. Reports the latency in simulated time and the throughput
+ * of the chain on the host for different sensor errors.
+ */
+
+#include <unity.h>
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+#include "hal.h"
+#include "ir-trace.h"
+#include "measure_policy.h"
+#include "temp_pipeline.h"
+#include "IEEE11073float.h"
+
+/** EEPROM cell with the refresh rate, see ir-sensor.cpp */
+#define EE_MEAS_1 0x24E1
+/** First and last trace sample on the forehead */
+#define PLATEAU_FIRST 17
+#define PLATEAU_LAST 56
+
+/** Result of a series of simulated measurements */
+struct sim_result_s
+{
+	/** Median time to result in simulated ms */
+	uint32_t median_latency;
+	/** Largest absolute error of the result in degree */
+	float max_error;
+	/** Samples read from the simulated sensor */
+	uint32_t samples;
+	/** Host time of the whole series in ns */
+	double host_ns;
+};
+
+/** Mean of the trace on the forehead */
+static float reference;
+
+/**
+ * @brief One measurement, sensor to encoded result
+ *
+ * @param start start of the measurement after the start of the trace in ms
+ * @param samples incremented for every sample read
+ * @param encoded receives the IEEE-11073 FLOAT of the result
+ * @return float result in degree Celsius
+ */
+static float run_measurement(uint32_t start, uint32_t &samples, uint32_t &encoded)
+{
+	static TempPipeline<OutlierStage<5>> pipeline;
+	measure_settings_s settings = MEASURE_SETTINGS_DEFAULT;
+
+	hal_native_set_millis(0);
+	hal_ir_begin();
+	hal_delay(start);
+	pipeline.reset();
+	AvgStd stats;
+	stats.reset();
+	stats.clearHistory();
+	uint16_t meas = 0;
+	hal_ir_read_register(EE_MEAS_1, meas);
+	stats.setSamplingInterval(2000 >> ((meas & 0x0700) >> 8));
+	uint32_t measure_start = hal_millis();
+	while (true)
+	{
+		temp_sample_s sample;
+		sample.object = hal_ir_object_temp();
+		sample.ambient = hal_ir_sensor_temp();
+		sample.time = hal_millis();
+		samples++;
+		time_t elapsed = hal_millis() - measure_start;
+		if (pipeline.process(sample))
+		{
+			stats.checkAndAddReading(sample.object);
+		}
+		if ((elapsed > settings.max_time) || measure_converged(stats, settings, elapsed))
+		{
+			break;
+		}
+	}
+	uint8_t packet[4];
+	encoded = float2IEEE11073(stats.getMean(), packet);
+	return stats.getMean();
+}
+
+/**
+ * @brief 200 measurements started while the sensor reaches the forehead
+ */
+static sim_result_s run_series(void)
+{
+	sim_result_s result = {0, 0.0f, 0, 0.0};
+	std::vector<uint32_t> latencies;
+	// Keeps the encoding from being optimized away
+	volatile uint32_t encoded_sum = 0;
+	auto host_start = std::chrono::steady_clock::now();
+	for (uint32_t run = 0; run < 200; run++)
+	{
+		g_ir_sim_settings.seed = run + 1;
+		uint32_t encoded = 0;
+		uint32_t start = 7500 + (run % 9) * 250;
+		float value = run_measurement(start, result.samples, encoded);
+		encoded_sum += encoded;
+		latencies.push_back(hal_millis() - start);
+		result.max_error = std::max(result.max_error, fabsf(value - reference));
+	}
+	auto host_end = std::chrono::steady_clock::now();
+	result.host_ns = std::chrono::duration<double, std::nano>(host_end - host_start).count();
+	std::sort(latencies.begin(), latencies.end());
+	result.median_latency = latencies[latencies.size() / 2];
+	return result;
+}
+
+/**
+ * @brief Print the result of a series
+ */
+static void report(const char *name, const sim_result_s &result)
+{
+	char message[200];
+	snprintf(message, sizeof(message), "%-22s latency median %5u ms, max error %.3f, %.0f samples/s on the host, %.0f ns per sample",
+			 name, (unsigned int)result.median_latency, result.max_error,
+			 result.samples * 1e9 / result.host_ns, result.host_ns / result.samples);
+	TEST_MESSAGE(message);
+}
+
+void setUp(void)
+{
+	float sum = 0;
+	for (int idx = PLATEAU_FIRST; idx <= PLATEAU_LAST; idx++)
+	{
+		sum += ir_trace_object[idx] / 100.0f;
+	}
+	reference = sum / (PLATEAU_LAST - PLATEAU_FIRST + 1);
+	g_ir_sim_settings.noise_std = 0.03;
+	g_ir_sim_settings.drift_per_min = 0.0;
+	g_ir_sim_settings.outlier_rate = 0.0;
+	g_ir_sim_settings.outlier_size = 5.0;
+	hal_ir_write_eeprom(EE_MEAS_1, 0x820D);
+}
+
+void tearDown(void)
+{
+}
+
+/** Sensor noise only */
+void test_noise(void)
+{
+	sim_result_s result = run_series();
+	report("noise 0.03", result);
+	TEST_ASSERT_TRUE(result.median_latency < 5000);
+	TEST_ASSERT_TRUE(result.max_error < 0.1f);
+}
+
+/**
+ * The outlier filter keeps 5 degree spikes out of the result, also in the
+ * first samples. Only a cluster of 3 spikes in the 5 samples of the window
+ * gets through, it breaks the median absolute deviation of the filter
+ */
+void test_outliers(void)
+{
+	g_ir_sim_settings.outlier_rate = 0.05;
+	sim_result_s result = run_series();
+	report("5% outliers", result);
+	TEST_ASSERT_TRUE(result.max_error < 0.35f);
+}
+
+/** Drift shifts the result, but the slope limit keeps the measurement running */
+void test_drift(void)
+{
+	g_ir_sim_settings.drift_per_min = 0.5;
+	sim_result_s result = run_series();
+	report("drift 0.5/min", result);
+	TEST_ASSERT_TRUE(result.max_error < 0.3f);
+}
+
+/** Latency and throughput for all sensor errors and refresh rates */
+void bench_sim(void)
+{
+	g_ir_sim_settings.noise_std = 0.1;
+	g_ir_sim_settings.outlier_rate = 0.02;
+	g_ir_sim_settings.drift_per_min = 0.2;
+	report("all errors, 2Hz", run_series());
+	// Refresh rate 3 = 4Hz
+	hal_ir_write_eeprom(EE_MEAS_1, (0x820D & ~0x0700) | (3 << 8));
+	report("all errors, 4Hz", run_series());
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	UNITY_BEGIN();
+	RUN_TEST(test_noise);
+	RUN_TEST(test_outliers);
+	RUN_TEST(test_drift);
+	RUN_TEST(bench_sim);
+	return UNITY_END();
+}
@@ -0,0 +1,261 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Block format of the measurement log
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * Writes a log like meas-log.cpp into a buffer (blocks of 512 bytes)
+ * and reads it back with the streaming reader and block by block like
+ * the replay. Reports the size per record and the encode and decode
+ * throughput on the host.
+ */
+
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include "log_format.h"
+
+/** Max size of one block, see meas-log.cpp */
+#define LOG_BLOCK_SIZE 512
+/** Records in the test log */
+#define NUM_RECORDS 2000
+
+/** Records written to the test log */
+static std::vector<log_record_s> records;
+/** Test log, blocks one after the other like in the log file */
+static std::vector<uint8_t> log_data;
+/** Start of every block in log_data */
+static std::vector<size_t> block_starts;
+
+/**
+ * @brief Generate measurements, one every 5 to 15 minutes
+ */
+static void make_records(void)
+{
+	uint32_t seed = 1;
+	uint32_t epoch = 1618617600;
+	uint32_t uptime = 0;
+	records.clear();
+	for (uint32_t idx = 0; idx < NUM_RECORDS; idx++)
+	{
+		seed = seed * 1103515245 + 12345;
+		uint32_t step = 300 + (seed >> 16) % 600;
+		epoch += step;
+		uptime += step;
+		log_record_s record;
+		record.seq = idx + 1;
+		record.epoch = idx < 10 ? 0 : epoch;
+		record.uptime = uptime;
+		record.mean = 36.0f + ((seed >> 8) % 150) / 100.0f;
+		record.std = ((seed >> 4) % 20) / 100.0f;
+		record.min = record.mean - ((seed >> 12) % 30) / 100.0f;
+		record.max = record.mean + ((seed >> 20) % 30) / 100.0f;
+		record.n = 5 + (seed >> 24) % 20;
+		record.flags = 0;
+		records.push_back(record);
+	}
+}
+
+/**
+ * @brief Write all records into log_data, a new block when a block is full
+ */
+static void write_log(void)
+{
+	uint8_t buffer[LOG_BLOCK_SIZE];
+	LogBlockWriter writer(buffer, sizeof(buffer));
+	log_data.clear();
+	block_starts.clear();
+	writer.reset();
+	for (const log_record_s &record : records)
+	{
+		if (!writer.add(record))
+		{
+			size_t len = writer.finish();
+			block_starts.push_back(log_data.size());
+			log_data.insert(log_data.end(), buffer, buffer + len);
+			writer.reset();
+			writer.add(record);
+		}
+	}
+	size_t len = writer.finish();
+	block_starts.push_back(log_data.size());
+	log_data.insert(log_data.end(), buffer, buffer + len);
+}
+
+/**
+ * @brief Read the log block by block like log_replay()
+ *
+ * @param data log
+ * @param decoded receives the records of all valid blocks
+ * @return log_read_result_e LOG_READ_END or the error of the first bad block
+ */
+static log_read_result_e read_blocks(const std::vector<uint8_t> &data, std::vector<log_record_s> &decoded)
+{
+	uint8_t block[LOG_BLOCK_SIZE];
+	log_buffer_source_s source = {data.data(), data.size(), 0};
+	size_t len;
+	log_read_result_e result;
+	decoded.clear();
+	while ((result = log_read_block(log_buffer_read, &source, block, sizeof(block), len)) == LOG_READ_RECORD)
+	{
+		log_buffer_source_s block_source = {block, len, 0};
+		LogReader reader(log_buffer_read, &block_source);
+		log_record_s record;
+		while (reader.next(record) == LOG_READ_RECORD)
+		{
+			decoded.push_back(record);
+		}
+	}
+	return result;
+}
+
+/**
+ * @brief Compare a decoded record with the original, temperatures are stored in 0.01 degree
+ */
+static void check_record(const log_record_s &expected, const log_record_s &actual)
+{
+	TEST_ASSERT_EQUAL_UINT32(expected.seq, actual.seq);
+	TEST_ASSERT_EQUAL_UINT32(expected.epoch, actual.epoch);
+	TEST_ASSERT_EQUAL_UINT32(expected.uptime, actual.uptime);
+	TEST_ASSERT_FLOAT_WITHIN(0.006f, expected.mean, actual.mean);
+	TEST_ASSERT_FLOAT_WITHIN(0.006f, expected.std, actual.std);
+	TEST_ASSERT_FLOAT_WITHIN(0.006f, expected.min, actual.min);
+	TEST_ASSERT_FLOAT_WITHIN(0.006f, expected.max, actual.max);
+	TEST_ASSERT_EQUAL_UINT32(expected.n, actual.n);
+	TEST_ASSERT_EQUAL_UINT32(expected.flags, actual.flags);
+}
+
+void setUp(void)
+{
+	make_records();
+	write_log();
+}
+
+void tearDown(void)
+{
+}
+
+/** The streaming reader returns every record and the end of the log */
+void test_round_trip(void)
+{
+	log_buffer_source_s source = {log_data.data(), log_data.size(), 0};
+	LogReader reader(log_buffer_read, &source);
+	log_record_s record;
+	for (const log_record_s &expected : records)
+	{
+		TEST_ASSERT_EQUAL_INT(LOG_READ_RECORD, reader.next(record));
+		check_record(expected, record);
+	}
+	TEST_ASSERT_EQUAL_INT(LOG_READ_END, reader.next(record));
+	TEST_ASSERT_EQUAL_UINT32(log_data.size(), reader.offset());
+}
+
+/** Reading block by block returns the same records */
+void test_blocks(void)
+{
+	std::vector<log_record_s> decoded;
+	TEST_ASSERT_TRUE(block_starts.size() > 2);
+	TEST_ASSERT_EQUAL_INT(LOG_READ_END, read_blocks(log_data, decoded));
+	TEST_ASSERT_EQUAL_UINT32(records.size(), decoded.size());
+	for (size_t idx = 0; idx < records.size(); idx++)
+	{
+		check_record(records[idx], decoded[idx]);
+	}
+}
+
+/** No record of a damaged block is returned, the blocks before it are */
+void test_bad_crc(void)
+{
+	std::vector<uint8_t> damaged = log_data;
+	// A bit in the record data of the third block
+	damaged[block_starts[2] + LOG_BLOCK_HEADER_LEN + 40] ^= 0x04;
+	std::vector<log_record_s> decoded;
+	TEST_ASSERT_EQUAL_INT(LOG_READ_BAD_CRC, read_blocks(damaged, decoded));
+	TEST_ASSERT_EQUAL_UINT32(log_data[block_starts[0] + 2] + log_data[block_starts[1] + 2], decoded.size());
+	TEST_ASSERT_EQUAL_UINT32(records[decoded.size() - 1].seq, decoded.back().seq);
+
+	// Power loss while writing the last block
+	damaged = log_data;
+	damaged.resize(damaged.size() - 3);
+	TEST_ASSERT_EQUAL_INT(LOG_READ_BAD_CRC, read_blocks(damaged, decoded));
+	TEST_ASSERT_EQUAL_UINT32(records.size() - log_data[block_starts.back() + 2], decoded.size());
+
+	// Not a log block
+	damaged = log_data;
+	damaged[block_starts[1]] = 0;
+	TEST_ASSERT_EQUAL_INT(LOG_READ_BAD_FORMAT, read_blocks(damaged, decoded));
+	TEST_ASSERT_EQUAL_UINT32(log_data[block_starts[0] + 2], decoded.size());
+}
+
+/**
+ * @brief Time per record in ns
+ *
+ * @param mode 0 = encode, 1 = streaming decode, 2 = decode block by block
+ */
+static double time_records(int mode)
+{
+	const int rounds = 50;
+	std::vector<log_record_s> decoded;
+	volatile uint32_t sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++)
+	{
+		if (mode == 0)
+		{
+			write_log();
+			sink += log_data.size();
+		}
+		else if (mode == 1)
+		{
+			log_buffer_source_s source = {log_data.data(), log_data.size(), 0};
+			LogReader reader(log_buffer_read, &source);
+			log_record_s record;
+			while (reader.next(record) == LOG_READ_RECORD)
+			{
+				sink += record.seq;
+			}
+		}
+		else
+		{
+			read_blocks(log_data, decoded);
+			sink += decoded.size();
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+	(void)sink;
+	return std::chrono::duration<double, std::nano>(end - start).count() / (rounds * NUM_RECORDS);
+}
+
+void bench_log(void)
+{
+	char message[200];
+	double per_record = (double)log_data.size() / NUM_RECORDS;
+	snprintf(message, sizeof(message), "size: %.1f bytes per record (%u raw), %u records in 8 kB, %u blocks",
+			 per_record, (unsigned int)sizeof(log_record_s), (unsigned int)(8192 / per_record),
+			 (unsigned int)block_starts.size());
+	TEST_MESSAGE(message);
+	double encode_ns = time_records(0);
+	double stream_ns = time_records(1);
+	double block_ns = time_records(2);
+	snprintf(message, sizeof(message), "encode %.1f ns, decode streaming %.1f ns, decode checked blocks %.1f ns per record",
+			 encode_ns, stream_ns, block_ns);
+	TEST_MESSAGE(message);
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	UNITY_BEGIN();
+	RUN_TEST(test_round_trip);
+	RUN_TEST(test_blocks);
+	RUN_TEST(test_bad_crc);
+	RUN_TEST(bench_log);
+	return UNITY_END();
+}
@@ -0,0 +1,255 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Stages of the processing pipeline
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * Checks every stage on its own and the composed body pipeline of
+ * main.h, then reports the time per sample of each stage on the host.
+ */
+
+#include <unity.h>
+#include <stdio.h>
+#include <math.h>
+#include <chrono>
+#include "temp_pipeline.h"
+
+/** Same composition as body_pipeline_t in main.h */
+typedef TempPipeline<OutlierStage<5>, EmissivityStage, AmbientStage, SkinToCoreStage> body_pipeline_t;
+
+/**
+ * @brief Stage that counts the samples it gets, to see where the pipeline stops
+ */
+class CountStage
+{
+public:
+	uint32_t count = 0;
+
+	void reset(void) { count = 0; }
+
+	bool process(temp_sample_s &sample)
+	{
+		(void)sample;
+		count++;
+		return true;
+	}
+};
+
+/**
+ * @brief Make a sample
+ */
+static temp_sample_s make_sample(float object, float ambient, uint32_t time)
+{
+	temp_sample_s sample;
+	sample.object = object;
+	sample.ambient = ambient;
+	sample.time = time;
+	return sample;
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/** The first samples fill the window, then spikes are dropped, also before the window is full */
+void test_outlier_spikes(void)
+{
+	OutlierStage<5> stage;
+	stage.reset();
+	const float values[] = {36.50f, 41.50f, 36.52f, 36.49f, 31.50f, 36.51f, 41.60f, 36.50f};
+	const bool passed[] = {false, false, true, true, false, true, false, true};
+	for (size_t idx = 0; idx < sizeof(values) / sizeof(values[0]); idx++)
+	{
+		temp_sample_s sample = make_sample(values[idx], 25.0f, idx * 500);
+		TEST_ASSERT_EQUAL_INT(passed[idx], stage.process(sample));
+		TEST_ASSERT_TRUE(sample.object == values[idx]);
+	}
+}
+
+/** A real step of the temperature is accepted after half the window */
+void test_outlier_step(void)
+{
+	OutlierStage<5> stage;
+	stage.reset();
+	uint32_t accepted_after = 0;
+	for (uint32_t idx = 0; idx < 20; idx++)
+	{
+		float value = idx < 10 ? 33.0f : 36.5f;
+		temp_sample_s sample = make_sample(value + (idx & 1) * 0.02f, 25.0f, idx * 500);
+		if (stage.process(sample) && (idx >= 10) && (accepted_after == 0))
+		{
+			accepted_after = idx - 10;
+		}
+	}
+	TEST_ASSERT_EQUAL_UINT32(2, accepted_after);
+
+	// The first sample is not checked with min_count 1, as for a single reading
+	stage.min_count = 1;
+	stage.reset();
+	temp_sample_s sample = make_sample(36.5f, 25.0f, 0);
+	TEST_ASSERT_TRUE(stage.process(sample));
+}
+
+/** Emissivity 1 changes nothing, a lower emissivity raises a target warmer than the sensor */
+void test_emissivity(void)
+{
+	EmissivityStage stage;
+	temp_sample_s sample = make_sample(33.0f, 25.0f, 0);
+	TEST_ASSERT_TRUE(stage.process(sample));
+	TEST_ASSERT_TRUE(sample.object == 33.0f);
+
+	stage.emissivity = 0.98f;
+	TEST_ASSERT_TRUE(stage.process(sample));
+	double measured = 33.0 + 273.15;
+	double ambient = 25.0 + 273.15;
+	double expected = pow((pow(measured, 4) - 0.02 * pow(ambient, 4)) / 0.98, 0.25) - 273.15;
+	TEST_ASSERT_FLOAT_WITHIN(0.01, expected, sample.object);
+	TEST_ASSERT_TRUE(sample.object > 33.1f);
+
+	// Target at the sensor temperature, the reflection is the same as the emission
+	sample = make_sample(25.0f, 25.0f, 0);
+	TEST_ASSERT_TRUE(stage.process(sample));
+	TEST_ASSERT_FLOAT_WITHIN(0.01, 25.0, sample.object);
+}
+
+/** Gain 0 changes nothing, with a gain the rate of the sensor temperature is subtracted */
+void test_ambient(void)
+{
+	AmbientStage stage;
+	stage.reset();
+	for (uint32_t idx = 0; idx < 10; idx++)
+	{
+		temp_sample_s sample = make_sample(36.0f, 25.0f + idx * 0.05f, idx * 500);
+		TEST_ASSERT_TRUE(stage.process(sample));
+		TEST_ASSERT_TRUE(sample.object == 36.0f);
+	}
+
+	// Sensor warms up by 0.1 degree per second
+	stage.gain = 2.0f;
+	stage.reset();
+	temp_sample_s sample;
+	for (uint32_t idx = 0; idx < 40; idx++)
+	{
+		sample = make_sample(36.0f, 25.0f + idx * 0.05f, idx * 500);
+		stage.process(sample);
+	}
+	TEST_ASSERT_FLOAT_WITHIN(0.001, 36.0 - 2.0 * 0.1, sample.object);
+
+	// The rate starts over after reset
+	stage.reset();
+	sample = make_sample(36.0f, 30.0f, 20000);
+	stage.process(sample);
+	TEST_ASSERT_TRUE(sample.object == 36.0f);
+}
+
+/** Ratio 0 changes nothing, with a ratio the core is warmer than the skin */
+void test_skin_to_core(void)
+{
+	SkinToCoreStage stage;
+	temp_sample_s sample = make_sample(34.0f, 24.0f, 0);
+	TEST_ASSERT_TRUE(stage.process(sample));
+	TEST_ASSERT_TRUE(sample.object == 34.0f);
+
+	stage.ratio = 0.15f;
+	TEST_ASSERT_TRUE(stage.process(sample));
+	TEST_ASSERT_FLOAT_WITHIN(0.0001, 34.0 + 0.15 * 10.0, sample.object);
+}
+
+/** The stages run in order, a dropped sample does not reach the later stages */
+void test_pipeline(void)
+{
+	TempPipeline<CountStage, OutlierStage<5>, CountStage> pipeline;
+	pipeline.reset();
+	const float values[] = {36.5f, 36.5f, 36.5f, 41.5f, 36.5f};
+	uint32_t passed = 0;
+	for (float value : values)
+	{
+		temp_sample_s sample = make_sample(value, 25.0f, 0);
+		passed += pipeline.process(sample) ? 1 : 0;
+	}
+	TEST_ASSERT_EQUAL_UINT32(5, pipeline.stage<0>().count);
+	TEST_ASSERT_EQUAL_UINT32(2, pipeline.stage<2>().count);
+	TEST_ASSERT_EQUAL_UINT32(2, passed);
+	pipeline.reset();
+	TEST_ASSERT_EQUAL_UINT32(0, pipeline.stage<0>().count);
+
+	// The body pipeline with the default settings passes the samples unchanged
+	body_pipeline_t body;
+	body.reset();
+	for (uint32_t idx = 0; idx < 10; idx++)
+	{
+		float value = 36.4f + (idx % 3) * 0.05f;
+		temp_sample_s sample = make_sample(value, 24.0f + idx * 0.1f, idx * 500);
+		if (body.process(sample))
+		{
+			TEST_ASSERT_TRUE(sample.object == value);
+		}
+	}
+}
+
+/**
+ * @brief Time of a stage per sample in ns
+ *
+ * @param stage stage or pipeline, reset before the run
+ */
+template <typename STAGE>
+static double time_stage(STAGE &stage)
+{
+	const uint32_t count = 2000000;
+	volatile float sink = 0;
+	stage.reset();
+	auto start = std::chrono::steady_clock::now();
+	for (uint32_t idx = 0; idx < count; idx++)
+	{
+		temp_sample_s sample = make_sample(36.0f + (idx % 7) * 0.03f, 25.0f + (idx % 11) * 0.01f, idx * 500);
+		if (stage.process(sample))
+		{
+			sink += sample.object;
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+	(void)sink;
+	return std::chrono::duration<double, std::nano>(end - start).count() / count;
+}
+
+void bench_stages(void)
+{
+	OutlierStage<5> outlier;
+	EmissivityStage emissivity;
+	emissivity.emissivity = 0.98f;
+	AmbientStage ambient;
+	ambient.gain = 1.0f;
+	SkinToCoreStage skin_to_core;
+	skin_to_core.ratio = 0.15f;
+	body_pipeline_t body;
+	body.stage<1>() = emissivity;
+	body.stage<2>() = ambient;
+	body.stage<3>() = skin_to_core;
+
+	char message[200];
+	snprintf(message, sizeof(message), "outlier %.1f ns, emissivity %.1f ns, ambient %.1f ns, skin to core %.1f ns, body pipeline %.1f ns per sample",
+			 time_stage(outlier), time_stage(emissivity), time_stage(ambient), time_stage(skin_to_core), time_stage(body));
+	TEST_MESSAGE(message);
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	UNITY_BEGIN();
+	RUN_TEST(test_outlier_spikes);
+	RUN_TEST(test_outlier_step);
+	RUN_TEST(test_emissivity);
+	RUN_TEST(test_ambient);
+	RUN_TEST(test_skin_to_core);
+	RUN_TEST(test_pipeline);
+	RUN_TEST(bench_stages);
+	return UNITY_END();
+}
@@ -0,0 +1,117 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Power states and energy ledger
+ * @version 0.1
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "power_ledger.h"
+
+/** Current model like power.cpp, only the current is used */
+static const power_state_config_s config[POWER_NUM_STATES] = {
+	{0, 244, 1636, false, 30},
+	{0, 244, 1636, false, 80},
+	{0, 244, 1636, true, 1500},
+	{4, 32, 244, true, 9000}};
+
+static PowerLedger ledger(config);
+
+void setUp(void)
+{
+	ledger.begin(1000);
+}
+
+void tearDown(void)
+{
+}
+
+/** The highest requested state is active, without requests the device advertises */
+void test_priority(void)
+{
+	TEST_ASSERT_EQUAL_INT(POWER_ADVERTISING, ledger.state());
+	TEST_ASSERT_TRUE(ledger.request(POWER_CONNECTED, true, 1000));
+	TEST_ASSERT_TRUE(ledger.request(POWER_MEASURING, true, 1000));
+	TEST_ASSERT_FALSE(ledger.request(POWER_CONNECTED, false, 1000));
+	TEST_ASSERT_EQUAL_INT(POWER_MEASURING, ledger.state());
+	TEST_ASSERT_FALSE(ledger.request(POWER_MEASURING, true, 1000));
+	TEST_ASSERT_TRUE(ledger.request(POWER_DISPLAY, true, 1000));
+	TEST_ASSERT_TRUE(ledger.request(POWER_DISPLAY, false, 1000));
+	TEST_ASSERT_EQUAL_INT(POWER_MEASURING, ledger.state());
+	TEST_ASSERT_TRUE(ledger.request(POWER_MEASURING, false, 1000));
+	TEST_ASSERT_EQUAL_INT(POWER_ADVERTISING, ledger.state());
+}
+
+/** Time and charge are booked to the state that was active */
+void test_ledger(void)
+{
+	power_ledger_s result[POWER_NUM_STATES];
+	// 60 s advertising, 10 s measuring while connected, 5 s display, 25 s connected
+	ledger.request(POWER_CONNECTED, true, 61000);
+	ledger.request(POWER_MEASURING, true, 61000);
+	ledger.request(POWER_DISPLAY, true, 71000);
+	ledger.request(POWER_MEASURING, false, 71000);
+	ledger.request(POWER_DISPLAY, false, 76000);
+	ledger.get(101000, result);
+
+	TEST_ASSERT_EQUAL_UINT32(60000, result[POWER_ADVERTISING].time_ms);
+	TEST_ASSERT_EQUAL_UINT32(25000, result[POWER_CONNECTED].time_ms);
+	TEST_ASSERT_EQUAL_UINT32(10000, result[POWER_MEASURING].time_ms);
+	TEST_ASSERT_EQUAL_UINT32(5000, result[POWER_DISPLAY].time_ms);
+	TEST_ASSERT_EQUAL_UINT32(60 * 30, result[POWER_ADVERTISING].charge_uas);
+	TEST_ASSERT_EQUAL_UINT32(25 * 80, result[POWER_CONNECTED].charge_uas);
+	TEST_ASSERT_EQUAL_UINT32(10 * 1500, result[POWER_MEASURING].charge_uas);
+	TEST_ASSERT_EQUAL_UINT32(5 * 9000, result[POWER_DISPLAY].charge_uas);
+
+	// Reading the ledger books the running state, reading again adds nothing
+	ledger.get(101000, result);
+	TEST_ASSERT_EQUAL_UINT32(25000, result[POWER_CONNECTED].time_ms);
+}
+
+/** millis() wraps after 49.7 days, the time in the state stays correct */
+void test_wrap(void)
+{
+	power_ledger_s result[POWER_NUM_STATES];
+	ledger.begin(0xFFFFF000);
+	ledger.request(POWER_DISPLAY, true, 0x00001000);
+	ledger.get(0x00002000, result);
+	TEST_ASSERT_EQUAL_UINT32(0x2000, result[POWER_ADVERTISING].time_ms);
+	TEST_ASSERT_EQUAL_UINT32(0x1000, result[POWER_DISPLAY].time_ms);
+}
+
+/** Characteristic value: state, then seconds and uAh per state */
+void test_encode(void)
+{
+	power_ledger_s result[POWER_NUM_STATES];
+	memset(result, 0, sizeof(result));
+	result[POWER_CONNECTED].time_ms = 7200999;
+	result[POWER_CONNECTED].charge_uas = 80 * 7200;
+	uint8_t data[POWER_LEDGER_LEN];
+	PowerLedger::encode(POWER_CONNECTED, result, data);
+
+	TEST_ASSERT_EQUAL_UINT32(33, sizeof(data));
+	TEST_ASSERT_EQUAL_UINT8(POWER_CONNECTED, data[0]);
+	uint32_t time_s;
+	uint32_t charge_uah;
+	memcpy(&time_s, &data[1 + POWER_CONNECTED * 8], 4);
+	memcpy(&charge_uah, &data[5 + POWER_CONNECTED * 8], 4);
+	TEST_ASSERT_EQUAL_UINT32(7200, time_s);
+	TEST_ASSERT_EQUAL_UINT32(160, charge_uah);
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	UNITY_BEGIN();
+	RUN_TEST(test_priority);
+	RUN_TEST(test_ledger);
+	RUN_TEST(test_wrap);
+	RUN_TEST(test_encode);
+	return UNITY_END();
+}